@@ -6,7 +6,8 @@
 A complete software implementation of OpenGL graphic pipeline.
 This implementation also covers every details you need to know
 about writing a software rasterizer from scratch. The whole
-pipeline also supports OpenMP accelerating, you can dynamically
+pipeline also supports multi-threaded rendering (using either a
+built-in worker thread pool or OpenMP), you can dynamically
 adjust the number of CPU cores used for rendering.
 **/
 
@@ -18,5 +19,10 @@ adjust the number of CPU cores used for rendering.
 #include "sgl_texture.h"
 #include "sgl_shader.h"
 #include "sgl_model.h"
+#include "sgl_anim.h"
+#include "sgl_scene.h"
+#include "sgl_occlusion.h"
+#include "sgl_command_buffer.h"
+#include "sgl_thread_pool.h"
 #include "sgl_pipeline.h"
 #include "sgl_pass.h"
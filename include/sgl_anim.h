@@ -0,0 +1,160 @@
+#pragma once
+#include <stdint.h>
+
+#include <atomic>
+#include <map>
+#include <memory>
+#include <shared_mutex>
+#include <vector>
+
+#include "sgl_math.h"
+#include "sgl_shader.h"
+#include "sgl_model.h"
+
+namespace sgl {
+
+/**
+A skeleton pose cache shared by many instances of the same model.
+
+* In a crowd, many instances of a model play the same animation at nearly
+the same time. Instead of evaluating the skeleton for every instance, the
+timeline is quantized into slots of `time_tolerance` seconds and the pose
+of each (model, animation, time slot) is evaluated only once, so the cost
+scales with the number of distinct poses rather than the number of 
+instances. The pose of a slot is always evaluated at the center of the
+slot, so the result does not depend on which instance computes it first.
+The pose is shared by all the meshes of the model, the bone matrices of 
+each mesh are derived from it when the mesh is drawn.
+
+* The cache is thread-safe: lookups only take a shared lock, so any number
+of threads can read it concurrently. Missing poses are computed outside
+the lock. Once the cache is full, the least recently used half of the
+poses is evicted.
+**/
+class PoseCache {
+public:
+  /* An evaluated pose of the skeleton, see Model::evaluate_pose(). */
+  typedef std::vector<Mat4x4> Pose_t;
+
+  /**
+  Get the pose of a model, evaluate it if not cached.
+  @param model: The model being drawn.
+  @param anim_id: Id of the animation being played, see
+  Model::get_animation_id().
+  @param time: Animation timeline (in sec.).
+  @return: The pose, or NULL if the animation id is invalid. The pose stays
+  valid as long as the returned pointer is held, even if it is evicted.
+  **/
+  std::shared_ptr<const Pose_t> get_pose(
+    const Model& model, const int32_t& anim_id, double time);
+  /**
+  Replacement of Model::update_skeletal_animation_for_mesh() that shares
+  the results among all the instances of the model.
+  **/
+  void update_skeletal_animation_for_mesh(
+    const Model& model, const Mesh& mesh, const int32_t& anim_id, double time,
+    Uniforms& uniforms);
+  /* Remove all the poses, must be called if a cached model is unloaded
+   * or reloaded. */
+  void clear();
+  /* Number of poses currently cached. */
+  size_t size() const;
+
+  void set_time_tolerance(double tolerance);
+  double get_time_tolerance() const { return this->time_tolerance; }
+
+  /**
+  @param time_tolerance: Instances whose time differ less than this value
+  (in sec.) may share the same pose.
+  @param max_poses: Maximum number of poses kept in the cache.
+  **/
+  PoseCache(double time_tolerance = 1.0 / 60.0, uint32_t max_poses = 1024);
+  virtual ~PoseCache() {}
+
+protected:
+  struct Key {
+    const Model* model;
+    int32_t anim_id;
+    int64_t time_slot;
+    bool operator<(const Key& k) const {
+      if (model != k.model) return model < k.model;
+      if (anim_id != k.anim_id) return anim_id < k.anim_id;
+      return time_slot < k.time_slot;
+    }
+  };
+  struct Entry {
+    std::shared_ptr<const Pose_t> pose;
+    std::atomic<uint64_t> last_used; /* updated by readers */
+  };
+  void _evict();
+
+  double time_tolerance;
+  uint32_t max_poses;
+  std::map<Key, Entry> poses;
+  std::atomic<uint64_t> clock; /* access counter for LRU eviction */
+  mutable std::shared_mutex lock;
+};
+
+/**
+A standalone CPU skinning stage shared across passes.
+
+* Skinning inside model_VS is repeated for every pass that draws the mesh
+(such as a solid pass followed by a wireframe overlay, or a shadow pass).
+This stage skins a mesh once into a cached vertex buffer, positions and 
+normals are already in model space and the bone ids are cleared, so every 
+pass can draw the buffer with model_VS as a static mesh.
+
+* The vertices are converted once into SoA streams (positions, normals, 
+bone slots and weights). Skinning then blends the 3x4 bone matrices of 
+several vertices at once using SIMD (4 vertices with AVX2, 2 with SSE2).
+
+* Results are cached per mesh and per pose (the bone matrices used), so a
+mesh drawn several times with the same pose is only skinned once. Bone 
+weights are expected to sum to 1.
+**/
+class SkinningStage {
+public:
+  /**
+  Skin the vertices of a mesh.
+  @param mesh: The mesh to be skinned.
+  @param bone_matrices: Bone matrices indexed by unique node id, such as
+  Uniforms::bone_matrices after Model::update_skeletal_animation_for_mesh().
+  @return: The skinned vertex buffer, valid until the same mesh is skinned
+  with `max_poses_per_mesh` other poses or clear() is called.
+  **/
+  const VertexBuffer_t& skin_mesh(const Mesh& mesh, const Mat4x4* bone_matrices);
+  /* Remove all the cached buffers, must be called if a cached model is 
+   * unloaded or reloaded. */
+  void clear();
+
+  SkinningStage(uint32_t max_poses_per_mesh = 4);
+  virtual ~SkinningStage() {}
+
+protected:
+  /* SoA vertex streams of a mesh, built once */
+  struct Streams {
+    uint32_t n_vertices;
+    uint32_t n_influences; /* max number of bones influencing a vertex */
+    std::vector<double> px, py, pz, nx, ny, nz;
+    /* offset of the 3x4 bone matrix in the palette */
+    std::vector<int32_t> bone_offsets[MAX_BONES_INFLUENCE_PER_VERTEX];
+    std::vector<double> bone_weights[MAX_BONES_INFLUENCE_PER_VERTEX];
+  };
+  struct SkinnedPose {
+    std::vector<double> palette; /* 3x4 bone matrices (row major) of the pose */
+    VertexBuffer_t vertices;
+    uint64_t last_used;
+  };
+  struct SkinnedMesh {
+    Streams streams;
+    std::vector<SkinnedPose> poses;
+  };
+  void _build_streams(const Mesh& mesh, Streams& streams);
+  void _skin(const Streams& streams, const double* palette, VertexBuffer_t& vertices);
+
+  std::map<const Mesh*, SkinnedMesh> meshes;
+  uint32_t max_poses_per_mesh;
+  uint64_t clock;
+};
+
+}; /* namespace sgl */
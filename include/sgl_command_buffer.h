@@ -0,0 +1,124 @@
+#pragma once
+#include <stdint.h>
+
+#include <vector>
+
+#include "sgl_math.h"
+#include "sgl_shader.h"
+
+namespace sgl {
+
+/* A draw call recorded by CommandBuffer. */
+struct DrawCommand {
+  const VertexBuffer_t *vertices; /* not owned */
+  const IndexBuffer_t   *indices; /* not owned */
+  /* index range, see Pipeline::draw(...). index_count < 0 draws the whole
+   * index buffer and shades every vertex of the vertex buffer */
+  int32_t first_index, index_count, base_vertex;
+  uint32_t  uniforms_id; /* recorded uniforms (after the uniform prologue) */
+  VS_func_t VS;
+  FS_func_t FS;
+  bool backface_culling;
+  bool depth_test;
+  bool early_depth_test;
+  bool strict_order; /* never reordered, see enable_strict_order() */
+  double depth;      /* clip space w of the model origin, used for sorting */
+};
+
+/**
+Records draw calls (shaders, uniforms, buffers & states) so that they can be
+submitted to a pipeline all at once, see Pipeline::submit(...).
+
+* Recording copies the uniforms (and runs the uniform prologue on the copy),
+so the same Uniforms object can be modified and reused for the next draw.
+Vertex & index buffers are only referenced, they must stay valid and
+unchanged until the command buffer is submitted.
+
+* On submission, draws are sorted by their states, shaders and material
+(uniforms.in_textures[0]), then from front to back, so that consecutive
+triangles in each tile share the same states and early depth test can reject
+more fragments. Draws that depend on the drawing order are never reordered:
+draws without depth test (each one overwrites the pixels drawn before it)
+and draws recorded with strict order enabled (e.g., decals that lie on
+another surface, since pixels at exactly the same depth are won by the draw
+submitted last). Other draws are only sorted between them.
+
+Usage:
+  commands.reset();
+  commands.set_shaders(VS, FS);
+  commands.draw(vertices, indices, uniforms); ...
+  pipeline.submit(commands);
+**/
+class CommandBuffer {
+public:
+  /* remove all the recorded draws, recording states are kept */
+  void reset();
+
+  /**
+  Recording states, the same as those of Pipeline. They only affect the
+  draws recorded afterwards.
+  @note: NULL shaders will be ignored.
+  **/
+  void set_shaders(VS_func_t VS, FS_func_t FS) {
+    if (VS!=NULL) recording.VS=VS;
+    if (FS!=NULL) recording.FS=FS;
+  }
+  /* NULL disables the prologue, the derived variables of the recorded 
+   * uniforms must then be filled by the caller (see 
+   * Pipeline::set_uniform_prologue()). */
+  void set_uniform_prologue(UP_func_t UP) { recording.UP = UP; }
+  void enable_backface_culling(bool state = true) { recording.backface_culling = state; }
+  void disable_backface_culling() { recording.backface_culling = false; }
+  void enable_depth_test(bool state = true) { recording.depth_test = state; }
+  void disable_depth_test() { recording.depth_test = false; }
+  void enable_early_depth_test(bool state = true) { recording.early_depth_test = state; }
+  void disable_early_depth_test() { recording.early_depth_test = false; }
+  /* keep the draws recorded afterwards in their recording order with
+   * respect to all the other draws */
+  void enable_strict_order(bool state = true) { recording.strict_order = state; }
+  void disable_strict_order() { recording.strict_order = false; }
+
+  /**
+  Record draw calls, see Pipeline::draw(...).
+  **/
+  void draw(
+    const VertexBuffer_t& vertices,
+    const IndexBuffer_t& indices,
+    const Uniforms& uniforms);
+  void draw(
+    const VertexBuffer_t& vertices,
+    const IndexBuffer_t& indices,
+    const int32_t& first_index,
+    const int32_t& index_count,
+    const int32_t& base_vertex,
+    const Uniforms& uniforms);
+
+  uint32_t get_draw_count() const { return (uint32_t)this->commands.size(); }
+  const DrawCommand& get_draw(const uint32_t& i) const { return this->commands[i]; }
+  const Uniforms& get_uniforms(const DrawCommand& command) const { return this->uniforms[command.uniforms_id]; }
+  /**
+  Get the order in which the draws should be submitted (see above).
+  @param order: Output, indices of the recorded draws.
+  **/
+  void get_submit_order(std::vector<uint32_t>& order) const;
+
+  CommandBuffer();
+  virtual ~CommandBuffer() {}
+
+protected:
+  struct {
+    VS_func_t VS;
+    FS_func_t FS;
+    UP_func_t UP;
+    bool backface_culling;
+    bool depth_test;
+    bool early_depth_test;
+    bool strict_order;
+  } recording; /* recording states */
+  std::vector<DrawCommand> commands;
+  /* recorded uniforms, the storage is kept by reset() to avoid re-allocation */
+  std::vector<Uniforms> uniforms;
+  uint32_t n_uniforms;
+};
+
+}; /* namespace sgl */
@@ -772,6 +772,19 @@ slerp(Quat q1, Quat q2, double t) {
   q.s = sclp * q1.s + sclq * end.s;
   return q;
 }
+inline Quat
+nlerp(Quat q1, Quat q2, double t) {
+  /* Normalized linear interpolation. Much cheaper than slerp (no acos/sin)
+  and close enough to it when q1 and q2 are close to each other. */
+  double sclq = (dot(q1, q2) < 0.0) ? -t : t;
+  double sclp = 1.0 - t;
+  Quat q;
+  q.x = sclp * q1.x + sclq * q2.x;
+  q.y = sclp * q1.y + sclq * q2.y;
+  q.z = sclp * q1.z + sclq * q2.z;
+  q.s = sclp * q1.s + sclq * q2.s;
+  return normalize(q);
+}
 inline Mat3x3
 quat_to_mat3x3(Quat q)
 {
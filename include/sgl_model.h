@@ -23,6 +23,16 @@ struct KeyFrame {
   double tick; 
   T value;
 };
+struct CompressedTrack {
+  /* A track of quantized key frames, see Model::compress_animations(). Only
+   * the key frames needed to reconstruct the baked samples within the error
+   * tolerance are kept. */
+  std::vector<uint16_t> sample_ids; /* baked sample index of each key frame,
+                                     * the last one is the last sample */
+  std::vector<uint16_t> values;     /* 3 quantized components per key frame */
+  Vec3 range_min;   /* position/scaling tracks are dequantized with: */
+  Vec3 range_scale; /* value = range_min + q * range_scale */
+};
 struct Animation {
   /* animation for a single bone */
   std::string name; /* name of the animation */
@@ -30,6 +40,34 @@ struct Animation {
   std::vector<KeyFrame<Vec3>> position_key_frames;
   std::vector<KeyFrame<Quat>> rotation_key_frames;
   double ticks_per_second; /* default = 25 */
+  /* key frames resampled at a fixed rate (see Model::set_animation_bake_rate()),
+   * so sampling is a direct lookup instead of a binary search. Empty if the 
+   * animation is not baked. */
+  struct {
+    double first_tick;       /* tick of the first sample */
+    double ticks_per_sample; /* interval between two samples (in ticks) */
+    std::vector<Vec3> positions;
+    std::vector<Vec3> scalings;
+    std::vector<Quat> rotations;
+  } baked;
+  /* baked samples compressed by Model::compress_animations(), the tracks
+   * are empty if the animation is not compressed. */
+  struct {
+    double first_tick;
+    double ticks_per_sample;
+    CompressedTrack positions; /* 16-bit range-quantized */
+    CompressedTrack scalings;  /* 16-bit range-quantized */
+    CompressedTrack rotations; /* 48-bit smallest-three */
+  } compressed;
+};
+struct AnimationClipInfo {
+  /* compression report of an animation clip (all the nodes it controls) */
+  std::string name;
+  size_t raw_bytes;         /* memory used by the original key frames */
+  size_t compressed_bytes;  /* memory used by the compressed tracks */
+  double max_position_error; /* max reconstruction errors at the samples */
+  double max_scaling_error;
+  double max_rotation_error; /* in radians */
 };
 enum KeyframeInterp_t {
   KeyFrameInterp_Nearest,
@@ -51,6 +89,59 @@ struct Node {
   /* skeletal animations */
   std::vector<Animation> animations;
 };
+struct SkeletonNode {
+  /* A node in the flattened node hierarchy, built once the model is loaded
+   * so that evaluating a pose does not need to walk the node tree. */
+  int32_t      parent; /* unique id of the parent node, -1 for the root */
+  Mat4x4    transform; /* node transformation matrix (bind pose) */
+  uint32_t     height; /* levels below this node (0 for leaf nodes) */
+};
+struct NodePose {
+  /* Transformation of a node relative to its parent, kept as translation,
+   * rotation & scaling so that poses can be blended without decomposing
+   * matrices. If the node is not animated, the bind pose transformation
+   * of the node is used and the other fields are left undefined. */
+  Vec3   position;
+  Quat   rotation;
+  Vec3    scaling;
+  bool   animated;
+};
+struct BoundingVolume {
+  /* bounding volumes (in model local space) */
+  Vec3 aabb_min, aabb_max; /* axis-aligned bounding box */
+  Vec3 center;             /* bounding sphere */
+  double radius;
+};
+/**
+Test if a bounding box is completely outside the view frustum.
+@param transform: Model & View & Projection matrix.
+@return: Returns true if all the corners of the box are outside the same 
+clip plane. Boxes crossing a corner of the frustum may not be detected, so
+this is conservative.
+**/
+inline bool
+is_outside_frustum(const BoundingVolume& bounds, const Mat4x4& transform)
+{
+  int outcode = 0x3f;
+  for (int i = 0; i < 8; i++) {
+    Vec3 corner(
+      (i & 1) ? bounds.aabb_max.x : bounds.aabb_min.x,
+      (i & 2) ? bounds.aabb_max.y : bounds.aabb_min.y,
+      (i & 4) ? bounds.aabb_max.z : bounds.aabb_min.z);
+    Vec4 p = mul(transform, Vec4(corner, 1.0));
+    int code = 0;
+    if (p.x > p.w)  code |= 1 << 0;
+    if (p.x < -p.w) code |= 1 << 1;
+    if (p.y > p.w)  code |= 1 << 2;
+    if (p.y < -p.w) code |= 1 << 3;
+    if (p.z > p.w)  code |= 1 << 4;
+    if (p.z < -p.w) code |= 1 << 5;
+    outcode &= code;
+    if (outcode == 0)
+      return false;
+  }
+  return true;
+}
 struct Mesh {
   /* A mesh is a unique part of a model that has only 
    * one material. A mesh can contain multiple meshes. */
@@ -65,6 +156,14 @@ struct Mesh {
   std::vector<Bone> bones;
   /* mapping bone name to its index */
   std::map<std::string, uint32_t> bone_name_to_local_id; 
+  /* unique node id of each bone (same order as `bones`) */
+  std::vector<uint32_t> bone_node_ids;
+  /* bounding volumes in bind pose */
+  BoundingVolume bounds;
+  /* bounding volumes of the animated mesh over a whole clip, padded to 
+   * cover the motion between the sampled poses, indexed by the animation 
+   * id (see Model::get_animation_id()) */
+  std::vector<BoundingVolume> anim_bounds;
 };
 struct Material {
   /* each mesh part will only uses one material. */
@@ -143,6 +242,12 @@ public:
 
   NOTE: If the model is in bind pose (default T-pose), then we will
         have: T0*T1*T2 = Q^-1, which means S is the identity matrix.
+
+  NOTE: The products T0*T1*T2 of all the nodes (the pose) only depend on
+        the animation and the time, not on the mesh. This function 
+        evaluates the whole pose on each call, so when drawing several
+        meshes of a model, evaluate the pose once with evaluate_pose()
+        and use update_bone_matrices_for_mesh() for each mesh instead.
   **/
   void update_skeletal_animation_for_mesh(
     const Mesh& mesh,             /* the mesh being drawn */
@@ -152,10 +257,104 @@ public:
     /* NOTE: a single draw call only renders a single mesh onto screen,
     so if a model contains N meshes, it will need N draw calls to fully
     render the whole model, with i-th draw call renders the i-th mesh. */
-  );
+  ) const;
+  /* the same as above, but the animation is given by its id (see 
+   * get_animation_id()), so no string lookup is needed per frame. */
+  void update_skeletal_animation_for_mesh(
+    const Mesh& mesh, const int32_t& anim_id, double time, Uniforms& uniforms) const;
+  /* get the id of an animation, returns -1 if not found. */
+  int32_t get_animation_id(const std::string& anim_name) const;
+  /* number of animations, animation ids are within [0, count) */
+  uint32_t get_animation_count() const { return (uint32_t)this->anim_channels.size(); }
+  /* length of an animation (in sec.) */
+  double get_animation_duration(const int32_t& anim_id) const;
+  /**
+  Get the bounding volumes of the model or one of its meshes.
+  @param anim_id: Id of the animation being played. If the id is invalid,
+  bounding volumes of the bind pose are returned.
+  **/
+  const BoundingVolume& get_bounds(const int32_t& anim_id = -1) const;
+  const BoundingVolume& get_mesh_bounds(const Mesh& mesh, const int32_t& anim_id = -1) const;
+  /* number of bone matrices used by a mesh (largest bone id + 1), 0 if the
+   * mesh has no bones, see InstanceData::bone_count */
+  int32_t get_mesh_bone_count(const Mesh& mesh) const;
+  /**
+  Evaluate the pose of the whole skeleton.
+  @param anim_id: Id of the animation being played, see get_animation_id().
+  @param time: Animation timeline (in sec.).
+  @param pose: Output, the accumulated transformation (T0*T1*...*Ti) of each
+  node, indexed by the unique node id.
+  @param culled_levels: (Optional) Animation level of detail, the outermost 
+  `culled_levels` levels of the hierarchy (nodes whose height is less than 
+  this value, such as finger bones) are not animated and rigidly follow 
+  their parents in bind pose.
+  **/
+  void evaluate_pose(const int32_t& anim_id, double time, std::vector<Mat4x4>& pose,
+    const uint32_t culled_levels = 0) const;
+  /**
+  Evaluate the pose of the whole skeleton relative to the parent of each 
+  node, see evaluate_pose() for the parameters. Unlike the accumulated pose,
+  the local pose can be blended with blend_local_poses().
+  @param local_pose: Output, the transformation of each node relative to its
+  parent, indexed by the unique node id.
+  **/
+  void evaluate_local_pose(const int32_t& anim_id, double time, 
+    std::vector<NodePose>& local_pose, const uint32_t culled_levels = 0) const;
+  /* accumulate a local pose from parent to child (T0*T1*...*Ti), the
+   * output is the same as evaluate_pose() */
+  void compose_pose(const std::vector<NodePose>& local_pose, std::vector<Mat4x4>& pose) const;
+  /**
+  Blend two local poses of the skeleton. Translation, rotation & scaling of
+  each node are interpolated separately (nlerp for the rotation) before the
+  nodes are accumulated from parent to child, so that the bones keep their
+  length and shape (unlike blending the accumulated matrices directly).
+  @param local_pose0, local_pose1: Poses to blend, see evaluate_local_pose().
+  @param weight: Blending weight, 0 gives local_pose0 and 1 gives local_pose1.
+  @param pose: Output, the blended and accumulated pose.
+  @note: Nodes animated in only one of the poses are not blended, the 
+  transformation of the nearest pose is used.
+  **/
+  void blend_local_poses(const std::vector<NodePose>& local_pose0, 
+    const std::vector<NodePose>& local_pose1, double weight, std::vector<Mat4x4>& pose) const;
+  /**
+  Write the final bone transformations of a mesh into uniform variables.
+  @param pose: Pose of the skeleton, see evaluate_pose().
+  **/
+  void update_bone_matrices_for_mesh(
+    const Mesh& mesh, const std::vector<Mat4x4>& pose, Uniforms& uniforms) const;
+  /* the same as above, but writes the first min(pose.size(), 
+   * MAX_NODES_PER_MODEL) bone matrices into `bone_matrices`. */
+  void update_bone_matrices_for_mesh(
+    const Mesh& mesh, const std::vector<Mat4x4>& pose, Mat4x4* bone_matrices) const;
   void set_keyframe_interp_mode(const KeyframeInterp_t interp) {
     this->keyframe_interp_mode = interp;
   }
+  /**
+  Resample all the animations at a fixed rate when the model is loaded, so 
+  that sampling an animation only needs direct indexing and a nlerp instead 
+  of a binary search and a slerp for each track.
+  @param sample_rate: Samples per second (such as 30 or 60), or 0 to disable
+  baking (default). Takes effect immediately if a model is already loaded.
+  @note: Baked animations are only used by linear interpolation, nearest
+  interpolation always samples the original key frames.
+  **/
+  void set_animation_bake_rate(double sample_rate);
+  /**
+  Compress all the baked animations: rotations are stored as 48-bit 
+  smallest-three quaternions, positions and scalings are quantized to 16 bits
+  within the range of each track, and key frames that can be linearly 
+  reconstructed within the error tolerance are dropped.
+  @param position_tolerance: Max error allowed for positions and scalings.
+  @param rotation_tolerance: Max error allowed for rotations (in radians).
+  @return: Compression report of each animation clip, indexed by the 
+  animation id.
+  @note: Animations must be baked first (see set_animation_bake_rate()).
+  The compression is lossy, and the original key frames and baked samples 
+  are released after compression, so nearest interpolation then picks the
+  previous compressed key frame.
+  **/
+  std::vector<AnimationClipInfo> compress_animations(
+    double position_tolerance = 1e-3, double rotation_tolerance = 1e-3);
 
   /* ctor & dtor that we don't even care about much. */
   Model();
@@ -176,27 +375,39 @@ protected:
   Node* root_node;
   /* key frame interpolation modes (nearest, linear, ...) */
   KeyframeInterp_t keyframe_interp_mode;
+  /* animation resampling rate (in Hz), 0 if disabled */
+  double anim_bake_rate;
+  /* flattened node hierarchy, indexed by the unique node id. Node ids are
+   * assigned in pre-order, so a parent always comes before its children. */
+  std::vector<SkeletonNode> skeleton;
+  /* animation channels, anim_channels[anim_id][node_id] is the animation of
+   * the node, or NULL if the node is not animated. */
+  std::vector<std::vector<const Animation*>> anim_channels;
+  /* bounding volumes of the whole model (bind pose & each animation) */
+  BoundingVolume bounds;
+  std::vector<BoundingVolume> anim_bounds;
 
 private:
   /* utility functions for loading the model */
   void _parse_and_copy_node(Node* node, aiNode* ai_node);
   void _delete_node(Node* node);
+  uint32_t _build_skeleton(const Node* node);
+  void _compute_bounds();
+  void _bake_node_animations(Node* node, double sample_rate);
+  void _compress_node_animations(Node* node, double position_tolerance, 
+    double rotation_tolerance, std::vector<AnimationClipInfo>& clips);
 
   /* animation related utility functions */
   void _register_vertex_weight(Vertex& v, uint32_t bone_ID, double weight);
   Node* _find_node_by_name(const std::string& node_name);
   Animation* _find_node_animation_by_name(Node& node, const std::string & anim_name);
-  void _update_mesh_skeletal_animation_from_node(
-    const Node* node,               /* current node being traversed */
-    const Mat4x4& parent_transform, /* accumulated parent node transformation matrix */
-    const Mesh& mesh,               /* mesh that contains all the bones */
-    const uint32_t& anim_id,        /* id of the animation currently being played */
-    double time,                    /* elapsed time since the start of the animation (sec.) */
-    Uniforms& uniforms              /* uniform variables that will be written to */
-  );
   Mat4x4 _interpolate_skeletal_animation(
     const Animation& anim, const double tick, const KeyframeInterp_t interp
-  );
+  ) const;
+  void _sample_skeletal_animation(
+    const Animation& anim, const double tick, const KeyframeInterp_t interp,
+    Vec3& position, Quat& rotation, Vec3& scaling
+  ) const;
 
   /* utility functions for mesh debugging */
   void _dump_mesh(const Mesh& mesh);
@@ -229,6 +440,15 @@ void model_VS(
   const Vertex& vertex_in,
   Vertex_gl& vertex_out
 );
+/* instanced version of model_VS, bone ids of the vertices are offset by 
+ * the bone offset of the instance (see Pipeline::draw_instanced()), the bone
+ * count of the instance should be Model::get_mesh_bone_count(mesh). */
+void model_instanced_VS(
+  const Uniforms& uniforms,
+  const InstanceData& instance,
+  const Vertex& vertex_in,
+  Vertex_gl& vertex_out
+);
 void model_FS(
   const Uniforms& uniforms,
   const Fragment_gl& fragment_in,
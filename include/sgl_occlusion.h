@@ -0,0 +1,77 @@
+#pragma once
+#include <stdint.h>
+
+#include <vector>
+
+#include "sgl_math.h"
+#include "sgl_shader.h"
+#include "sgl_model.h"
+
+namespace sgl {
+
+/**
+Software occlusion culling with a low resolution occluder depth buffer.
+
+* Large static meshes that hide other objects (walls, terrain, buildings)
+are rasterized as occluders into a small depth-only buffer (256x128 by
+default) before drawing. The bounding box of each object is then tested
+against this buffer, and if every pixel it covers already holds a nearer
+occluder, the object is skipped before any vertex processing happens.
+
+* The buffer is conservative, so an object is never culled by mistake:
+an occluder only writes the pixels it covers completely, and it writes the
+farthest depth of the triangle within each pixel. Triangles crossing the
+near plane are skipped (they can only make the culling less effective).
+The rasterizer evaluates the edge functions of several pixels at once
+using SIMD (8 pixels with AVX2, 4 with SSE2).
+
+* Occluders are drawn in their bind pose, so they should be static.
+Depth is stored as NDC z (-1 at the near plane, +1 at the far plane).
+
+Usage:
+  occlusion.begin(view_projection);
+  occlusion.add_occluder(wall_model, wall_transform); ...
+  if (!occlusion.is_occluded(model.get_bounds(), model_view_projection)) ...
+**/
+class OcclusionBuffer {
+public:
+  /* clear the buffer and set the camera of the occluders added next */
+  void begin(const Mat4x4& view_projection);
+  /**
+  Rasterize an occluder.
+  @param vertices, indices: Triangle list, only the positions are used.
+  @param transform: Model transform of the occluder (local to world).
+  **/
+  void add_occluder(const VertexBuffer_t& vertices, const IndexBuffer_t& indices,
+    const Mat4x4& transform);
+  /* rasterize all the meshes of a model as occluders */
+  void add_occluder(const Model& model, const Mat4x4& transform);
+  /**
+  Test if a bounding box is completely hidden by the occluders.
+  @param bounds: Local space bounding volume (only the box is used).
+  @param model_view_projection: Transform from the local space of the box
+  to clip space, using the view & projection given in begin().
+  @return: Returns true if the box is hidden. Boxes crossing the near
+  plane or completely outside the screen are never reported as hidden.
+  **/
+  bool is_occluded(const BoundingVolume& bounds, const Mat4x4& model_view_projection) const;
+
+  int32_t get_width() const { return this->w; }
+  int32_t get_height() const { return this->h; }
+  /* depth of a pixel, +1 if no occluder covers it */
+  float get_depth(int32_t x, int32_t y) const { return this->depth[y * this->stride + x]; }
+
+  OcclusionBuffer(int32_t w = 256, int32_t h = 128);
+  virtual ~OcclusionBuffer() {}
+
+protected:
+  void _rasterize_triangle(const Vec4& v0, const Vec4& v1, const Vec4& v2);
+
+  int32_t w, h;
+  int32_t stride; /* row length rounded up to the SIMD width */
+  std::vector<float> depth;
+  Mat4x4 view_projection;
+  std::vector<Vec4> clip_vertices; /* scratch buffer of add_occluder() */
+};
+
+}; /* namespace sgl */
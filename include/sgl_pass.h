@@ -1,6 +1,9 @@
 #pragma once
 
 #include "sgl_pipeline.h"
+#include "sgl_anim.h"
+#include "sgl_scene.h"
+#include "sgl_occlusion.h"
 
 namespace sgl {
 
@@ -71,12 +74,103 @@ public:
   Model*          model; /* a pointer to model object that is being drawn */
   std::string anim_name; /* name of the current animation being played */
   double           time; /* time value for controlling the skeletal animation (in sec.) */
+  PoseCache* pose_cache; /* (optional) poses shared with other passes drawing the same model */
+  SkinningStage* skinning; /* (optional) skin meshes once and share the results with other passes */
+  bool frustum_culling; /* skip the model/meshes outside the view frustum (default: true) */
+  /* (optional) skip the model/meshes hidden by occluders, the occluders 
+   * must be added with the view & projection of this pass beforehand */
+  OcclusionBuffer* occlusion;
+  /* (optional) record the draw calls into this command buffer and submit
+   * them all at once at the end of run() (see Pipeline::submit()), the
+   * recorded draws use the states of the command buffer. The skinning stage
+   * is not used while recording (its buffers may be reused before the 
+   * submission), meshes are skinned by the vertex shader instead. */
+  CommandBuffer* commands;
+  /* Animation level of detail. A distant model is animated at a reduced
+   * update rate and without its outermost bones (see Model::evaluate_pose()),
+   * level L animates with the outermost L-1 levels of the hierarchy culled.
+   * The reduced poses are cached by the pass and shared by all the instances
+   * drawn at the same update, `pose_cache` is only used at full detail. */
+  struct {
+    bool       enabled; /* disabled by default */
+    double    distance; /* eye distance where level 1 starts, each further level starts at twice the distance */
+    uint32_t max_level; /* the coarsest level */
+    double update_rate; /* pose updates per second at level 1, halved at each further level */
+    bool   interpolate; /* blend the two nearest updated poses instead of holding the last one */
+  } anim_lod;
 
 public:
-  void run(bool clear = true);
+  virtual void run(bool clear = true);
+  /* animation LOD level (0 = full detail) of the model seen from the eye */
+  uint32_t get_anim_lod_level() const;
+  uint32_t get_anim_lod_level(const Mat4x4& model_transform) const;
 
   BasicAnimPass();
   virtual ~BasicAnimPass() {}
+
+protected:
+  /* pose of the model being drawn, shared by all its meshes */
+  std::vector<Mat4x4> anim_pose;
+  /* poses evaluated at the reduced update rate, `sample` is the index of the
+   * update (time / period), the period only depends on the culled levels */
+  struct AnimLODKey {
+    const Model* model;
+    int32_t anim_id;
+    uint32_t culled_levels;
+    int64_t sample;
+    bool operator<(const AnimLODKey& k) const {
+      if (model != k.model) return model < k.model;
+      if (anim_id != k.anim_id) return anim_id < k.anim_id;
+      if (culled_levels != k.culled_levels) return culled_levels < k.culled_levels;
+      return sample < k.sample;
+    }
+  };
+  struct AnimLODPose {
+    std::vector<NodePose> local_pose; /* relative to the parents, for blending */
+    std::vector<Mat4x4> pose;         /* accumulated, only filled when held */
+    uint64_t last_used;               /* the last run() using this pose */
+  };
+  std::map<AnimLODKey, AnimLODPose> lod_poses;
+  std::vector<Mat4x4> lod_blended_pose;
+  uint64_t run_count;
+  const std::vector<Mat4x4>& _evaluate_lod_pose(
+    const Model& model, int32_t anim_id, uint32_t lod_level, double period, double time);
+  AnimLODPose& _find_lod_pose(
+    const Model& model, int32_t anim_id, uint32_t culled_levels, double period, int64_t sample);
+  /* set shaders & render targets and the camera uniforms */
+  void _begin(bool clear);
+  /* draw all the meshes of a model, _begin() must be called first */
+  void _draw_model(Model& model, const Mat4x4& transform, int32_t anim_id, double time);
+  /* submit the recorded draw calls if any */
+  void _end();
+};
+
+/**
+Draw all the model instances of a scene that intersect the view frustum.
+* The visible instances are found by the BVH of the scene, then each one
+  is drawn like in BasicAnimPass (with mesh culling, animation LOD, etc.)
+  using its own transform, animation and time. The `model`, `anim_name`
+  and `time` members of BasicAnimPass are ignored.
+* If `occlusion` is set, the buffer is filled with the visible occluder
+  instances (see Scene::set_occluder()) before drawing.
+* If `commands` is set, the meshes of all the visible instances are 
+  submitted together, so that many small instances are rasterized in a few
+  combined passes instead of one pass per mesh.
+**/
+class ScenePass : public BasicAnimPass {
+public:
+  Scene* scene; /* the scene to be drawn */
+
+public:
+  void run(bool clear = true);
+  /* number of instances drawn by the last run() */
+  uint32_t get_visible_count() const { return (uint32_t)this->visible.size(); }
+
+  ScenePass();
+  virtual ~ScenePass() {}
+
+protected:
+  std::vector<uint32_t> visible;
 };
 
 }; /* namespace sgl */
\ No newline at end of file
@@ -9,25 +9,218 @@
 #include "sgl_texture.h"
 #include "sgl_utils.h"
 #include "sgl_model.h"
+#include "sgl_thread_pool.h"
+#include "sgl_command_buffer.h"
 
 namespace sgl {
 
+/* Render targets are split into square tiles of RASTER_TILE_SIZE x 
+ * RASTER_TILE_SIZE pixels, each tile is rasterized by only one thread. */
+const int RASTER_TILE_SIZE = 32;
+/* Tiles are further split into blocks of RASTER_BLOCK_SIZE x RASTER_BLOCK_SIZE
+ * pixels, the coverage of a whole block is determined at once.
+ * NOTE: this value cannot be changed (coverage mask is 64-bit). */
+const int RASTER_BLOCK_SIZE = 8;
+/* Window coordinates are snapped to fixed point with SUBPIXEL_BITS fractional
+ * bits (1/16 pixel) in triangle setup, coverage is then tested using integer
+ * arithmetic only. */
+const int SUBPIXEL_BITS = 4;
+/* Attributes interpolated in rasterization stage. They are all linear in
+ * window space, so each of them is described by a plane equation. */
+const int INTERP_Z = 0;        /* window space depth (gl_FragCoord.z) */
+const int INTERP_INV_W = 1;    /* 1/w (gl_FragCoord.w) */
+const int INTERP_VARYINGS = 2; /* varyings divided by w, see pack_varyings() */
+const int NUM_INTERPOLANTS = INTERP_VARYINGS + NUM_VARYINGS;
+/* Number of vertices processed by a single task in vertex processing stage. */
+const int VERTEX_CHUNK_SIZE = 256;
+/* Number of triangles processed by a single task in vertex post-processing 
+ * and triangle setup stages. */
+const int PRIMITIVE_CHUNK_SIZE = 128;
+/* Instanced draw calls are split into batches of about this many triangles,
+ * so the post-transform vertices & triangle setups of a batch stay in cache
+ * while it is rasterized. */
+const int INSTANCE_BATCH_TRIANGLES = 8192;
+/* Draw calls submitted from a command buffer are combined into passes of at
+ * least this many triangles (unless fewer are left), see Pipeline::submit(). */
+const int SUBMIT_BATCH_TRIANGLES = 8192;
+/* Clip planes in homogeneous space, also used as outcode bits. A vertex is
+ * outside a plane if its outcode has the corresponding bit set. */
+const int CLIP_POS_X = 1 << 0; /* x <= +w */
+const int CLIP_NEG_X = 1 << 1; /* x >= -w */
+const int CLIP_POS_Y = 1 << 2; /* y <= +w */
+const int CLIP_NEG_Y = 1 << 3; /* y >= -w */
+const int CLIP_POS_Z = 1 << 4; /* z <= +w */
+const int CLIP_NEG_Z = 1 << 5; /* z >= -w */
+const int NUM_CLIP_PLANES = 6;
+/* Maximum number of vertices of a triangle clipped by all the clip planes,
+ * each plane adds at most one vertex to a convex polygon. */
+const int MAX_CLIP_VERTICES = 3 + NUM_CLIP_PLANES;
+/* Largest width & height (in pixels) of a triangle that can be rasterized 
+ * without overflow. Edge functions of blocks crossed by an edge are evaluated
+ * in 32-bit lanes, and are bounded by 4*(RASTER_BLOCK_SIZE-1)*extent in units
+ * of 2^(-2*SUBPIXEL_BITS). Limits the guard band, see set_guard_band(). */
+const int MAX_RASTER_EXTENT = 
+  (1 << (31 - 2 * SUBPIXEL_BITS)) / (4 * (RASTER_BLOCK_SIZE - 1));
+
+/* Marks a vertex index of Triangle_gl that refers to a vertex generated by 
+ * clipping, before it is moved into the post-transform vertex array. */
+const uint32_t CLIPPED_VERTEX_BIT = uint32_t(1) << 31;
+
 /**
 Internal class that is used in primitive assembly stage.
 Users do not need to care about it too much since it is just an simple
 aggregation of vertices that represent an assembled primitive.
+@note: Vertices are referenced by their indices in the post-transform vertex
+array (ppl.Vertices) instead of being copied, since a vertex of an indexed 
+mesh is usually shared by several triangles. Vertices generated by clipping 
+are appended to the end of the array.
 **/
 class Triangle_gl {
 public:
-  Vertex_gl v[3];
+  uint32_t v[3];
 
 public:
   Triangle_gl() {}
-  Triangle_gl(const Vertex_gl &v1, const Vertex_gl &v2, const Vertex_gl &v3) {
+  Triangle_gl(const uint32_t &v1, const uint32_t &v2, const uint32_t &v3) {
     this->v[0] = v1, this->v[1] = v2, this->v[2] = v3;
   }
 };
 
+/**
+Internal class that is used in vertex post-processing stage. Triangles are
+assembled & clipped in chunks, each chunk is processed by a single task.
+**/
+class PrimitiveChunk_gl {
+public:
+  const int32_t *indices; /* 3 indices per triangle */
+  int32_t base_vertex;    /* added to each index */
+  int32_t n_triangles;    /* at most PRIMITIVE_CHUNK_SIZE */
+};
+
+/**
+Internal class that describes a draw call of a combined pass (see 
+Pipeline::submit()). The vertices, index ranges & triangles of all the draw
+calls in a pass are stored one after another in submission order.
+**/
+class DrawCall_gl {
+public:
+  const DrawCommand *command;
+  const Uniforms *uniforms;
+  /* vertices to be shaded: ppl.DrawFetchVertices[first_fetch, first_fetch +
+  n_vertices) of the vertex buffer, or the whole vertex buffer if -1 */
+  int first_fetch;
+  int first_vertex, n_vertices;    /* outputs in ppl.Vertices */
+  /* indices of the draw call (relative to its first output vertex):
+  command->indices[first_index, first_index + n_indices), or the same range
+  of ppl.DrawIndices if first_fetch >= 0 */
+  int first_index, n_indices;
+  int first_task;                  /* first vertex processing task */
+  int first_chunk;                 /* first primitive chunk */
+  int first_triangle, n_triangles; /* ppl.Triangles after post-processing */
+};
+
+/**
+Internal class that is used in triangle setup stage.
+Each assembled triangle is set up only once per draw call (perspective divide,
+window transform, bounding rectangle, edge & attribute plane equations), the 
+result is then shared by all the tiles that the triangle overlaps.
+**/
+class TriangleSetup_gl {
+public:
+  /* plane equations of the interpolants (see INTERP_*), the value at window 
+  coordinate (x, y) is f0[k] + dfdx[k]*x + dfdy[k]*y. */
+  double f0[NUM_INTERPOLANTS], dfdx[NUM_INTERPOLANTS], dfdy[NUM_INTERPOLANTS];
+  /* fixed-point edge equations w_i(X, Y) = edge_a[i]*X + edge_b[i]*Y + edge_c[i]
+  for edges v1-v2, v2-v0, v0-v1, where (X, Y) is the fixed-point window 
+  coordinate. The signs are flipped for clockwise triangles, and 
+  edge_c[i] is biased by -1 if the edge is not a top-left edge, so a pixel is 
+  covered if and only if all w_i >= 0. */
+  int64_t edge_a[3], edge_b[3], edge_c[3];
+  IVec4 bounds;   /* pixel bounds (x_min, y_min, x_max, y_max), inclusive,
+                     empty (x_min > x_max) if the triangle is culled */
+  double z_min;   /* minimum window space depth of the vertices */
+  int32_t instance_id; /* gl_InstanceID of the first vertex */
+};
+
+/* Coverage of a block of RASTER_BLOCK_SIZE^2 pixels, generated by the 
+rasterizer. Bit (y*RASTER_BLOCK_SIZE+x) of the mask is set if pixel 
+(block_x+x, block_y+y) is covered. */
+struct BlockCoverage_gl {
+  int x, y;      /* lower-left pixel of the block */
+  uint64_t mask; /* coverage mask */
+};
+
+/**
+Storage of the window space depth z (in [0, +1]) in each depth format. 
+Unsigned normalized formats are rounded to the nearest representable value.
+**/
+template <PixelFormat Format> struct DepthStorage {};
+template <> struct DepthStorage<PixelFormat::pixel_format_float64> {
+  typedef double type;
+  static type encode(const double &z) { return z; }
+  static double decode(const type &d) { return d; }
+};
+template <> struct DepthStorage<PixelFormat::pixel_format_float32> {
+  typedef float type;
+  static type encode(const double &z) { return float(z); }
+  static double decode(const type &d) { return double(d); }
+};
+template <> struct DepthStorage<PixelFormat::pixel_format_depth24> {
+  typedef uint32_t type;
+  static type encode(const double &z) { return uint32_t(z * 16777215.0 + 0.5); }
+  static double decode(const type &d) { return double(d) * (1.0 / 16777215.0); }
+};
+template <> struct DepthStorage<PixelFormat::pixel_format_depth16> {
+  typedef uint16_t type;
+  static type encode(const double &z) { return uint16_t(z * 65535.0 + 0.5); }
+  static double decode(const type &d) { return double(d) * (1.0 / 65535.0); }
+};
+
+/**
+Depth buffer access for a given depth format.
+@param Reversed: Store 1-z instead of z (reverse-Z). Floating point numbers 
+are denser near zero, so this keeps more precision for far away surfaces when 
+using pixel_format_float32, where the perspective projection compresses depth
+the most.
+**/
+template <PixelFormat Format, bool Reversed = false>
+struct DepthBuffer {
+  typedef typename DepthStorage<Format>::type type;
+  static const PixelFormat format = Format;
+  static const bool reversed = Reversed;
+  static type encode(const double &z) { 
+    return DepthStorage<Format>::encode(Reversed ? 1.0 - z : z); 
+  }
+  static double decode(const type &d) {
+    double z = DepthStorage<Format>::decode(d);
+    return Reversed ? 1.0 - z : z;
+  }
+  /* if stored depth a is behind stored depth b */
+  static bool is_behind(const type &a, const type &b) {
+    return Reversed ? (a < b) : (a > b);
+  }
+};
+
+/**
+Pipeline states fixed at compile time, see SpecializedPipeline.
+@note: The generic Pipeline also uses these states internally, they are
+selected at runtime once per tile.
+**/
+template <bool DepthTest = true, bool BackfaceCulling = true, 
+          PixelFormat ColorFormat = PixelFormat::pixel_format_BGRA8888,
+          bool EarlyDepthTest = false,
+          PixelFormat DepthFormat = PixelFormat::pixel_format_float64,
+          bool ReverseDepth = false>
+struct PipelineState {
+  static const bool depth_test = DepthTest;
+  static const bool backface_culling = BackfaceCulling;
+  static const PixelFormat color_format = ColorFormat;
+  static const bool early_depth_test = EarlyDepthTest; /* see enable_early_depth_test() */
+  static const PixelFormat depth_format = DepthFormat;
+  static const bool reverse_depth = ReverseDepth; /* see enable_reverse_depth() */
+  typedef DepthBuffer<DepthFormat, ReverseDepth> depth_buffer;
+};
+
 class Pipeline {
  public:
   /**
@@ -52,6 +245,28 @@ class Pipeline {
     if (FS!=NULL) shaders.FS=FS;
   }
   /**
+  Set the uniform prologue, which is called once per draw call (see UP_func_t).
+  By default it is default_UP(...), which fills the derived uniforms used by 
+  the default shaders.
+  @note: NULL value disables the prologue, uniforms are then given to the 
+  shaders as is. The derived variables of Uniforms (view_projection, 
+  model_view_projection, normal_matrix) must then be filled by the caller
+  before each draw call, since the default shaders (default_VS, model_VS, 
+  ...) read them instead of the original matrices.
+  **/
+  void set_uniform_prologue(UP_func_t UP) {
+    shaders.UP = UP;
+  }
+  /**
+  Set the vertex shader used by instanced draw calls (see draw_instanced()),
+  by default it is default_instanced_VS(...). The fragment shader is the one
+  set by set_shaders(...).
+  @note: NULL value will be ignored.
+  **/
+  void set_instanced_vertex_shader(VS_instanced_func_t VS) {
+    if (VS!=NULL) shaders.VS_instanced=VS;
+  }
+  /**
   Set render targets (color & depth textures).
   @note: NULL value will be ignored.
   **/
@@ -80,6 +295,55 @@ class Pipeline {
     ppl.do_depth_test = false;
   }
   /**
+  Enable/disable early depth test. If enabled, the depth test is done before
+  running the fragment shader, and hidden blocks & triangles are rejected 
+  before rasterization using a hierarchical depth buffer (see ppl.HiZ).
+  @note: Only enable this if the fragment shader does not modify 
+  `gl_FragDepth`, any depth written by the shader is ignored. Discarding 
+  fragments is allowed.
+  **/
+  void enable_early_depth_test(bool state = true) {
+    ppl.early_depth_test = state;
+  }
+  void disable_early_depth_test() {
+    ppl.early_depth_test = false;
+  }
+  /**
+  Rebuild the hierarchical depth buffer before the next draw call. 
+  @note: The hierarchical depth buffer is automatically updated when drawing
+  and when clearing the depth target through this pipeline. Only call this 
+  if the depth texture is modified in other ways (e.g., cleared by another 
+  pipeline, or written directly).
+  **/
+  void invalidate_depth_hierarchy() {
+    ppl.hiz_valid = false;
+  }
+  /**
+  Enable/disable reverse-Z, the depth target stores 1-z instead of z (see
+  DepthBuffer). Only affects how depth is stored, the depth test and 
+  `gl_FragDepth` still use window space depth z.
+  @note: The depth target must be cleared after changing this state.
+  **/
+  void enable_reverse_depth(bool state = true) {
+    ppl.reverse_depth = state;
+  }
+  void disable_reverse_depth() {
+    ppl.reverse_depth = false;
+  }
+  /**
+  Set the size of the guard band. Triangles crossing the left, right, bottom or
+  top side of the render target are not clipped as long as they stay inside
+  the guard band, pixels outside the render target are simply skipped by the 
+  rasterizer (scissoring). Only the near & far planes always need clipping.
+  @param size: Number of pixels the guard band extends beyond each side of the
+  render target. 0 means clipping against the render target exactly. The size
+  is limited so that any triangle inside the guard band is no larger than 
+  MAX_RASTER_EXTENT, it is MAX_RASTER_EXTENT (as large as possible) by default.
+  **/
+  void set_guard_band(const int &size) {
+    ppl.guard_band = max(size, 0);
+  }
+  /**
   Buffer manipulations.
   **/
   int32_t create_index_buffer();
@@ -104,6 +368,85 @@ class Pipeline {
     const int32_t& ibo,
     const Uniforms& uniforms
   );
+  /** 
+  Render a range of triangles onto target textures.
+  @param vertices: Vertex buffer object.
+  @param indices: Index buffer object.
+  @param first_index: Index of the first element used in `indices`.
+  @param index_count: Number of elements used in `indices` (3 per triangle).
+  @param base_vertex: Value added to each element of `indices` before fetching
+    the vertex from `vertices`.
+  @param uniforms: Uniform variables used by vertex and
+    fragment shaders.
+  @note: Only the vertices referenced by the range are shaded (each of them 
+  exactly once). Prefer this over draw(vertices, indices, uniforms) if the
+  index buffer only uses a small part of the vertex buffer (e.g., a sub-mesh 
+  in a shared vertex buffer, or a mesh with reduced LOD indices).
+  **/
+  virtual void draw(
+    const VertexBuffer_t& vertices,
+    const IndexBuffer_t& indices,
+    const int32_t& first_index,
+    const int32_t& index_count,
+    const int32_t& base_vertex,
+    const Uniforms& uniforms);
+  virtual void draw(
+    const int32_t& vbo,
+    const int32_t& ibo,
+    const int32_t& first_index,
+    const int32_t& index_count,
+    const int32_t& base_vertex,
+    const Uniforms& uniforms
+  );
+  /** 
+  Render several instances of a mesh in a single draw call.
+  @param vertices: Vertex buffer object.
+  @param indices: Index buffer object.
+  @param uniforms: Uniform variables shared by all the instances.
+  @param instances: Per-instance variables, `instance_count` elements. Their
+    derived variables are filled by the pipeline.
+  @param instance_count: Number of instances.
+  @note: Each vertex is shaded once per instance by the instanced vertex 
+  shader (see set_instanced_vertex_shader()), which receives the variables
+  of the instance. The fragment shader can find them with 
+  `uniforms.instances[fragment_in.gl_InstanceID]`.
+  @note: Compared with one draw call per instance, the uniform prologue is 
+  only run once, and instances are drawn in batches of about 
+  INSTANCE_BATCH_TRIANGLES triangles: the vertices of all the instances in a
+  batch are shaded in a single parallel job and all their triangles are 
+  binned & rasterized together. Instances are drawn in order, so the result
+  is the same as drawing them one by one.
+  **/
+  virtual void draw_instanced(
+    const VertexBuffer_t& vertices,
+    const IndexBuffer_t& indices,
+    const Uniforms& uniforms,
+    const InstanceData* instances,
+    const int32_t& instance_count);
+  virtual void draw_instanced(
+    const int32_t& vbo,
+    const int32_t& ibo,
+    const Uniforms& uniforms,
+    const InstanceData* instances,
+    const int32_t& instance_count
+  );
+  /* number of instances skipped by the last instanced draw call because
+   * their bones do not fit in Uniforms::bone_matrices (see InstanceData) */
+  int get_skipped_instance_count() const { return ppl.SkippedInstances; }
+  /**
+  Render all the draw calls recorded in a command buffer onto target textures.
+  @param commands: The recorded draw calls, each one is drawn with its own
+    shaders, uniforms & states instead of those set to the pipeline.
+  @note: Draws are submitted in the order given by 
+  CommandBuffer::get_submit_order(...), and are combined into passes of 
+  about SUBMIT_BATCH_TRIANGLES triangles. Each pass shades the vertices of all
+  its draws in a single parallel job, assembles, clips, sets up & bins all 
+  their triangles together, then rasterizes every tile only once: the 
+  triangles binned into a tile are still rasterized in submission order, 
+  switching states & shaders between the runs of triangles of each draw.
+  The result is the same as drawing them one by one in that order.
+  **/
+  virtual void submit(const CommandBuffer& commands);
 
  public:
   /**
@@ -113,6 +456,15 @@ class Pipeline {
   void set_num_threads(const int& num_threads) {
     ppl.num_threads = num_threads;
   }
+  /**
+  Set the thread pool used by the pipeline (only used if the pipeline is not
+  built with the OpenMP backend). By default all pipelines share the same
+  pool returned by ThreadPool::get_default().
+  @note: NULL value will be ignored. The pool is not owned by the pipeline.
+  **/
+  void set_thread_pool(ThreadPool* pool) {
+    if (pool != NULL) ppl.thread_pool = pool;
+  }
 
  protected:
   /**
@@ -124,15 +476,72 @@ class Pipeline {
   **/
   void vertex_processing(const VertexBuffer_t &vertex_buffer,
                          const Uniforms &uniforms);
+  template <typename VS>
+  void vertex_processing(const VertexBuffer_t &vertex_buffer,
+                         const Uniforms &uniforms, const VS &vertex_shader);
+  /**
+  Stage I (indexed draw calls): Vertex fetch.
+  Walk through the index range and collect the vertices it references into 
+  this->ppl.FetchVertices (in order of their first appearance), and remap the
+  range into this->ppl.FetchIndices, which indexes the fetched vertices.
+  @param vertex_buffer, index_buffer, first_index, index_count, base_vertex: 
+  See draw(...).
+  @return: false if the range or any referenced vertex is out of bounds.
+  **/
+  bool vertex_fetch(const VertexBuffer_t &vertex_buffer, 
+                    const IndexBuffer_t &index_buffer, const int &first_index,
+                    const int &index_count, const int &base_vertex);
+  /**
+  Run the vertex shader on the vertices collected by vertex_fetch(...) only,
+  outputs are stored into this->ppl.Vertices in the same order.
+  **/
+  template <typename VS>
+  void vertex_processing_fetched(const VertexBuffer_t &vertex_buffer,
+                                 const Uniforms &uniforms, const VS &vertex_shader);
+  /**
+  Stage I (instanced draw calls): Run the instanced vertex shader on every 
+  vertex of the instances [first_instance, first_instance + instance_count)
+  of uniforms.instances, the outputs of instance first_instance + i are 
+  stored into this->ppl.Vertices[i * n_verts, (i + 1) * n_verts).
+  **/
+  void vertex_processing_instanced(const VertexBuffer_t &vertex_buffer,
+                                   const Uniforms &uniforms, const int &first_instance,
+                                   const int &instance_count);
+  /* number of instances drawn together, see INSTANCE_BATCH_TRIANGLES */
+  int get_instance_batch_size(const IndexBuffer_t &index_buffer, const int &instance_count);
+  /**
+  Stage I (combined passes): Fetch the vertices of all the draw calls in 
+  this->ppl.Draws, and run the vertex shader of each draw call on its 
+  vertices, all in a single parallel job.
+  **/
+  void vertex_processing_draws();
 
   /**
   Stage II: Vertex Post-processing.
   @param index_buffer: The index buffer object that will tell us how the mesh is
   formed by using the vertex array.
   @note: After running post-processing, this->ppl.Triangles will be initialized
-  properly and ready for the next step.
+  properly and ready for the next step, new vertices generated by clipping are
+  appended to this->ppl.Vertices.
+  @note: Triangles are assembled & clipped in chunks of PRIMITIVE_CHUNK_SIZE
+  concurrently, each chunk writes to its own buffers and all buffers are then 
+  concatenated in chunk order, so the order of the output triangles (and the
+  clipped vertices) is always the same as in single-threaded mode.
   **/
   void vertex_post_processing(const std::vector<int> &index_buffer);
+  /**
+  Stage II (combined passes): the same as above for all the draw calls in 
+  this->ppl.Draws. Chunks never contain triangles of two draw calls, so 
+  the output triangles of each draw call are still contiguous, their range
+  is stored into the draw call.
+  **/
+  void vertex_post_processing_draws();
+  /**
+  Assemble & clip the triangles of this->ppl.PrimitiveChunks concurrently, 
+  and concatenate the outputs in chunk order. The output triangles of chunk
+  i start at this->ppl.ChunkOffsets[i].
+  **/
+  void assemble_and_clip_chunks();
 
   /**
   Stage III: Fragment Processing.
@@ -140,82 +549,201 @@ class Pipeline {
   @param num_threads: The number of concurrent threads used for rasterization.
   @note: "MT" stands for "multi-threaded" version. 
          * If running in MT mode, OpenMP must be enabled.
+         * Both versions set up & bin triangles first, then rasterize the 
+           render target tile by tile. In MT mode tiles are distributed among
+           threads, so each pixel is always owned by exactly one thread.
   **/
   void fragment_processing(const Uniforms &uniforms);
   void fragment_processing_MT(const Uniforms &uniforms, const int &num_threads);
 
+  /**
+  Stage III-a: Triangle setup & binning.
+  @note: Converts every triangle in this->ppl.Triangles into window space 
+  (stored into this->ppl.Setups) concurrently, then appends its index into the
+  bin of each tile it overlaps. Bins keep the submission order of the triangles.
+  @param draws: Draw calls of a combined pass, triangles are culled using the
+  states of their own draw call. NULL if drawing with the pipeline states.
+  **/
+  void triangle_setup_and_binning(const std::vector<DrawCall_gl> *draws = NULL);
+  /**
+  Set up a single triangle.
+  @param triangle: Input triangle, vertices are in homogeneous clip space.
+  @param setup: Output triangle in window space.
+  @param backface_culling: Cull the triangle if it is back facing.
+  **/
+  void setup_triangle(const Triangle_gl &triangle, TriangleSetup_gl &setup,
+                      const bool &backface_culling);
+  /**
+  Build the hierarchical depth buffer (ppl.HiZ) for the current depth target
+  if early depth test is used and the buffer is not up to date.
+  **/
+  void prepare_depth_hierarchy();
+  /* the same as above, regardless of the pipeline states */
+  void update_depth_hierarchy();
+  /**
+  Get the maximum depth of a block of RASTER_BLOCK_SIZE^2 pixels in the depth
+  target, pixels outside the target are ignored.
+  @param x, y: Lower-left pixel of the block.
+  **/
+  double get_depth_block_max(const int &x, const int &y);
+  template <class DepthBuffer_t>
+  double get_depth_block_max(const int &x, const int &y);
+  /**
+  Stage III-b: Rasterize all the triangles binned into a single tile.
+  @param tile_id: Tile index (row major, origin at the lower-left corner).
+  @param uniforms: The uniform variables given to the pipeline.
+  @note: Shaders are called through function pointers, pipeline states are 
+  dispatched once per tile to the template version below.
+  **/
+  void rasterize_tile(const int &tile_id, const Uniforms &uniforms);
+  /**
+  Rasterize the triangles ppl.TileBins[tile_id][i_bin_start, i_bin_end) 
+  using the given shader & states instead of the pipeline ones.
+  **/
+  void rasterize_tile_range(const int &tile_id, const Uniforms &uniforms, 
+                            const FS_func_t &FS, const bool &depth_test,
+                            const bool &early_depth_test, const int &i_bin_start,
+                            const int &i_bin_end);
+  template <bool DepthTest, bool EarlyDepthTest, PixelFormat ColorFormat>
+  void rasterize_tile_dispatch_depth(const int &tile_id, const Uniforms &uniforms,
+                                     const FS_func_t &FS, const int &i_bin_start,
+                                     const int &i_bin_end);
+  /* rasterize the triangles of ppl.TileBins[tile_id][i_bin_start, i_bin_end), 
+  the whole bin if i_bin_end < 0 */
+  template <class State, typename FS>
+  void rasterize_tile(const int &tile_id, const Uniforms &uniforms, 
+                      const FS &fragment_shader, const int &i_bin_start = 0,
+                      const int &i_bin_end = -1);
+  /**
+  Stage III-b (combined passes): Rasterize all the triangles binned into a 
+  single tile, each run of consecutive triangles of the same draw call in 
+  ppl.Draws is rasterized with the shader, uniforms & states of the draw call.
+  **/
+  void rasterize_tile_draws(const int &tile_id);
+  /**
+  Compute the coverage of a triangle inside a tile.
+  @param setup: The triangle to be rasterized.
+  @param tile_x, tile_y: Lower-left pixel of the tile.
+  @param blocks: Output covered blocks, at most (RASTER_TILE_SIZE / 
+  RASTER_BLOCK_SIZE)^2 elements, in bottom-to-top, left-to-right order.
+  @return: Number of blocks with at least one pixel covered.
+  @note: Each tile is traversed in blocks of RASTER_BLOCK_SIZE^2 pixels. Blocks
+  completely outside the triangle are rejected by testing only the block 
+  corners, blocks completely inside are accepted without any per-pixel test, 
+  the coverage mask of the remaining blocks is computed using SIMD.
+  @note: Pixels on an edge shared by two triangles are only covered by one of
+  them (top-left fill rule), so each pixel is shaded only once per mesh.
+  **/
+  int rasterize_blocks(const TriangleSetup_gl &setup, const int &tile_x, 
+                       const int &tile_y, BlockCoverage_gl *blocks);
+  /**
+  Rasterize all the triangles binned into a single tile, and call 
+  pixel_func(x, y, f, instance_id) for each covered pixel, where f holds the
+  interpolants evaluated at the pixel center (see INTERP_*) and instance_id
+  is the gl_InstanceID of the triangle. The interpolants are stepped
+  incrementally along each row of a block.
+  @param State: Pipeline states, if both depth test and early depth test are
+  enabled, triangles & blocks that are completely behind the depth target are
+  rejected (using ppl.HiZ), and ppl.HiZ is kept updated.
+  @param i_bin_start, i_bin_end: Only rasterize the triangles 
+  ppl.TileBins[tile_id][i_bin_start, i_bin_end), the whole bin if 
+  i_bin_end < 0.
+  @note: This is a template so that the per-pixel work can be inlined into the
+  raster loop.
+  **/
+  template <class State, typename PixelFunc>
+  void traverse_tile(const int &tile_id, const PixelFunc &pixel_func, 
+                     const int &i_bin_start = 0, const int &i_bin_end = -1);
+  /**
+  Shade & output a single covered pixel.
+  @param x, y: Pixel location in window space.
+  @param f: Interpolants evaluated at the pixel center (see INTERP_*).
+  @param instance_id: gl_InstanceID of the triangle.
+  @param uniforms: The uniform variables given to the pipeline.
+  @param fragment_shader: Fragment shader, a function pointer (FS_func_t) or a
+  functor with the same signature.
+  @param State: Pipeline states, see PipelineState.
+  **/
+  template <class State, typename FS>
+  void shade_pixel(const int &x, const int &y, const double *f, const int &instance_id,
+                   const Uniforms &uniforms, const FS &fragment_shader);
+
  protected:
   /**
   Clip triangle in homogeneous space.
   @note: Assume each vertex has homogeneous coordinate (x,y,z,w), then clip
   points outside -w <= x, y, z <= +w.
-  @param triangle_in: Input triangle in homogeneous space.
-  @param triangles_out: Output triangle(s) in homogeneous space.
+  @note: The outcodes of the three vertices are computed first. Triangles 
+  completely inside the clip volume are accepted and triangles completely 
+  outside any clip plane (or any side of the render target) are rejected 
+  without clipping. The x & y clip planes are moved to the boundary of the
+  guard band, see set_guard_band(). The remaining ones are clipped as a 
+  polygon only against the planes they cross (see clip_polygon), and the 
+  resulting polygon is triangulated as a fan. All the intermediate vertices 
+  are kept on the stack.
+  @param triangle_in: Input triangle, vertices are in homogeneous space.
+  @param triangles_out: Output triangle(s), appended to the end of the array.
+  @param vertices_out: New vertices generated by clipping, appended to the end
+  of the array. Output triangles refer to them by (CLIPPED_VERTEX_BIT | i), 
+  where i is the index in `vertices_out`.
   **/
   void clip_triangle(const Triangle_gl &triangle_in,
-                     std::vector<Triangle_gl> &triangles_out);
+                     std::vector<Triangle_gl> &triangles_out,
+                     std::vector<Vertex_gl> &vertices_out);
   /**
-  Clip triangle (`v1`-`v2`-`v3`) in homogeneous space.
-  Assume each vertex has homogeneous coordinate (x,y,z,w), then clip
-  points outside -w <= x, y, z <= +w.
+  Clip a convex polygon against a single clip plane (Sutherland-Hodgman).
   @note: For detailed explanation of how to do clipping in homogeneous space,
   see: "How to clip in homogeneous space?" in "doc/graphics_pipeline.md".
-  @param v1, v2, v3: Input triangle vertices in homogeneous space.
-  @param clip_axis: Clip axis (0=x, 1=y, 2=z).
-  @param clip_sign: Clip sign (+1 or -1). +1 means clipping using +w, -1 means
-  clipping using -w.
-  @param q1, q2, q3, q4: Output triangle vertices.
-    - If one triangle is produced, then (`q1`-`q2`-`q3`) represents the new
-  triangle.
-    - If two triangles are produced, then (`q1`-`q2`-`q3`) represents the first
-  triangle, (`q1`-`q3`-`q4`) represents the second triangle.
-  @param n_tri: Number of triangle(s) produced after clipping. Can be 0, 1, or 
-  2 depending on different cases. If 0 is returned, then triangle is completely
-  discarded.
-  **/
-  void clip_triangle(const Vertex_gl &v1, const Vertex_gl &v2,
-                     const Vertex_gl &v3, const int clip_axis,
-                     const int clip_sign, Vertex_gl &q1, Vertex_gl &q2,
-                     Vertex_gl &q3, Vertex_gl &q4, int &n_tri);
-  /**
-  Clip segment A-B in homogeneous space. This is an auxiliary function for
-  clip_triangle(...).
-  @param A, B: Point A(Ax,Ay,Az,Aw) and B(Bx,By,Bz,Bw) in homogeneous space.
-  @param clip_axis, clip_sign: The same with clip_triangle(...).
-  @param t: Output interpolation weight between A (when t=0) and B (when t=1).
-  The intersection point C can be caluclated as follows: C = (1-t)A + tB;
-  **/
-  void clip_segment(const Vertex_gl &A, const Vertex_gl &B, 
-                    const int clip_axis, const int clip_sign, double &t) {
-    double A_i = A.gl_Position.i[clip_axis], A_w = A.gl_Position.w;
-    double B_i = B.gl_Position.i[clip_axis], B_w = B.gl_Position.w;
-    double S1, S2;
-    if (clip_sign == +1) {
-      S1 = A_i - A_w;
-      S2 = B_i - B_w;
-    } else {
-      S1 = A_i + A_w;
-      S2 = B_i + B_w;
-    }
-    t = (S1) / (S1 - S2);
+  @param polygon_in: Input polygon vertices in homogeneous space.
+  @param n_in: Number of input vertices, at most MAX_CLIP_VERTICES.
+  @param plane: Clip plane index, the outcode bit of the plane is (1 << plane).
+  @param polygon_out: Output polygon vertices, must be able to hold 
+  MAX_CLIP_VERTICES vertices. The vertex order (and the winding) is kept.
+  @param ids_in, ids_out: Vertex indices of the input & output polygon, 
+  vertices kept by the clipper keep their indices, new vertices are marked as
+  CLIPPED_VERTEX_BIT.
+  @return: Number of output vertices, the polygon is completely clipped away if
+  less than 3 vertices are returned.
+  **/
+  int clip_polygon(const Vertex_gl *polygon_in, const uint32_t *ids_in,
+                   const int n_in, const int plane, Vertex_gl *polygon_out,
+                   uint32_t *ids_out);
+  /**
+  Signed distance of a point to a clip plane in homogeneous space, the point 
+  is inside the plane if the distance is non-negative.
+  @param p: Point (x,y,z,w) in homogeneous space.
+  @param plane: Clip plane index, see CLIP_*.
+  **/
+  double get_clip_distance(const Vec4 &p, const int plane) const {
+    const int axis = plane >> 1;
+    const double w = (axis == 0) ? ppl.clip_extent_x * p.w : 
+                     (axis == 1) ? ppl.clip_extent_y * p.w : p.w;
+    return (plane & 1) ? w + p.i[axis] : w - p.i[axis];
   }
   /**
-  Get minimum rectangle in screen space that completely covers the whole triangle.
-  @param p0, p1, p2: Window space coordinate (x,y,z,1/w), where (x,y) is the
-  relative pixel location, z is the mapped NDC depth (see glFragDepth()), w is
-  the real depth value in view space.
-  @return: Minimum rectangle (x_s, y_s, x_e, y_e) that contains the triangle.
+  Get the outcode of a point in homogeneous space.
+  @note: Points lying on a clip plane are inside the plane, so we don't need
+  to clip them.
+  @param extent_x, extent_y: The x & y clip planes are at +/-extent_x*w and 
+  +/-extent_y*w.
+  @return: Bitwise OR of CLIP_* of all the planes that the point is outside.
   **/
-  Vec4 get_minimum_rect(const Vec4 &p0, const Vec4 &p1, const Vec4 &p2) {
-    Vec2 bl, tr;
-    bl.x = min(min(p0.x, p1.x), p2.x);
-    bl.y = min(min(p0.y, p1.y), p2.y);
-    tr.x = max(max(p0.x, p1.x), p2.x);
-    tr.y = max(max(p0.y, p1.y), p2.y);
-    return Vec4(bl.x, bl.y, tr.x, tr.y);
+  static int get_outcode(const Vec4 &p, const double &extent_x = 1.0, 
+                         const double &extent_y = 1.0) {
+    const double wx = extent_x * p.w, wy = extent_y * p.w;
+    int outcode = 0;
+    if (p.x > wx)   outcode |= CLIP_POS_X;
+    if (p.x < -wx)  outcode |= CLIP_NEG_X;
+    if (p.y > wy)   outcode |= CLIP_POS_Y;
+    if (p.y < -wy)  outcode |= CLIP_NEG_Y;
+    if (p.z > p.w)  outcode |= CLIP_POS_Z;
+    if (p.z < -p.w) outcode |= CLIP_NEG_Z;
+    return outcode;
   }
   /**
   Edge function. Determine which side the point p is at w.r.t. edge p0-p1.
+  @note: Coverage is tested with the fixed-point version of this function,
+  see TriangleSetup_gl.
   **/
   double edge(const Vec4 &p0, const Vec4 &p1, const Vec4 &p) {
     return (p0.y - p1.y) * p.x + (p1.x - p0.x) * p.y +
@@ -254,6 +782,34 @@ class Pipeline {
   @param z: Depth value in window space [0, +1], 0/1: near/far.
   **/
   void write_render_targets(const Vec2 &p, const Vec4 &color, const double &z);
+  /**
+  Write final color data into targeted textures (rasterizer version).
+  @param x, y: Window coordinate, must be inside the render targets.
+  @param color, z: The same with write_render_targets(...).
+  @param DepthTest: Do depth test & write depth.
+  @param State: Pipeline states, known at compile time so no branch is needed.
+  **/
+  template <bool DepthTest, class State>
+  void write_pixel(const int &x, const int &y, const Vec4 &color, const double &z);
+  /**
+  Run tasks [0, n_tasks) concurrently and wait for all of them to finish.
+  @param n_tasks: Number of tasks, task(i) is called once for each i.
+  @param num_threads: Maximum number of threads, non-positive values mean 
+  using this->ppl.num_threads.
+  @note: Depending on the build configuration, either the worker thread pool
+  (default) or OpenMP (if PARALLEL_BACKEND_OPENMP is defined) is used.
+  **/
+  template <typename Func>
+  void parallel_for(const int &n_tasks, const Func &task, int num_threads = 0) {
+    if (num_threads <= 0) num_threads = ppl.num_threads;
+#if defined(PARALLEL_BACKEND_OPENMP)
+#pragma omp parallel for num_threads(num_threads) schedule(dynamic, 1)
+    for (int task_id = 0; task_id < n_tasks; task_id++)
+      task(task_id);
+#else
+    ppl.thread_pool->run(n_tasks, task, num_threads);
+#endif
+  }
 
  protected:
 
@@ -262,11 +818,45 @@ class Pipeline {
     Texture *depth; /* not owned */
   } targets; /* render targets */
   struct {
-    std::vector<Vertex_gl> Vertices; /* vertices after vertex processing */
+    std::vector<Vertex_gl> Vertices; /* vertices after vertex processing, followed by vertices generated by clipping */
+    std::vector<int32_t> FetchVertices; /* vertex buffer indices of the vertices referenced by an indexed draw call */
+    IndexBuffer_t FetchIndices; /* index range of an indexed draw call, remapped to FetchVertices */
+    std::vector<int32_t> VertexRemap; /* vertex buffer index -> FetchVertices index, -1 if not fetched */
+    Uniforms uniforms; /* uniforms of the current draw call after running the uniform prologue */
+    std::vector<InstanceData> Instances; /* instances of the current instanced draw call (with derived variables) */
+    int SkippedInstances; /* instances of the last instanced draw call skipped by run_instanced_prologue() */
+    IndexBuffer_t InstanceIndices; /* index buffer of an instanced draw call, repeated for each instance */
     std::vector<Triangle_gl> Triangles; /* geometry generated after vertex post-processing */
+    std::vector<PrimitiveChunk_gl> PrimitiveChunks; /* tasks of vertex post-processing */
+    std::vector<uint32_t> ChunkOffsets; /* first output triangle of each chunk (+ the total number) */
+    std::vector<std::vector<Triangle_gl>> ChunkTriangles; /* per-chunk outputs of vertex post-processing */
+    std::vector<std::vector<Vertex_gl>> ChunkVertices; /* per-chunk vertices generated by clipping */
+    std::vector<TriangleSetup_gl> Setups; /* triangles after setup, same order as `Triangles` */
+    std::vector<std::vector<uint32_t>> TileBins; /* triangle setup indices binned for each tile */
+    std::vector<uint32_t> DrawOrder; /* submission order of the draw calls in a command buffer */
+    std::vector<DrawCall_gl> Draws; /* draw calls of the current combined pass */
+    std::vector<int32_t> DrawFetchVertices; /* FetchVertices of the ranged draw calls in `Draws` */
+    IndexBuffer_t DrawIndices; /* FetchIndices of the ranged draw calls in `Draws` */
+    int num_tiles_x, num_tiles_y; /* number of tiles covering the color target */
     int num_threads; /* number of cpu cores used when running the pipeline */
+    ThreadPool *thread_pool; /* worker threads used when running the pipeline (not owned) */
     bool backface_culling; /* enable/disable backface culling when rendering */
     bool do_depth_test; /* enable/disable depth test when rendering */
+    bool early_depth_test; /* do depth test before running fragment shader */
+    bool reverse_depth; /* store 1-z in the depth target */
+    int guard_band; /* guard band size (in pixels) set by the user */
+    /* x & y clip planes used in the current draw call are at +/-clip_extent_x*w
+    and +/-clip_extent_y*w (1.0 if guard band is not used) */
+    double clip_extent_x, clip_extent_y;
+    /* hierarchical depth buffer, maximum depth of each RASTER_BLOCK_SIZE^2
+    block of the depth target (row major, origin at the lower-left corner, 
+    hiz_w x hiz_h blocks). Since depth values can only decrease when depth 
+    test is enabled, an outdated HiZ is still conservative unless the depth
+    target is cleared. */
+    std::vector<double> HiZ;
+    int hiz_w, hiz_h;
+    Texture *hiz_depth; /* depth target that HiZ is built from */
+    bool hiz_valid;
   } ppl; /* pipeline internal states and variables */
   struct {
     std::vector<VertexBuffer_t> VertexBuffers;
@@ -275,7 +865,41 @@ class Pipeline {
   struct {
     VS_func_t VS;
     FS_func_t FS;
+    UP_func_t UP;
+    VS_instanced_func_t VS_instanced;
   } shaders; /* shaders used by the pipeline */
+  /**
+  Run the uniform prologue (if any) on a copy of the uniforms.
+  @return: The uniforms that should be used by the shaders in this draw call,
+  valid until the next draw call.
+  **/
+  const Uniforms &run_uniform_prologue(const Uniforms &uniforms);
+  /**
+  Run the uniform prologue of an instanced draw call, and copy the instances
+  with their derived variables into this->ppl.Instances. Instances whose
+  bones do not fit in Uniforms::bone_matrices (see InstanceData::bone_count)
+  are skipped and counted in ppl.SkippedInstances, the number of instances to
+  draw is ppl.Instances.size().
+  @return: The same as run_uniform_prologue(...), `instances` is set.
+  **/
+  const Uniforms &run_instanced_prologue(const Uniforms &uniforms, 
+    const InstanceData *instances, const int &instance_count);
+  /**
+  Repeat the index buffer for each instance into this->ppl.InstanceIndices, 
+  the indices of instance i are offset by i * n_verts (see 
+  vertex_processing_instanced()).
+  **/
+  void repeat_instance_indices(const IndexBuffer_t &index_buffer, const int &n_verts,
+    const int &instance_count);
+  /* draw the draw calls in this->ppl.Draws in a combined pass */
+  void draw_combined();
+  /**
+  Submit a command buffer by calling draw(...) for each recorded draw call,
+  used by pipelines that cannot combine draw calls.
+  @note: ranged draw calls go through the ranged draw(...) overload, so a
+  derived pipeline must override both overloads.
+  **/
+  void submit_sequential(const CommandBuffer &commands);
 
   void _zero_init();
 
@@ -290,6 +914,7 @@ public:
   void set_wireframe_color(const Vec3& color) { wppl.wire_color = color; }
   /* wireframe pipeline only support single-threaded rendering but default draw()
   implementation is multi-threaded, so we need to rewrite it. */
+  using Pipeline::draw;
   virtual void draw(
     const std::vector<Vertex>& vertices,
     const std::vector<int32_t>& indices,
@@ -299,9 +924,41 @@ public:
     const int32_t& ibo,
     const Uniforms& uniforms
   );
+  virtual void draw(
+    const VertexBuffer_t& vertices,
+    const IndexBuffer_t& indices,
+    const int32_t& first_index,
+    const int32_t& index_count,
+    const int32_t& base_vertex,
+    const Uniforms& uniforms);
+  virtual void draw(
+    const int32_t& vbo,
+    const int32_t& ibo,
+    const int32_t& first_index,
+    const int32_t& index_count,
+    const int32_t& base_vertex,
+    const Uniforms& uniforms
+  );
+  virtual void draw_instanced(
+    const VertexBuffer_t& vertices,
+    const IndexBuffer_t& indices,
+    const Uniforms& uniforms,
+    const InstanceData* instances,
+    const int32_t& instance_count);
+  virtual void draw_instanced(
+    const int32_t& vbo,
+    const int32_t& ibo,
+    const Uniforms& uniforms,
+    const InstanceData* instances,
+    const int32_t& instance_count
+  );
+  /* draw calls (ranged ones included) are drawn one by one as lines */
+  virtual void submit(const CommandBuffer& commands);
 
 public:
-  WireframePipeline() {};
+  /* lines are traversed pixel by pixel without scissoring, so triangles are 
+  always clipped to the render target. */
+  WireframePipeline() { set_guard_band(0); };
   virtual ~WireframePipeline() {};
 
 protected:
@@ -323,5 +980,412 @@ protected:
   } wppl;
 };
 
+/**
+Wrap a shader function into a functor type, so that it can be given to 
+SpecializedPipeline as a template argument.
+**/
+template <VS_func_t VS_func>
+struct VertexShader {
+  void operator()(const Uniforms &uniforms, const Vertex &vertex_in, 
+                  Vertex_gl &vertex_out) const {
+    VS_func(uniforms, vertex_in, vertex_out);
+  }
+};
+template <FS_func_t FS_func>
+struct FragmentShader {
+  void operator()(const Uniforms &uniforms, const Fragment_gl &fragment_in, 
+                  Vec4 &color_out, bool &is_discarded, double &gl_FragDepth) const {
+    FS_func(uniforms, fragment_in, color_out, is_discarded, gl_FragDepth);
+  }
+};
+
+/**
+Pipeline specialized at compile time for a fixed set of shaders and states.
+@param VS, FS: Vertex & fragment shader types, functors with the same 
+signatures as VS_func_t and FS_func_t, they are default constructed unless
+given to the constructor. Use VertexShader<func>/FragmentShader<func> to wrap
+plain shader functions.
+@param State: Pipeline states, see PipelineState.
+@note: Shaders are called directly and all the per-pixel state checks are 
+resolved at compile time, so the whole raster loop can be inlined. For the 
+shaders to be inlined their definitions must be visible in the translation 
+unit that calls draw(...).
+@note: set_shaders(...), enable_depth_test(...), enable_early_depth_test(...),
+enable_reverse_depth(...) and enable_backface_culling(...) have no effect. The
+render targets must have the same formats as State::color_format and 
+State::depth_format.
+@note: submit(...) is not specialized, the recorded draw calls are drawn with
+their own shaders & states.
+**/
+template <typename VS, typename FS, typename State = PipelineState<>>
+class SpecializedPipeline : public Pipeline {
+public:
+  using Pipeline::draw;
+  virtual void draw(
+    const VertexBuffer_t& vertices,
+    const IndexBuffer_t& indices,
+    const Uniforms& uniforms);
+  virtual void draw(
+    const VertexBuffer_t& vertices,
+    const IndexBuffer_t& indices,
+    const int32_t& first_index,
+    const int32_t& index_count,
+    const int32_t& base_vertex,
+    const Uniforms& uniforms);
+  using Pipeline::draw_instanced;
+  /* the instanced vertex shader is not specialized (see 
+   * set_instanced_vertex_shader()), only the fragment shader & states are */
+  virtual void draw_instanced(
+    const VertexBuffer_t& vertices,
+    const IndexBuffer_t& indices,
+    const Uniforms& uniforms,
+    const InstanceData* instances,
+    const int32_t& instance_count);
+
+protected:
+  /* check render targets and apply State, return false if the render targets
+  cannot be used */
+  bool _prepare_draw();
+  /* stage II & III */
+  void _draw_triangles(const IndexBuffer_t& indices, const Uniforms& uniforms);
+
+public:
+  SpecializedPipeline(const VS &VS_in = VS(), const FS &FS_in = FS()) 
+    : vertex_shader(VS_in), fragment_shader(FS_in) {
+    ppl.backface_culling = State::backface_culling;
+    ppl.do_depth_test = State::depth_test;
+    ppl.early_depth_test = State::early_depth_test;
+    ppl.reverse_depth = State::reverse_depth;
+  }
+  virtual ~SpecializedPipeline() {}
+
+protected:
+  VS vertex_shader;
+  FS fragment_shader;
+};
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+/* * * * * * * * * * * * * * Template implementations * * * * * * * * * * * * */
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+template <typename VS>
+void
+Pipeline::vertex_processing(const VertexBuffer_t &vertex_buffer,
+                            const Uniforms &uniforms, const VS &vertex_shader) {
+  /* Vertices are shaded in chunks, each chunk writes to its own range of 
+  this->ppl.Vertices so the output order does not depend on scheduling. */
+  const int n_verts = int(vertex_buffer.size());
+  const int n_chunks = (n_verts + VERTEX_CHUNK_SIZE - 1) / VERTEX_CHUNK_SIZE;
+  ppl.Vertices.resize(n_verts);
+  parallel_for(n_chunks, [&](int chunk_id) {
+    const int i_start = chunk_id * VERTEX_CHUNK_SIZE;
+    const int i_end = min(i_start + VERTEX_CHUNK_SIZE, n_verts);
+    for (int i_vert = i_start; i_vert < i_end; i_vert++) {
+      /* Map vertex from model local space to homogeneous clip space and stores
+      to "gl_Position". */
+      vertex_shader(uniforms, vertex_buffer[i_vert], ppl.Vertices[i_vert]);
+      ppl.Vertices[i_vert].gl_InstanceID = 0;
+    }
+  });
+}
+
+template <typename VS>
+void
+Pipeline::vertex_processing_fetched(const VertexBuffer_t &vertex_buffer,
+                                    const Uniforms &uniforms, const VS &vertex_shader) {
+  const int n_verts = int(ppl.FetchVertices.size());
+  const int n_chunks = (n_verts + VERTEX_CHUNK_SIZE - 1) / VERTEX_CHUNK_SIZE;
+  ppl.Vertices.resize(n_verts);
+  parallel_for(n_chunks, [&](int chunk_id) {
+    const int i_start = chunk_id * VERTEX_CHUNK_SIZE;
+    const int i_end = min(i_start + VERTEX_CHUNK_SIZE, n_verts);
+    for (int i_vert = i_start; i_vert < i_end; i_vert++) {
+      vertex_shader(uniforms, vertex_buffer[ppl.FetchVertices[i_vert]], ppl.Vertices[i_vert]);
+      ppl.Vertices[i_vert].gl_InstanceID = 0;
+    }
+  });
+}
+
+template <class DepthBuffer_t>
+double
+Pipeline::get_depth_block_max(const int &x, const int &y) {
+  const int w = this->targets.depth->w, h = this->targets.depth->h;
+  const typename DepthBuffer_t::type *depths = 
+    (const typename DepthBuffer_t::type *) this->targets.depth->pixels;
+  const int x_e = min(x + RASTER_BLOCK_SIZE, w), y_e = min(y + RASTER_BLOCK_SIZE, h);
+  double z_max = 0.0;
+  for (int j = y; j < y_e; j++) {
+    const typename DepthBuffer_t::type *row = depths + (h - 1 - j) * w;
+    for (int i = x; i < x_e; i++)
+      z_max = max(z_max, DepthBuffer_t::decode(row[i]));
+  }
+  return z_max;
+}
+
+template <class State, typename FS>
+void
+Pipeline::rasterize_tile(const int &tile_id, const Uniforms &uniforms, 
+                         const FS &fragment_shader, const int &i_bin_start,
+                         const int &i_bin_end) {
+  traverse_tile<State>(tile_id, 
+    [&](const int &x, const int &y, const double *f, const int &instance_id) {
+      shade_pixel<State>(x, y, f, instance_id, uniforms, fragment_shader);
+    }, i_bin_start, i_bin_end);
+}
+
+template <class State, typename PixelFunc>
+void
+Pipeline::traverse_tile(const int &tile_id, const PixelFunc &pixel_func, 
+                        const int &i_bin_start, const int &i_bin_end) {
+  typedef typename State::depth_buffer DB;
+  const bool HierarchicalZ = State::depth_test && State::early_depth_test;
+  const int BS = RASTER_BLOCK_SIZE;
+  const int NB = RASTER_TILE_SIZE / RASTER_BLOCK_SIZE; /* blocks per tile row */
+  const int tile_x = (tile_id % ppl.num_tiles_x) * RASTER_TILE_SIZE;
+  const int tile_y = (tile_id / ppl.num_tiles_x) * RASTER_TILE_SIZE;
+  BlockCoverage_gl blocks[NB * NB];
+  /* maximum depth of the blocks in this tile */
+  double *hiz = HierarchicalZ ? &ppl.HiZ[(tile_y / BS) * ppl.hiz_w + tile_x / BS] : NULL;
+  double tile_z_max = 1.0;
+  bool tile_z_max_changed = true;
+  /* tolerance of the rounding errors in depth interpolation */
+  const double z_eps = 1e-9;
+  const std::vector<uint32_t> &bin = ppl.TileBins[tile_id];
+  const int n_bin = (i_bin_end < 0) ? int(bin.size()) : i_bin_end;
+  for (int i_bin = i_bin_start; i_bin < n_bin; i_bin++) {
+    const TriangleSetup_gl &setup = ppl.Setups[bin[i_bin]];
+    if (HierarchicalZ) {
+      if (tile_z_max_changed) {
+        tile_z_max = 0.0;
+        for (int j = 0; j < NB; j++)
+          for (int i = 0; i < NB; i++)
+            tile_z_max = max(tile_z_max, hiz[j * ppl.hiz_w + i]);
+        tile_z_max_changed = false;
+      }
+      /* the whole triangle is behind the tile (compare in the stored format, 
+      the same as the depth test) */
+      if (DB::is_behind(DB::encode(min(max(setup.z_min - z_eps, 0.0), 1.0)), 
+                        DB::encode(tile_z_max))) 
+        continue;
+    }
+    /* Step 3.3: Rasterization (only the part inside this tile). */
+    const int n_blocks = rasterize_blocks(setup, tile_x, tile_y, blocks);
+    for (int i_block = 0; i_block < n_blocks; i_block++) {
+      const BlockCoverage_gl &block = blocks[i_block];
+      double *block_z_max = NULL;
+      if (HierarchicalZ) {
+        block_z_max = &hiz[((block.y - tile_y) / BS) * ppl.hiz_w + (block.x - tile_x) / BS];
+        /* minimum depth of the triangle plane inside this block */
+        const double dzdx = setup.dfdx[INTERP_Z], dzdy = setup.dfdy[INTERP_Z];
+        double z_min = setup.f0[INTERP_Z] + 
+          dzdx * (double(block.x) + (dzdx > 0.0 ? 0.5 : double(BS) - 0.5)) +
+          dzdy * (double(block.y) + (dzdy > 0.0 ? 0.5 : double(BS) - 0.5));
+        z_min = min(max(max(z_min, setup.z_min) - z_eps, 0.0), 1.0);
+        /* the whole block is behind the depth target */
+        if (DB::is_behind(DB::encode(z_min), DB::encode(*block_z_max))) continue;
+      }
+      /* shade all covered pixels in the block, stepping the interpolants
+      along each row */
+      double f_row[NUM_INTERPOLANTS], f[NUM_INTERPOLANTS];
+      for (int k = 0; k < NUM_INTERPOLANTS; k++)
+        f_row[k] = setup.f0[k] + setup.dfdx[k] * (double(block.x) + 0.5) + 
+                   setup.dfdy[k] * (double(block.y) + 0.5);
+      for (int row = 0; row < BS; row++) {
+        uint64_t row_mask = (block.mask >> (row * BS)) & ((uint64_t(1) << BS) - 1);
+        if (row_mask) {
+          for (int k = 0; k < NUM_INTERPOLANTS; k++)
+            f[k] = f_row[k];
+          for (int col = 0; row_mask; col++, row_mask >>= 1) {
+            if (row_mask & 1)
+              pixel_func(block.x + col, block.y + row, f, setup.instance_id);
+            for (int k = 0; k < NUM_INTERPOLANTS; k++)
+              f[k] += setup.dfdx[k];
+          }
+        }
+        for (int k = 0; k < NUM_INTERPOLANTS; k++)
+          f_row[k] += setup.dfdy[k];
+      }
+      if (HierarchicalZ) {
+        *block_z_max = get_depth_block_max<DB>(block.x, block.y);
+        tile_z_max_changed = true;
+      }
+    }
+  }
+}
+
+template <class State, typename FS>
+void
+Pipeline::shade_pixel(const int &x, const int &y, const double *f, const int &instance_id,
+                      const Uniforms &uniforms, const FS &fragment_shader) {
+  typedef typename State::depth_buffer DB;
+  /* early depth test */
+  typename DB::type *early_depth = NULL, early_z = 0;
+  if (State::depth_test && State::early_depth_test) {
+    const int pixel_id = (this->targets.color->h - 1 - y) * this->targets.color->w + x;
+    early_depth = (typename DB::type *) this->targets.depth->pixels + pixel_id;
+    early_z = DB::encode(min(max(f[INTERP_Z], 0.0), 1.0));
+    if (DB::is_behind(early_z, *early_depth))
+      return;
+  }
+  /* Step 3.4: Assemble fragment and render pixel. */
+  /* recover perspective correct varyings */
+  const double z_real = 1.0 / f[INTERP_INV_W];
+  double varyings[NUM_VARYINGS];
+  for (int k = 0; k < NUM_VARYINGS; k++)
+    varyings[k] = f[INTERP_VARYINGS + k] * z_real;
+  Fragment_gl fragment;
+  assemble_fragment(varyings, fragment);
+  fragment.gl_InstanceID = instance_id;
+  /*
+  The window space depth is the NDC depth in range [-1, +1] mapped to [0, +1],
+  it is linear in window space so it is interpolated without correction.
+
+  * Although OpenGL's depth range is [-1, +1], but if you want to read the 
+    depth value from a depth texture, the value is further normalized to 
+    [0, +1]. So here for convenience we directly convert it to [0, +1]
+    because reading from depth buffer is rather common in graphics 
+    programming. 
+  */
+  double gl_FragDepth = f[INTERP_Z];
+  fragment.gl_FragCoord = Vec4(double(x) + 0.5, double(y) + 0.5, gl_FragDepth, f[INTERP_INV_W]);
+  Vec4 color_out;
+  bool is_discarded = false;
+  fragment_shader(uniforms, fragment, color_out, is_discarded, gl_FragDepth);
+  /* Step 3.5: Fragment processing */
+  if (is_discarded)
+    return;
+  if (State::depth_test && State::early_depth_test) {
+    /* already tested, the pixel is only touched by the current thread */
+    *early_depth = early_z;
+    write_pixel<false, State>(x, y, color_out, gl_FragDepth);
+  }
+  else
+    write_pixel<State::depth_test, State>(x, y, color_out, gl_FragDepth);
+}
+
+template <bool DepthTest, class State>
+void
+Pipeline::write_pixel(const int &x, const int &y, const Vec4 &color, const double &z) {
+  typedef typename State::depth_buffer DB;
+  /* (x, h-1-y) is the final output pixel location (origin is at the top-left 
+  corner of the screen). */
+  const int pixel_id = (this->targets.color->h - 1 - y) * this->targets.color->w + x;
+  /* depth test */
+  if (DepthTest) {
+    typename DB::type *depths = (typename DB::type *) this->targets.depth->pixels;
+    typename DB::type z_new = DB::encode(min(max(z, 0.0), 1.0));
+    if (DB::is_behind(z_new, depths[pixel_id]))
+      return;
+    depths[pixel_id] = z_new;
+  }
+  uint8_t R, G, B, A;
+  unpack_color_to_unsigned_RGBA(color, R, G, B, A);
+  /* little endian, see pack_RGBA8888_to_uint32(...) */
+  uint32_t packed_32bit;
+  if (State::color_format == PixelFormat::pixel_format_RGBA8888)
+    packed_32bit = ((A << 24) | (B << 16) | (G << 8) | R);
+  else
+    packed_32bit = ((A << 24) | (R << 16) | (G << 8) | B);
+  uint32_t *pixels = (uint32_t *) this->targets.color->pixels;
+  pixels[pixel_id] = packed_32bit;
+}
+
+template <typename VS, typename FS, typename State>
+bool 
+SpecializedPipeline<VS, FS, State>::_prepare_draw() {
+  static_assert(State::color_format == PixelFormat::pixel_format_RGBA8888 ||
+                State::color_format == PixelFormat::pixel_format_BGRA8888,
+                "Invalid color format.");
+  if (targets.color->format != State::color_format || 
+      (State::depth_test && targets.depth->format != State::depth_format)) {
+    printf("Render target format does not match the pipeline state.\n");
+    return false;
+  }
+  ppl.backface_culling = State::backface_culling;
+  ppl.do_depth_test = State::depth_test;
+  ppl.early_depth_test = State::early_depth_test;
+  ppl.reverse_depth = State::reverse_depth;
+
+  /* Clear cached data generated from previous call. */
+  ppl.Vertices.clear();
+  ppl.Triangles.clear();
+  return true;
+}
+
+template <typename VS, typename FS, typename State>
+void 
+SpecializedPipeline<VS, FS, State>::_draw_triangles(
+  const IndexBuffer_t& indices,
+  const Uniforms& uniforms)
+{
+  /* Stage II: Vertex post-processing. */
+  vertex_post_processing(indices);
+
+  /* Step III: Rasterization & fragment processing */
+  triangle_setup_and_binning();
+  prepare_depth_hierarchy();
+  const int n_tiles = ppl.num_tiles_x * ppl.num_tiles_y;
+  parallel_for(n_tiles, [&](int tile_id) {
+    rasterize_tile<State>(tile_id, uniforms, fragment_shader);
+  });
+}
+
+template <typename VS, typename FS, typename State>
+void 
+SpecializedPipeline<VS, FS, State>::draw(
+  const VertexBuffer_t& vertices,
+  const IndexBuffer_t& indices,
+  const Uniforms& uniforms)
+{
+  if (!_prepare_draw())
+    return;
+  const Uniforms &draw_uniforms = run_uniform_prologue(uniforms);
+  /* Stage I: Vertex processing. */
+  vertex_processing(vertices, draw_uniforms, vertex_shader);
+  _draw_triangles(indices, draw_uniforms);
+}
+
+template <typename VS, typename FS, typename State>
+void 
+SpecializedPipeline<VS, FS, State>::draw(
+  const VertexBuffer_t& vertices,
+  const IndexBuffer_t& indices,
+  const int32_t& first_index,
+  const int32_t& index_count,
+  const int32_t& base_vertex,
+  const Uniforms& uniforms)
+{
+  if (!_prepare_draw())
+    return;
+  const Uniforms &draw_uniforms = run_uniform_prologue(uniforms);
+  /* Stage I: Vertex fetch & processing. */
+  if (!vertex_fetch(vertices, indices, first_index, index_count, base_vertex))
+    return;
+  vertex_processing_fetched(vertices, draw_uniforms, vertex_shader);
+  _draw_triangles(ppl.FetchIndices, draw_uniforms);
+}
+
+template <typename VS, typename FS, typename State>
+void 
+SpecializedPipeline<VS, FS, State>::draw_instanced(
+  const VertexBuffer_t& vertices,
+  const IndexBuffer_t& indices,
+  const Uniforms& uniforms,
+  const InstanceData* instances,
+  const int32_t& instance_count)
+{
+  if (shaders.VS_instanced == NULL || instance_count <= 0 || !_prepare_draw())
+    return;
+  const Uniforms &draw_uniforms = run_instanced_prologue(uniforms, instances, instance_count);
+  const int n_instances = int(ppl.Instances.size());
+  const int batch_size = get_instance_batch_size(indices, n_instances);
+  for (int first = 0; first < n_instances; first += batch_size) {
+    const int count = min(batch_size, n_instances - first);
+    /* Stage I: Vertex processing (all instances of the batch at once). */
+    vertex_processing_instanced(vertices, draw_uniforms, first, count);
+    repeat_instance_indices(indices, int(vertices.size()), count);
+    _draw_triangles(ppl.InstanceIndices, draw_uniforms);
+  }
+}
 
 }; /* namespace sgl */
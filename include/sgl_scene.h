@@ -0,0 +1,98 @@
+#pragma once
+#include <stdint.h>
+
+#include <vector>
+
+#include "sgl_math.h"
+#include "sgl_model.h"
+
+namespace sgl {
+
+/* A model placed in the scene. */
+struct SceneInstance {
+  Model*         model; /* NULL if the instance is removed */
+  Mat4x4     transform; /* model local space to world space */
+  int32_t      anim_id; /* animation being played (-1 for bind pose) */
+  double          time; /* animation timeline (in sec.) */
+  BoundingVolume bounds; /* world space bounding volume (maintained by Scene) */
+  bool        occluder; /* rasterized into the occlusion buffer (see OcclusionBuffer) */
+};
+
+/**
+A container of model instances with a bounding volume hierarchy (BVH), so
+that frustum and ray queries only visit O(log n) nodes instead of testing
+every instance.
+
+* The BVH is built by recursively splitting the instances at the median of
+their centers along the longest axis. Moving instances only refits the node
+bounds (bottom-up, without changing the tree), while adding or removing
+instances rebuilds the tree. Both are done lazily by update(), which is also
+called by the queries. Call rebuild() if many instances moved a long way
+and the refitted tree becomes loose.
+
+* The items of each subtree are stored contiguously, so a node that is
+completely inside the frustum returns all its instances without visiting
+its children.
+**/
+class Scene {
+public:
+  /**
+  Add a model instance to the scene.
+  @return: Id of the instance. Ids of removed instances may be reused.
+  **/
+  uint32_t add_instance(Model* model, const Mat4x4& transform = Mat4x4::identity(),
+    const int32_t& anim_id = -1);
+  void remove_instance(const uint32_t& id);
+  void set_transform(const uint32_t& id, const Mat4x4& transform);
+  /* the bounding volume depends on the animation but not on the time */
+  void set_animation(const uint32_t& id, const int32_t& anim_id);
+  void set_time(const uint32_t& id, const double& time);
+  /* mark a (static, large) instance as an occluder of the others */
+  void set_occluder(const uint32_t& id, bool occluder);
+  const SceneInstance& get_instance(const uint32_t& id) const { return this->instances[id]; }
+  /* number of instance slots, ids are within [0, count) */
+  uint32_t get_instance_count() const { return (uint32_t)this->instances.size(); }
+  void clear();
+
+  /* apply pending changes to the BVH (rebuild or refit) */
+  void update();
+  /* rebuild the BVH from scratch */
+  void rebuild();
+
+  /**
+  Find all the instances that may be visible.
+  @param view_projection: View & Projection matrix.
+  @param ids: Output, ids of the instances intersecting the view frustum.
+  **/
+  void query_frustum(const Mat4x4& view_projection, std::vector<uint32_t>& ids);
+  /**
+  Find the nearest instance hit by a ray (tested against the instance boxes).
+  @param origin, dir: The ray, `dir` does not need to be normalized.
+  @param t_hit: Output, the ray hits the box at origin + t_hit * dir.
+  @param t_max: Only hits with t <= t_max are considered.
+  @return: Id of the instance, or -1 if nothing is hit.
+  **/
+  int32_t query_ray(const Vec3& origin, const Vec3& dir, double& t_hit, double t_max = 1e30);
+
+  Scene();
+  virtual ~Scene() {}
+
+protected:
+  struct BVHNode {
+    Vec3 aabb_min, aabb_max;
+    uint32_t first, count; /* items of the subtree: items[first, first+count) */
+    int32_t child;         /* children are child and child+1, -1 for leaves */
+  };
+  void _update_instance_bounds(SceneInstance& instance);
+  void _build_node(uint32_t i_node);
+  void _refit();
+
+  std::vector<SceneInstance> instances;
+  std::vector<uint32_t> free_ids;
+  std::vector<BVHNode> nodes;  /* nodes[0] is the root */
+  std::vector<uint32_t> items; /* instance ids, ordered by the BVH */
+  bool needs_rebuild;
+  bool needs_refit;
+};
+
+}; /* namespace sgl */
@@ -13,6 +13,10 @@ const int MAX_TEXTURES_PER_SHADING_UNIT = 8;
 const int MAX_BONES_INFLUENCE_PER_VERTEX = 4; 
 /* A mesh model can only have less than 128 nodes. */
 const int MAX_NODES_PER_MODEL = 128;
+/* Number of scalar varyings (wp, wn, t) passed from Vertex_gl to Fragment_gl.
+ * NOTE: pack_varyings() and assemble_fragment() must be updated accordingly
+ * if this value is changed. */
+const int NUM_VARYINGS = 8;
 
 struct Vertex {
   Vec3 p; /* vertex position (in model local space) */
@@ -42,6 +46,10 @@ public:
   Vec3 wp; /* world position */
   Vec3 wn; /* world normal */
   Vec2 t;  /* texture coordinates */
+  /* index of the instance (see Pipeline::draw_instanced()), 0 for other 
+   * draw calls. Written by the pipeline, not interpolated (the value of 
+   * the first vertex of a triangle is used by all its fragments). */
+  int32_t gl_InstanceID;
 
 public:
   /**
@@ -68,6 +76,7 @@ public:
     v_out.t = t + v.t;
     v_out.wp = wp + v.wp;
     v_out.gl_Position = gl_Position + v.gl_Position;
+    v_out.gl_InstanceID = gl_InstanceID;
     return v_out;
   }
   Vertex_gl operator*(const double &w) const {
@@ -77,6 +86,7 @@ public:
     v_out.t = t * w;
     v_out.wp = wp * w;
     v_out.gl_Position = gl_Position * w;
+    v_out.gl_InstanceID = gl_InstanceID;
     return v_out;
   }
   void operator*=(const double &w) {
@@ -95,6 +105,30 @@ struct Fragment_gl {
   Vec3 wp;
   Vec3 wn;
   Vec2 t;
+  int32_t gl_InstanceID; /* see Vertex_gl */
+};
+
+/* Per-instance variables of an instanced draw call, see 
+ * Pipeline::draw_instanced(). */
+struct InstanceData {
+  /* transforming vertex from local model space to world space, replaces
+   * Uniforms::model. */
+  Mat4x4 model;
+  /* color multiplier */
+  Vec4 tint;
+  /* bones of this instance start at Uniforms::bone_matrices[bone_offset], 
+   * instances sharing a pose can share the same bones. Bone ids of the
+   * vertices are added to it. Unused for vertices without bones. */
+  int32_t bone_offset;
+  /* number of bone matrices used by the instance (largest bone id of the
+   * vertices + 1, see Model::get_mesh_bone_count()), 0 if the vertices have
+   * no bones. If bone_offset + bone_count exceeds MAX_NODES_PER_MODEL, the 
+   * instance is skipped (see Pipeline::get_skipped_instance_count()). */
+  int32_t bone_count;
+  /* derived variables, filled once per draw call by the pipeline, users do
+   * not need to set them (see Uniforms). */
+  Mat4x4 model_view_projection;
+  Mat3x3 normal_matrix;
 };
 
 /* Uniform variables that are used by both vertex and fragment shaders. */
@@ -107,10 +141,21 @@ struct Uniforms {
   Mat4x4 view;
   /* transforming vertex from local view space to homogeneous clip space. */
   Mat4x4 projection;
+  /* derived variables, filled once per draw call by the uniform prologue (see
+   * UP_func_t) from the matrices above, users do not need to set them unless
+   * the prologue is disabled (see Pipeline::set_uniform_prologue()). */
+  Mat4x4 view_projection;       /* projection * view */
+  Mat4x4 model_view_projection; /* projection * view * model */
+  Mat3x3 normal_matrix;         /* transforming normals from local model 
+                                   space to world space (inverse transpose of
+                                   the upper-left 3x3 part of model) */
   /* texture objects */
   const Texture *in_textures[MAX_TEXTURES_PER_SHADING_UNIT];
   /* final bone transformations */
   Mat4x4 bone_matrices[MAX_NODES_PER_MODEL];
+  /* per-instance variables indexed by gl_InstanceID, only set by the 
+   * pipeline in instanced draw calls (see Pipeline::draw_instanced()). */
+  const InstanceData *instances;
 
 };
 
@@ -125,6 +170,24 @@ and link them to the pipeline.
 **/
 typedef void(*VS_func_t)(const Uniforms&, const Vertex&, Vertex_gl&);
 typedef void(*FS_func_t)(const Uniforms&, const Fragment_gl&, Vec4&, bool&, double&);
+/* Vertex shader of instanced draw calls, also receives the variables of the
+ * instance being drawn. */
+typedef void(*VS_instanced_func_t)(const Uniforms&, const InstanceData&, const Vertex&, Vertex_gl&);
+/**
+Uniform prologue (UP), called once per draw call on a copy of the uniforms 
+given to the pipeline before running any shader. Used to compute values that
+are the same for all vertices & fragments (e.g., matrix products), so they 
+are not computed again by each shader invocation.
+**/
+typedef void(*UP_func_t)(Uniforms&);
+
+/**
+Defines default uniform prologue, fills all the derived variables of 
+`Uniforms` (view_projection, model_view_projection, normal_matrix). The 
+default shaders rely on it, so custom prologues should call it as well.
+  @param uniforms: The uniform variables to be updated.
+**/
+void default_UP(Uniforms &uniforms);
 
 /**
 Defines default vertex shader (VS), which transforms vertices from model local 
@@ -133,18 +196,51 @@ space to homogeneous clip space. This function can also be used as a template.
   @param uniforms: Uniform variables used in vertex shader.
   @param vertex_out: The output vertex.
   @note: `gl_Position` of the @param vertex_out must be properly set.
+  @note: Uses the derived uniforms filled by default_UP(...).
 **/
 void default_VS(const Uniforms &uniforms, const Vertex &vertex_in, Vertex_gl &vertex_out);
 /**
-Assemble fragment from interpolated vertex. The assembled fragment will be sent
-to fragment shader immediately.
-  @param vertex_in: The interpolated vertex generated in rasterization stage.
+Defines default instanced vertex shader, the same as default_VS(...) but uses
+the transforms of the instance.
+  @param instance: The instance being drawn.
+**/
+void default_instanced_VS(const Uniforms &uniforms, const InstanceData &instance,
+  const Vertex &vertex_in, Vertex_gl &vertex_out);
+/**
+Pack the varyings of a vertex into a flat array. The varyings are linearly 
+interpolated (after divided by real depth) in rasterization stage.
+@note: Both functions are called per vertex / per pixel by the pipeline, they
+are defined here so that they can be inlined.
+  @param vertex_in: The vertex generated in vertex processing stage.
+  @param varyings_out: Packed varyings, NUM_VARYINGS values.
+**/
+inline void 
+pack_varyings(const Vertex_gl &vertex_in, double *varyings_out) {
+  varyings_out[0] = vertex_in.wp.x;
+  varyings_out[1] = vertex_in.wp.y;
+  varyings_out[2] = vertex_in.wp.z;
+  varyings_out[3] = vertex_in.wn.x;
+  varyings_out[4] = vertex_in.wn.y;
+  varyings_out[5] = vertex_in.wn.z;
+  varyings_out[6] = vertex_in.t.x;
+  varyings_out[7] = vertex_in.t.y;
+}
+/**
+Assemble fragment from interpolated varyings. The assembled fragment will be 
+sent to fragment shader immediately.
+  @param varyings_in: The perspective correct varyings interpolated in 
+rasterization stage, in the same order as pack_varyings(...).
   @param fragment_out: The assembled output fragment. After assembling this
 fragment will be sent into fragment_shader( @param fragment_in, ... ).
   @note: `gl_FragCoord` of the @param fragment_in does not need to be set by
 users, as this member will be properly set by the rasterization pipeline.
 **/
-void assemble_fragment(const Vertex_gl &vertex_in, Fragment_gl &fragment_out);
+inline void 
+assemble_fragment(const double *varyings_in, Fragment_gl &fragment_out) {
+  fragment_out.wp = Vec3(varyings_in[0], varyings_in[1], varyings_in[2]);
+  fragment_out.wn = Vec3(varyings_in[3], varyings_in[4], varyings_in[5]);
+  fragment_out.t = Vec2(varyings_in[6], varyings_in[7]);
+}
 
 /**
 Defines default fragment shader (FS), shades each fragment into color output. 
@@ -156,5 +252,11 @@ This function can also be used as a template.
 **/
 void default_FS(const Uniforms &uniforms, const Fragment_gl &fragment_in, Vec4 &color_out,
   bool& is_discarded, double& gl_FragDepth);
+/**
+Defines default fragment shader of instanced draw calls, the same as 
+default_FS(...) but the color is multiplied by the tint of the instance.
+**/
+void default_instanced_FS(const Uniforms &uniforms, const Fragment_gl &fragment_in, Vec4 &color_out,
+  bool& is_discarded, double& gl_FragDepth);
 
 }; /* namespace sgl */
@@ -24,6 +24,10 @@ enum PixelFormat {
   pixel_format_RGBA8888,
   pixel_format_BGRA8888, /* NVIDIA graphics card native format */
   pixel_format_float64,
+  /* depth formats, see DepthBuffer in "sgl_pipeline.h" */
+  pixel_format_float32,
+  pixel_format_depth24, /* 24-bit unsigned normalized, stored in 32 bits */
+  pixel_format_depth16, /* 16-bit unsigned normalized */
 };
 
 enum TextureSampling {
@@ -0,0 +1,85 @@
+#pragma once
+#include <stdint.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace sgl {
+
+/**
+A long-lived pool of worker threads with work stealing.
+
+* Workers are created once and then sleep until a job is submitted, so
+submitting a job does not pay for thread creation. A job is a range of
+independent tasks [0, n_tasks). The range is split evenly among all workers
+at submission, each worker then consumes its own sub-range from the front and
+steals half of the remaining tasks from the back of another worker's sub-range
+once its own sub-range runs out.
+
+* The thread that submits the job also works on it (as worker 0), so a pool
+created with N threads only spawns N-1 extra threads.
+
+* A single pool can be shared among multiple pipelines. Jobs submitted from
+different threads are executed one after another, and jobs submitted from
+inside a running task are executed serially by the calling thread.
+**/
+class ThreadPool {
+public:
+  /* Task function, receives the task index in [0, n_tasks). */
+  typedef std::function<void(int)> Task_func_t;
+
+  /**
+  Run tasks in parallel and wait until all of them are finished.
+  @param n_tasks: Number of tasks.
+  @param task: Task function, invoked once for each task index.
+  @param max_threads: Maximum number of threads used by this job (including
+  the calling thread). Non-positive values mean using all the threads.
+  **/
+  void run(const int &n_tasks, const Task_func_t &task, const int &max_threads = 0);
+  /* Get the number of threads in the pool (including the calling thread). */
+  int get_num_threads() const { return num_threads; }
+  /**
+  Get the default pool shared by all pipelines. The pool is created on first
+  use with one thread per CPU core.
+  **/
+  static ThreadPool *get_default();
+
+  ThreadPool(const int &num_threads);
+  ~ThreadPool();
+
+protected:
+  struct Worker {
+    std::mutex lock;
+    int begin, end; /* remaining tasks [begin, end) owned by this worker */
+  };
+  void _worker_loop(const int worker_id);
+  void _work(const int worker_id);
+  bool _pop_task(const int worker_id, int &task_id);
+  bool _steal_tasks(const int worker_id);
+
+protected:
+  int num_threads;
+  std::vector<std::thread> threads;
+  std::vector<Worker> workers;
+  /* current job */
+  struct {
+    const Task_func_t *task;
+    int n_workers;         /* number of workers participating the job */
+    uint64_t generation;   /* increased by one each time a job is submitted */
+    bool stop;             /* tell workers to quit */
+  } job;
+  std::mutex job_lock;
+  std::condition_variable job_start, job_done;
+  std::atomic<int> n_active; /* workers still working on the current job */
+  std::mutex submit_lock;    /* serializes jobs submitted from different threads */
+
+private:
+  ThreadPool(const ThreadPool &) = delete;
+  ThreadPool &operator=(const ThreadPool &) = delete;
+};
+
+}; /* namespace sgl */
@@ -0,0 +1,327 @@
+#include "sgl_anim.h"
+
+#include <algorithm>
+#include <mutex>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define SGL_SSE2
+#endif
+
+namespace sgl {
+
+PoseCache::PoseCache(double time_tolerance, uint32_t max_poses)
+{
+  this->time_tolerance = (time_tolerance > 0.0) ? time_tolerance : 1.0 / 60.0;
+  this->max_poses = max(max_poses, 1u);
+  this->clock = 0;
+}
+
+void
+PoseCache::set_time_tolerance(double tolerance)
+{
+  std::unique_lock<std::shared_mutex> guard(lock);
+  if (tolerance <= 0.0 || tolerance == this->time_tolerance)
+    return;
+  /* time slots are different now */
+  this->time_tolerance = tolerance;
+  this->poses.clear();
+}
+
+void
+PoseCache::clear()
+{
+  std::unique_lock<std::shared_mutex> guard(lock);
+  this->poses.clear();
+}
+
+size_t
+PoseCache::size() const
+{
+  std::shared_lock<std::shared_mutex> guard(lock);
+  return this->poses.size();
+}
+
+std::shared_ptr<const PoseCache::Pose_t>
+PoseCache::get_pose(const Model& model, const int32_t& anim_id, double time)
+{
+  if (anim_id < 0 || anim_id >= int32_t(model.get_animation_count()))
+    return NULL;
+
+  const uint64_t now = clock.fetch_add(1, std::memory_order_relaxed) + 1;
+  Key key;
+  key.model = &model;
+  key.anim_id = anim_id;
+  double tolerance;
+  {
+    std::shared_lock<std::shared_mutex> guard(lock);
+    tolerance = this->time_tolerance;
+    key.time_slot = (int64_t)floor(time / tolerance + 0.5);
+    std::map<Key, Entry>::iterator item = poses.find(key);
+    if (item != poses.end()) {
+      item->second.last_used.store(now, std::memory_order_relaxed);
+      return item->second.pose;
+    }
+  }
+
+  /* not cached, evaluate the pose without holding the lock so other
+  readers are not blocked. The pose is evaluated at the center of the slot. */
+  std::shared_ptr<Pose_t> pose = std::make_shared<Pose_t>();
+  model.evaluate_pose(anim_id, double(key.time_slot) * tolerance, *pose);
+
+  std::unique_lock<std::shared_mutex> guard(lock);
+  if (tolerance != this->time_tolerance)
+    return pose; /* tolerance changed meanwhile, do not cache it */
+  if (poses.size() >= max_poses && poses.find(key) == poses.end())
+    _evict();
+  /* another thread might have evaluated the same pose meanwhile */
+  Entry& entry = poses[key];
+  if (entry.pose == NULL)
+    entry.pose = pose;
+  entry.last_used.store(now, std::memory_order_relaxed);
+  return entry.pose;
+}
+
+void
+PoseCache::update_skeletal_animation_for_mesh(
+  const Model& model, const Mesh& mesh, const int32_t& anim_id, double time,
+  Uniforms& uniforms)
+{
+  std::shared_ptr<const Pose_t> pose = get_pose(model, anim_id, time);
+  if (pose == NULL)
+    return;
+  /* the pose is shared by all the meshes, only the bones of this mesh are
+  computed */
+  model.update_bone_matrices_for_mesh(mesh, *pose, uniforms);
+}
+
+void
+PoseCache::_evict()
+{
+  /* evict the least recently used half, the caller holds the unique lock */
+  std::vector<uint64_t> stamps;
+  stamps.reserve(poses.size());
+  for (std::map<Key, Entry>::iterator item = poses.begin(); item != poses.end(); item++)
+    stamps.push_back(item->second.last_used.load(std::memory_order_relaxed));
+  if (stamps.size() == 0)
+    return;
+  std::nth_element(stamps.begin(), stamps.begin() + stamps.size() / 2, stamps.end());
+  const uint64_t threshold = stamps[stamps.size() / 2];
+  for (std::map<Key, Entry>::iterator item = poses.begin(); item != poses.end(); ) {
+    if (item->second.last_used.load(std::memory_order_relaxed) <= threshold)
+      item = poses.erase(item);
+    else
+      item++;
+  }
+}
+
+/* a bone matrix in the skinning palette (the first 3 rows of Mat4x4) */
+static const int32_t SKINNING_MATRIX_SIZE = 12;
+
+SkinningStage::SkinningStage(uint32_t max_poses_per_mesh)
+{
+  this->max_poses_per_mesh = max(max_poses_per_mesh, 1u);
+  this->clock = 0;
+}
+
+void
+SkinningStage::clear()
+{
+  this->meshes.clear();
+}
+
+void
+SkinningStage::_build_streams(const Mesh& mesh, Streams& streams)
+{
+  /* Palette layout: one slot for each bone of the mesh (in the same order as 
+  mesh.bones), followed by an identity slot (used by vertices that do not
+  belong to any bone) and a zero slot (used by unused influences, and by 
+  nodes that are not bones of the mesh, whose bone matrices are zero). */
+  const uint32_t n_bones = (uint32_t)mesh.bones.size();
+  const int32_t identity_slot = int32_t(n_bones);
+  const int32_t zero_slot = int32_t(n_bones + 1);
+  std::vector<int32_t> node_to_slot(MAX_NODES_PER_MODEL, zero_slot);
+  for (uint32_t i_bone = 0; i_bone < n_bones; i_bone++) {
+    if (mesh.bone_node_ids[i_bone] < (uint32_t)MAX_NODES_PER_MODEL)
+      node_to_slot[mesh.bone_node_ids[i_bone]] = int32_t(i_bone);
+  }
+
+  const uint32_t n_vertices = (uint32_t)mesh.vertices.size();
+  streams.n_vertices = n_vertices;
+  streams.n_influences = 1;
+  streams.px.resize(n_vertices); streams.py.resize(n_vertices); streams.pz.resize(n_vertices);
+  streams.nx.resize(n_vertices); streams.ny.resize(n_vertices); streams.nz.resize(n_vertices);
+  for (uint32_t k = 0; k < MAX_BONES_INFLUENCE_PER_VERTEX; k++) {
+    streams.bone_offsets[k].assign(n_vertices, zero_slot * SKINNING_MATRIX_SIZE);
+    streams.bone_weights[k].assign(n_vertices, 0.0);
+  }
+  for (uint32_t v = 0; v < n_vertices; v++) {
+    const Vertex& vertex = mesh.vertices[v];
+    streams.px[v] = vertex.p.x; streams.py[v] = vertex.p.y; streams.pz[v] = vertex.p.z;
+    streams.nx[v] = vertex.n.x; streams.ny[v] = vertex.n.y; streams.nz[v] = vertex.n.z;
+    if (vertex.bone_IDs.i[0] < 0) {
+      streams.bone_offsets[0][v] = identity_slot * SKINNING_MATRIX_SIZE;
+      streams.bone_weights[0][v] = 1.0;
+      continue;
+    }
+    for (uint32_t k = 0; k < MAX_BONES_INFLUENCE_PER_VERTEX; k++) {
+      const int32_t bone_id = vertex.bone_IDs.i[k];
+      if (bone_id < 0) break;
+      const int32_t slot = (bone_id < MAX_NODES_PER_MODEL) ? node_to_slot[bone_id] : zero_slot;
+      streams.bone_offsets[k][v] = slot * SKINNING_MATRIX_SIZE;
+      streams.bone_weights[k][v] = vertex.bone_weights.i[k];
+      streams.n_influences = max(streams.n_influences, k + 1);
+    }
+  }
+}
+
+void
+SkinningStage::_skin(const Streams& streams, const double* palette, VertexBuffer_t& vertices)
+{
+  /* p' = M*(p, 1) and n' = M*(n, 0) with M = sum(w[k] * B[k]), where B[k]
+  is the 3x4 matrix of the k-th bone influencing the vertex. */
+  const uint32_t n_vertices = streams.n_vertices;
+  const uint32_t n_influences = streams.n_influences;
+  uint32_t v = 0;
+#if defined(__AVX2__)
+  for (; v + 4 <= n_vertices; v += 4) {
+    __m256d m[SKINNING_MATRIX_SIZE];
+    for (int32_t e = 0; e < SKINNING_MATRIX_SIZE; e++)
+      m[e] = _mm256_setzero_pd();
+    for (uint32_t k = 0; k < n_influences; k++) {
+      const int32_t* offsets = &streams.bone_offsets[k][v];
+      const double* b0 = palette + offsets[0];
+      const double* b1 = palette + offsets[1];
+      const double* b2 = palette + offsets[2];
+      const double* b3 = palette + offsets[3];
+      const __m256d w = _mm256_loadu_pd(&streams.bone_weights[k][v]);
+      for (int32_t e = 0; e < SKINNING_MATRIX_SIZE; e++)
+        m[e] = _mm256_add_pd(m[e], _mm256_mul_pd(w, _mm256_set_pd(b3[e], b2[e], b1[e], b0[e])));
+    }
+    const __m256d px = _mm256_loadu_pd(&streams.px[v]), nx = _mm256_loadu_pd(&streams.nx[v]);
+    const __m256d py = _mm256_loadu_pd(&streams.py[v]), ny = _mm256_loadu_pd(&streams.ny[v]);
+    const __m256d pz = _mm256_loadu_pd(&streams.pz[v]), nz = _mm256_loadu_pd(&streams.nz[v]);
+    double p[3][4], n[3][4];
+    for (int32_t r = 0; r < 3; r++) {
+      const __m256d* row = &m[r * 4];
+      _mm256_storeu_pd(p[r], _mm256_add_pd(_mm256_add_pd(_mm256_add_pd(
+        _mm256_mul_pd(row[0], px), _mm256_mul_pd(row[1], py)), _mm256_mul_pd(row[2], pz)), row[3]));
+      _mm256_storeu_pd(n[r], _mm256_add_pd(_mm256_add_pd(
+        _mm256_mul_pd(row[0], nx), _mm256_mul_pd(row[1], ny)), _mm256_mul_pd(row[2], nz)));
+    }
+    for (uint32_t j = 0; j < 4; j++) {
+      vertices[v + j].p = Vec3(p[0][j], p[1][j], p[2][j]);
+      vertices[v + j].n = Vec3(n[0][j], n[1][j], n[2][j]);
+    }
+  }
+#elif defined(SGL_SSE2)
+  for (; v + 2 <= n_vertices; v += 2) {
+    __m128d m[SKINNING_MATRIX_SIZE];
+    for (int32_t e = 0; e < SKINNING_MATRIX_SIZE; e++)
+      m[e] = _mm_setzero_pd();
+    for (uint32_t k = 0; k < n_influences; k++) {
+      const double* b0 = palette + streams.bone_offsets[k][v];
+      const double* b1 = palette + streams.bone_offsets[k][v + 1];
+      const __m128d w = _mm_loadu_pd(&streams.bone_weights[k][v]);
+      for (int32_t e = 0; e < SKINNING_MATRIX_SIZE; e++)
+        m[e] = _mm_add_pd(m[e], _mm_mul_pd(w, _mm_set_pd(b1[e], b0[e])));
+    }
+    const __m128d px = _mm_loadu_pd(&streams.px[v]), nx = _mm_loadu_pd(&streams.nx[v]);
+    const __m128d py = _mm_loadu_pd(&streams.py[v]), ny = _mm_loadu_pd(&streams.ny[v]);
+    const __m128d pz = _mm_loadu_pd(&streams.pz[v]), nz = _mm_loadu_pd(&streams.nz[v]);
+    double p[3][2], n[3][2];
+    for (int32_t r = 0; r < 3; r++) {
+      const __m128d* row = &m[r * 4];
+      _mm_storeu_pd(p[r], _mm_add_pd(_mm_add_pd(_mm_add_pd(
+        _mm_mul_pd(row[0], px), _mm_mul_pd(row[1], py)), _mm_mul_pd(row[2], pz)), row[3]));
+      _mm_storeu_pd(n[r], _mm_add_pd(_mm_add_pd(
+        _mm_mul_pd(row[0], nx), _mm_mul_pd(row[1], ny)), _mm_mul_pd(row[2], nz)));
+    }
+    for (uint32_t j = 0; j < 2; j++) {
+      vertices[v + j].p = Vec3(p[0][j], p[1][j], p[2][j]);
+      vertices[v + j].n = Vec3(n[0][j], n[1][j], n[2][j]);
+    }
+  }
+#endif
+  /* remaining vertices */
+  for (; v < n_vertices; v++) {
+    double m[SKINNING_MATRIX_SIZE];
+    for (int32_t e = 0; e < SKINNING_MATRIX_SIZE; e++)
+      m[e] = 0.0;
+    for (uint32_t k = 0; k < n_influences; k++) {
+      const double* b = palette + streams.bone_offsets[k][v];
+      const double w = streams.bone_weights[k][v];
+      for (int32_t e = 0; e < SKINNING_MATRIX_SIZE; e++)
+        m[e] += w * b[e];
+    }
+    const double px = streams.px[v], py = streams.py[v], pz = streams.pz[v];
+    const double nx = streams.nx[v], ny = streams.ny[v], nz = streams.nz[v];
+    vertices[v].p = Vec3(
+      m[0] * px + m[1] * py + m[2] * pz + m[3],
+      m[4] * px + m[5] * py + m[6] * pz + m[7],
+      m[8] * px + m[9] * py + m[10] * pz + m[11]);
+    vertices[v].n = Vec3(
+      m[0] * nx + m[1] * ny + m[2] * nz,
+      m[4] * nx + m[5] * ny + m[6] * nz,
+      m[8] * nx + m[9] * ny + m[10] * nz);
+  }
+}
+
+const VertexBuffer_t&
+SkinningStage::skin_mesh(const Mesh& mesh, const Mat4x4* bone_matrices)
+{
+  SkinnedMesh& skinned = this->meshes[&mesh];
+  if (skinned.poses.size() == 0 || skinned.streams.n_vertices != mesh.vertices.size()) {
+    skinned.poses.clear();
+    _build_streams(mesh, skinned.streams);
+  }
+
+  /* gather the bone matrices used by this mesh */
+  const uint32_t n_bones = (uint32_t)mesh.bones.size();
+  std::vector<double> palette((n_bones + 2) * SKINNING_MATRIX_SIZE, 0.0);
+  for (uint32_t i_bone = 0; i_bone < n_bones; i_bone++) {
+    const uint32_t node_id = mesh.bone_node_ids[i_bone];
+    if (node_id < (uint32_t)MAX_NODES_PER_MODEL) {
+      std::copy(bone_matrices[node_id].i, bone_matrices[node_id].i + SKINNING_MATRIX_SIZE,
+        &palette[i_bone * SKINNING_MATRIX_SIZE]);
+    }
+  }
+  const Mat4x4 identity = Mat4x4::identity();
+  std::copy(identity.i, identity.i + SKINNING_MATRIX_SIZE, &palette[n_bones * SKINNING_MATRIX_SIZE]);
+
+  /* reuse the buffer if the mesh was already skinned with the same pose */
+  const uint64_t now = ++this->clock;
+  for (uint32_t i = 0; i < skinned.poses.size(); i++) {
+    if (skinned.poses[i].palette == palette) {
+      skinned.poses[i].last_used = now;
+      return skinned.poses[i].vertices;
+    }
+  }
+  /* otherwise skin it into a new buffer, or the least recently used one */
+  uint32_t slot = (uint32_t)skinned.poses.size();
+  if (slot < this->max_poses_per_mesh) {
+    skinned.poses.resize(slot + 1);
+    VertexBuffer_t& vertices = skinned.poses[slot].vertices;
+    vertices = mesh.vertices;
+    for (uint32_t v = 0; v < vertices.size(); v++) {
+      vertices[v].bone_IDs = IVec4(-1, -1, -1, -1);
+      vertices[v].bone_weights = Vec4(0.0, 0.0, 0.0, 0.0);
+    }
+  }
+  else {
+    slot = 0;
+    for (uint32_t i = 1; i < skinned.poses.size(); i++) {
+      if (skinned.poses[i].last_used < skinned.poses[slot].last_used)
+        slot = i;
+    }
+  }
+  SkinnedPose& pose = skinned.poses[slot];
+  pose.palette.swap(palette);
+  pose.last_used = now;
+  _skin(skinned.streams, pose.palette.data(), pose.vertices);
+  return pose.vertices;
+}
+
+}; /* namespace sgl */
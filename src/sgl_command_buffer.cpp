@@ -0,0 +1,106 @@
+#include "sgl_command_buffer.h"
+
+#include <algorithm>
+
+namespace sgl {
+
+CommandBuffer::CommandBuffer() {
+  recording.VS = NULL;
+  recording.FS = NULL;
+  recording.UP = default_UP;
+  recording.backface_culling = true;
+  recording.depth_test = true;
+  recording.early_depth_test = false;
+  recording.strict_order = false;
+  n_uniforms = 0;
+}
+
+void
+CommandBuffer::reset() {
+  this->commands.clear();
+  this->n_uniforms = 0;
+}
+
+void
+CommandBuffer::draw(
+  const VertexBuffer_t& vertices,
+  const IndexBuffer_t& indices,
+  const Uniforms& uniforms) {
+  this->draw(vertices, indices, 0, -1, 0, uniforms);
+}
+
+void
+CommandBuffer::draw(
+  const VertexBuffer_t& vertices,
+  const IndexBuffer_t& indices,
+  const int32_t& first_index,
+  const int32_t& index_count,
+  const int32_t& base_vertex,
+  const Uniforms& uniforms) {
+  if (recording.VS == NULL || recording.FS == NULL)
+    return;
+  /* copy the uniforms into a slot kept from the previous frames if any */
+  if (this->n_uniforms < this->uniforms.size())
+    this->uniforms[this->n_uniforms] = uniforms;
+  else
+    this->uniforms.push_back(uniforms);
+  Uniforms& recorded = this->uniforms[this->n_uniforms];
+  if (recording.UP != NULL)
+    recording.UP(recorded);
+  recorded.instances = NULL;
+
+  DrawCommand command;
+  command.vertices = &vertices;
+  command.indices = &indices;
+  command.first_index = first_index;
+  command.index_count = index_count;
+  command.base_vertex = base_vertex;
+  command.uniforms_id = this->n_uniforms++;
+  command.VS = recording.VS;
+  command.FS = recording.FS;
+  command.backface_culling = recording.backface_culling;
+  command.depth_test = recording.depth_test;
+  command.early_depth_test = recording.early_depth_test;
+  command.strict_order = recording.strict_order;
+  command.depth = mul(recorded.projection, mul(recorded.view, recorded.model)).i44;
+  this->commands.push_back(command);
+}
+
+/* sort key of a draw: states, shaders, material, then front to back */
+static inline bool
+_draw_less(const DrawCommand& a, const Uniforms& ua, uint32_t ia,
+           const DrawCommand& b, const Uniforms& ub, uint32_t ib) {
+  const int state_a = (a.backface_culling ? 1 : 0) | (a.early_depth_test ? 2 : 0);
+  const int state_b = (b.backface_culling ? 1 : 0) | (b.early_depth_test ? 2 : 0);
+  if (state_a != state_b) return state_a < state_b;
+  if (a.FS != b.FS) return uintptr_t(a.FS) < uintptr_t(b.FS);
+  if (a.VS != b.VS) return uintptr_t(a.VS) < uintptr_t(b.VS);
+  if (ua.in_textures[0] != ub.in_textures[0])
+    return uintptr_t(ua.in_textures[0]) < uintptr_t(ub.in_textures[0]);
+  if (a.depth != b.depth) return a.depth < b.depth;
+  return ia < ib; /* keep the result deterministic */
+}
+
+void
+CommandBuffer::get_submit_order(std::vector<uint32_t>& order) const {
+  const uint32_t n_draws = uint32_t(this->commands.size());
+  order.resize(n_draws);
+  for (uint32_t i = 0; i < n_draws; i++)
+    order[i] = i;
+  /* draws depending on the drawing order split the others into segments,
+  which are sorted separately */
+  auto less = [&](const uint32_t& ia, const uint32_t& ib) {
+    const DrawCommand& a = this->commands[ia];
+    const DrawCommand& b = this->commands[ib];
+    return _draw_less(a, this->uniforms[a.uniforms_id], ia, b, this->uniforms[b.uniforms_id], ib);
+  };
+  uint32_t seg_start = 0;
+  for (uint32_t i = 0; i <= n_draws; i++) {
+    if (i < n_draws && !this->commands[i].strict_order && this->commands[i].depth_test)
+      continue;
+    std::sort(order.begin() + seg_start, order.begin() + i, less);
+    seg_start = i + 1;
+  }
+}
+
+}; /* namespace sgl */
@@ -3,6 +3,7 @@
 #include "sgl_utils.h"
 #include <string>
 #include <vector>
+#include <algorithm>
 
 namespace sgl {
 
@@ -10,6 +11,8 @@ Model::Model() {
   root_node = NULL;
   model_transform = Mat4x4::identity();
   keyframe_interp_mode = KeyframeInterp_t::KeyFrameInterp_Linear;
+  anim_bake_rate = 0.0;
+  bounds.radius = 0.0;
 }
 Model::~Model() {
   this->unload();
@@ -21,6 +24,14 @@ Model::unload() {
   this->materials.clear();
   this->_delete_node(root_node);
   this->root_node = NULL;
+  this->anim_name_to_unique_id.clear();
+  this->node_name_to_unique_id.clear();
+  this->node_name_to_ptr.clear();
+  this->skeleton.clear();
+  this->anim_channels.clear();
+  this->bounds = BoundingVolume();
+  this->bounds.radius = 0.0;
+  this->anim_bounds.clear();
 }
 
 bool 
@@ -132,6 +143,9 @@ Model::load(const std::string& file) {
       Bone bone;
       bone.name = mesh->mBones[i_bone]->mName.data;
       bone.offset = convert_assimp_mat4x4(mesh->mBones[i_bone]->mOffsetMatrix);
+      /* NOTE: in Assimp, if a node is actually a bone, then the node name 
+       * will be set to be the same as the bone name. */
+      uint32_t node_unique_id = this->node_name_to_unique_id[bone.name];
       /* number of affected vertices by this bone */
       uint32_t n_bone_verts = mesh->mBones[i_bone]->mNumWeights;
       for (uint32_t i_vert = 0; i_vert < n_bone_verts; i_vert++) {
@@ -140,12 +154,12 @@ Model::load(const std::string& file) {
         /* write bone info into affected vertex (let the vertex know
          * there is a bone that influences itself). */
         Vertex& affected_vert = this->meshes[i_mesh].vertices[vw.mVertexId];
-        uint32_t node_unique_id = this->node_name_to_unique_id[bone.name];
         _register_vertex_weight(affected_vert, node_unique_id, vw.mWeight);
       }
       /* register bone */
       std::vector<Bone>& bones_list = this->meshes[i_mesh].bones;
       bones_list.push_back(bone);
+      this->meshes[i_mesh].bone_node_ids.push_back(node_unique_id);
       this->meshes[i_mesh].bone_name_to_local_id.insert_or_assign(bone.name, (uint32_t)bones_list.size() - 1);
     }
   }
@@ -201,6 +215,17 @@ Model::load(const std::string& file) {
     }
   }
 
+  /* flatten node hierarchy and resolve animation channels, so no string
+   * lookups are needed when evaluating poses */
+  uint32_t n_anim_ids = 0;
+  for (auto& item : anim_name_to_unique_id)
+    n_anim_ids = max(n_anim_ids, item.second + 1);
+  anim_channels.resize(n_anim_ids);
+  _build_skeleton(root_node);
+  if (anim_bake_rate > 0.0)
+    _bake_node_animations(root_node, anim_bake_rate);
+  _compute_bounds();
+
   /* load materials */
   uint32_t n_materials = _scene->mNumMaterials;
   this->materials.resize(n_materials);
@@ -276,6 +301,183 @@ Model::_parse_and_copy_node(Node* node, aiNode* ai_node)
   }
 }
 
+uint32_t
+Model::_build_skeleton(const Node* node)
+{
+  const uint32_t node_id = node->unique_id;
+  if (node_id >= skeleton.size()) {
+    skeleton.resize(node_id + 1);
+    for (uint32_t i_anim = 0; i_anim < anim_channels.size(); i_anim++)
+      anim_channels[i_anim].resize(node_id + 1, NULL);
+  }
+  skeleton[node_id].parent = (node->parent != NULL) ? int32_t(node->parent->unique_id) : -1;
+  skeleton[node_id].transform = node->transform;
+  for (uint32_t i = 0; i < node->animations.size(); i++) {
+    const Animation& anim = node->animations[i];
+    std::map<std::string, uint32_t>::const_iterator 
+      item = anim_name_to_unique_id.find(anim.name);
+    if (item != anim_name_to_unique_id.end())
+      anim_channels[item->second][node_id] = &anim;
+  }
+  uint32_t height = 0;
+  for (uint32_t i = 0; i < node->childs.size(); i++)
+    height = max(height, _build_skeleton(node->childs[i]) + 1);
+  skeleton[node_id].height = height;
+  return height;
+}
+
+static inline void
+_expand_bounds(BoundingVolume& bounds, const Vec3& p)
+{
+  for (uint32_t i = 0; i < 3; i++) {
+    bounds.aabb_min.i[i] = min(bounds.aabb_min.i[i], p.i[i]);
+    bounds.aabb_max.i[i] = max(bounds.aabb_max.i[i], p.i[i]);
+  }
+}
+static inline void
+_init_bounds(BoundingVolume& bounds)
+{
+  bounds.aabb_min = Vec3(+1e30, +1e30, +1e30);
+  bounds.aabb_max = Vec3(-1e30, -1e30, -1e30);
+  bounds.center = Vec3();
+  bounds.radius = 0.0;
+}
+static inline void
+_finish_bounds(BoundingVolume& bounds)
+{
+  if (bounds.aabb_min.x > bounds.aabb_max.x) {
+    /* empty */
+    bounds.aabb_min = bounds.aabb_max = Vec3();
+  }
+  bounds.center = (bounds.aabb_min + bounds.aabb_max) * 0.5;
+  bounds.radius = length(bounds.aabb_max - bounds.aabb_min) * 0.5;
+}
+
+void
+Model::_compute_bounds()
+{
+  /* Animation bounds: a skinned vertex is a weighted average of the vertex
+  transformed by each of its bones, so it is always inside the union of the
+  boxes of all the vertices influenced by a bone, taken in the bone's space 
+  and then transformed by the bone's pose. The poses are sampled over each 
+  clip at a fixed rate and at every key frame of the clip (where the motion 
+  of a bone can change abruptly), and each transformed corner is padded by 
+  the distance it moved since the previous sample, to cover the motion 
+  between two samples. */
+  const double sample_rate = 30.0;
+  const uint32_t n_anims = (uint32_t)anim_channels.size();
+  /* bone space boxes of each mesh, bone_boxes[i_mesh][i_bone], and the box 
+  of the vertices that do not belong to any bone */
+  std::vector<std::vector<BoundingVolume>> bone_boxes(meshes.size());
+  std::vector<BoundingVolume> static_boxes(meshes.size());
+
+  _init_bounds(this->bounds);
+  for (uint32_t i_mesh = 0; i_mesh < meshes.size(); i_mesh++) {
+    Mesh& mesh = meshes[i_mesh];
+    const uint32_t n_bones = (uint32_t)mesh.bones.size();
+    std::map<int32_t, uint32_t> node_to_bone;
+    for (uint32_t i_bone = 0; i_bone < n_bones; i_bone++)
+      node_to_bone[int32_t(mesh.bone_node_ids[i_bone])] = i_bone;
+    _init_bounds(mesh.bounds);
+    _init_bounds(static_boxes[i_mesh]);
+    bone_boxes[i_mesh].resize(n_bones);
+    for (uint32_t i_bone = 0; i_bone < n_bones; i_bone++)
+      _init_bounds(bone_boxes[i_mesh][i_bone]);
+    for (uint32_t i_vert = 0; i_vert < mesh.vertices.size(); i_vert++) {
+      const Vertex& v = mesh.vertices[i_vert];
+      _expand_bounds(mesh.bounds, v.p);
+      if (v.bone_IDs.i[0] < 0) {
+        _expand_bounds(static_boxes[i_mesh], v.p);
+        continue;
+      }
+      for (uint32_t k = 0; k < MAX_BONES_INFLUENCE_PER_VERTEX; k++) {
+        if (v.bone_IDs.i[k] < 0) break;
+        std::map<int32_t, uint32_t>::const_iterator item = node_to_bone.find(v.bone_IDs.i[k]);
+        if (item == node_to_bone.end()) continue;
+        const Mat4x4& offset = mesh.bones[item->second].offset;
+        _expand_bounds(bone_boxes[i_mesh][item->second], mul(offset, Vec4(v.p, 1.0)).xyz());
+      }
+    }
+    _finish_bounds(mesh.bounds);
+    /* a tighter bounding sphere for the bind pose */
+    double radius_sq = 0.0;
+    for (uint32_t i_vert = 0; i_vert < mesh.vertices.size(); i_vert++)
+      radius_sq = max(radius_sq, length_sq(mesh.vertices[i_vert].p - mesh.bounds.center));
+    mesh.bounds.radius = sqrt(radius_sq);
+    _expand_bounds(this->bounds, mesh.bounds.aabb_min);
+    _expand_bounds(this->bounds, mesh.bounds.aabb_max);
+    mesh.anim_bounds.resize(n_anims);
+    for (uint32_t i_anim = 0; i_anim < n_anims; i_anim++)
+      mesh.anim_bounds[i_anim] = static_boxes[i_mesh];
+  }
+  _finish_bounds(this->bounds);
+
+  std::vector<Mat4x4> pose;
+  std::vector<double> times;
+  /* transformed corners of each bone box at the previous sample, 
+  prev_corners[i_mesh][i_bone * 8 + i_corner] */
+  std::vector<std::vector<Vec3>> prev_corners(meshes.size());
+  this->anim_bounds.resize(n_anims);
+  for (uint32_t i_anim = 0; i_anim < n_anims; i_anim++) {
+    const double duration = get_animation_duration(int32_t(i_anim));
+    const uint32_t n_samples = (uint32_t)ceil(duration * sample_rate) + 1;
+    times.clear();
+    for (uint32_t i_sample = 0; i_sample < n_samples; i_sample++)
+      times.push_back((n_samples > 1) ? duration * i_sample / (n_samples - 1) : 0.0);
+    const std::vector<const Animation*>& channels = anim_channels[i_anim];
+    for (uint32_t i_node = 0; i_node < channels.size(); i_node++) {
+      const Animation* anim = channels[i_node];
+      if (anim == NULL || anim->ticks_per_second <= 0.0)
+        continue;
+      const double tick_time = 1.0 / anim->ticks_per_second;
+      for (uint32_t i = 0; i < anim->position_key_frames.size(); i++)
+        times.push_back(anim->position_key_frames[i].tick * tick_time);
+      for (uint32_t i = 0; i < anim->scaling_key_frames.size(); i++)
+        times.push_back(anim->scaling_key_frames[i].tick * tick_time);
+      for (uint32_t i = 0; i < anim->rotation_key_frames.size(); i++)
+        times.push_back(anim->rotation_key_frames[i].tick * tick_time);
+    }
+    for (uint32_t i = 0; i < times.size(); i++)
+      times[i] = min(max(times[i], 0.0), duration);
+    std::sort(times.begin(), times.end());
+    times.erase(std::unique(times.begin(), times.end()), times.end());
+
+    for (uint32_t i_time = 0; i_time < times.size(); i_time++) {
+      evaluate_pose(int32_t(i_anim), times[i_time], pose);
+      for (uint32_t i_mesh = 0; i_mesh < meshes.size(); i_mesh++) {
+        Mesh& mesh = meshes[i_mesh];
+        prev_corners[i_mesh].resize(mesh.bones.size() * 8);
+        for (uint32_t i_bone = 0; i_bone < mesh.bones.size(); i_bone++) {
+          const BoundingVolume& box = bone_boxes[i_mesh][i_bone];
+          const uint32_t node_id = mesh.bone_node_ids[i_bone];
+          if (box.aabb_min.x > box.aabb_max.x || node_id >= pose.size()) 
+            continue;
+          for (int i = 0; i < 8; i++) {
+            Vec3 corner(
+              (i & 1) ? box.aabb_max.x : box.aabb_min.x,
+              (i & 2) ? box.aabb_max.y : box.aabb_min.y,
+              (i & 4) ? box.aabb_max.z : box.aabb_min.z);
+            const Vec3 p = mul(pose[node_id], Vec4(corner, 1.0)).xyz();
+            Vec3& prev = prev_corners[i_mesh][i_bone * 8 + i];
+            const double pad = (i_time > 0) ? length(p - prev) : 0.0;
+            _expand_bounds(mesh.anim_bounds[i_anim], p - Vec3(pad, pad, pad));
+            _expand_bounds(mesh.anim_bounds[i_anim], p + Vec3(pad, pad, pad));
+            prev = p;
+          }
+        }
+      }
+    }
+    _init_bounds(this->anim_bounds[i_anim]);
+    for (uint32_t i_mesh = 0; i_mesh < meshes.size(); i_mesh++) {
+      BoundingVolume& mesh_bounds = meshes[i_mesh].anim_bounds[i_anim];
+      _finish_bounds(mesh_bounds);
+      _expand_bounds(this->anim_bounds[i_anim], mesh_bounds.aabb_min);
+      _expand_bounds(this->anim_bounds[i_anim], mesh_bounds.aabb_max);
+    }
+    _finish_bounds(this->anim_bounds[i_anim]);
+  }
+}
+
 void 
 Model::_delete_node(Node * node)
 {
@@ -322,61 +524,6 @@ Model::_register_vertex_weight(
            bone_ID, weight);
   }
 }
-void
-Model::_update_mesh_skeletal_animation_from_node(
-  const Node* node, const Mat4x4& parent_transform, const Mesh& mesh,
-  const uint32_t& anim_id, double time, Uniforms& uniforms)
-{
-  /* retrieve some info about this node. 
-  NOTE: in Assimp, if a node is actually a bone, then the node name will be 
-  set to be the same as the bone name. */
-  std::string node_name = node->name;
-  std::map<std::string, uint32_t>::const_iterator 
-    item = mesh.bone_name_to_local_id.find(node_name);
-  bool is_bone = (item != mesh.bone_name_to_local_id.end()); /* this node is a bone */
-  const Bone* bone = (is_bone ? &(mesh.bones[item->second]) : NULL); /* the pointer to the bone */
-  bool has_anim = (node->animations.size() > 0); /* this node contains animation(s) */
-
-  /* Compute node transform. */
-  Mat4x4 node_transform;
-  if (has_anim) {
-    const Animation& anim = node->animations[anim_id];
-    double anim_tick = time * anim.ticks_per_second;
-    node_transform = _interpolate_skeletal_animation(anim, anim_tick, this->keyframe_interp_mode);
-  }
-  else {
-    node_transform = node->transform;
-  }
-
-  /* Compute accumulated node transform for recursion */
-  Mat4x4 accumulated_transform = mul(parent_transform, node_transform);
-
-  /* Compute bone final tranformation matrix and save to uniform variable */
-  uint32_t node_unique_id = node_name_to_unique_id[node_name];
-  Mat4x4 uniform_matrix;
-  if (is_bone) {
-    /* in some tutorials, a global inverse transform is applied to the end
-    of the transformation chain, but here I ignore it as apply an additional
-    transformation seems to mess up the model location. */
-    uniform_matrix = mul(accumulated_transform, bone->offset); 
-  }
-  else {
-    /* This node is not a bone and no vertices should linked to this node.
-    For debugging purposes we set it to zero matrix, so if something wrong 
-    happens (such as a vertex is linked to a non-bone node) then we will 
-    know. */
-    uniform_matrix = Mat4x4();
-  }
-  uniforms.bone_matrices[node_unique_id] = uniform_matrix;
-
-  /* continue to child nodes */
-  for (uint32_t i_node = 0; i_node < node->childs.size(); i_node++) {
-    _update_mesh_skeletal_animation_from_node(
-      node->childs[i_node], accumulated_transform, mesh,
-      anim_id, time, uniforms);
-  }
-}
-
 template<typename T>
 inline T 
 _interpolate_key_frames(
@@ -490,19 +637,317 @@ _interpolate_key_frames(
     return key_frames[0].value;
 }
 
-Mat4x4 
-Model::_interpolate_skeletal_animation(
-  const Animation& anim, const double tick, const KeyframeInterp_t interp)
+void
+Model::set_animation_bake_rate(double sample_rate)
 {
-  /*
-  Interpolate position, scaling, and rotation.
-  NOTE: key frames are sorted by default, and at least one keyframe 
-  should exist in the animation (even if the model has no animation).
-  */
-  Vec3 position = _interpolate_key_frames<Vec3>(anim.position_key_frames, tick, interp);
-  Vec3 scaling = _interpolate_key_frames<Vec3>(anim.scaling_key_frames, tick, interp);
-  Quat rotation = _interpolate_key_frames<Quat>(anim.rotation_key_frames, tick, interp);
+  this->anim_bake_rate = (sample_rate > 0.0) ? sample_rate : 0.0;
+  if (root_node != NULL)
+    _bake_node_animations(root_node, this->anim_bake_rate);
+}
+
+static void
+_bake_animation(Animation& anim, double sample_rate)
+{
+  anim.baked.positions.clear();
+  anim.baked.scalings.clear();
+  anim.baked.rotations.clear();
+  if (sample_rate <= 0.0 ||
+    anim.position_key_frames.size() == 0 ||
+    anim.scaling_key_frames.size() == 0 ||
+    anim.rotation_key_frames.size() == 0)
+    return;
+  /* time span covered by all the tracks, each track is clamped to its 
+  first/last key frame outside of its own range */
+  double first_tick = min(anim.position_key_frames.front().tick,
+    min(anim.scaling_key_frames.front().tick, anim.rotation_key_frames.front().tick));
+  double last_tick = max(anim.position_key_frames.back().tick,
+    max(anim.scaling_key_frames.back().tick, anim.rotation_key_frames.back().tick));
+  double duration = last_tick - first_tick;
+  /* shrink the interval a little bit so that the last sample falls 
+  exactly on the last key frame */
+  uint32_t n_intervals = 0;
+  if (duration > 0.0)
+    n_intervals = max(1u, (uint32_t)ceil(duration * sample_rate / anim.ticks_per_second));
+  anim.baked.first_tick = first_tick;
+  anim.baked.ticks_per_sample = (n_intervals > 0) ? duration / n_intervals : 0.0;
+  anim.baked.positions.resize(n_intervals + 1);
+  anim.baked.scalings.resize(n_intervals + 1);
+  anim.baked.rotations.resize(n_intervals + 1);
+  for (uint32_t i = 0; i <= n_intervals; i++) {
+    double tick = (i == n_intervals) ? last_tick : first_tick + i * anim.baked.ticks_per_sample;
+    anim.baked.positions[i] = _interpolate_key_frames<Vec3>(
+      anim.position_key_frames, tick, KeyFrameInterp_Linear);
+    anim.baked.scalings[i] = _interpolate_key_frames<Vec3>(
+      anim.scaling_key_frames, tick, KeyFrameInterp_Linear);
+    anim.baked.rotations[i] = _interpolate_key_frames<Quat>(
+      anim.rotation_key_frames, tick, KeyFrameInterp_Linear);
+  }
+}
+
+void
+Model::_bake_node_animations(Node* node, double sample_rate)
+{
+  for (uint32_t i = 0; i < node->animations.size(); i++)
+    _bake_animation(node->animations[i], sample_rate);
+  for (uint32_t i = 0; i < node->childs.size(); i++)
+    _bake_node_animations(node->childs[i], sample_rate);
+}
+
+/* 
+Compressed animation tracks.
+Rotations use the "smallest three" encoding: the component with the largest
+magnitude is dropped (it can be recovered from the unit length, and its sign
+can always be made positive since q and -q are the same rotation), so the 
+other three must lie within [-1/sqrt(2), 1/sqrt(2)] and are quantized to 15 
+bits each. The index of the dropped component is stored in the top bits of 
+the first two words. Positions and scalings are quantized to 16 bits within
+the range of the track.
+*/
+static const double QUAT_COMPONENT_RANGE = 0.707106781186547524400844362104849039; /* 1/sqrt(2) */
+static const uint32_t MAX_KEY_FRAME_SEGMENT = 256; /* bounds the cost of key reduction */
 
+static inline void
+_encode_key(const Vec3& v, const CompressedTrack& track, uint16_t* out)
+{
+  for (uint32_t i = 0; i < 3; i++) {
+    double q = 0.0;
+    if (track.range_scale.i[i] > 0.0) 
+      q = clamp(0.0, round((v.i[i] - track.range_min.i[i]) / track.range_scale.i[i]), 65535.0);
+    out[i] = (uint16_t)q;
+  }
+}
+static inline void
+_encode_key(const Quat& q, const CompressedTrack& track, uint16_t* out)
+{
+  Quat qn = normalize(q);
+  double c[4] = { qn.x, qn.y, qn.z, qn.s };
+  uint32_t largest = 0;
+  for (uint32_t i = 1; i < 4; i++)
+    if (fabs(c[i]) > fabs(c[largest])) largest = i;
+  double sign = (c[largest] < 0.0) ? -1.0 : 1.0;
+  for (uint32_t i = 0, j = 0; i < 4; i++) {
+    if (i == largest) continue;
+    double v = (sign * c[i] + QUAT_COMPONENT_RANGE) / (2.0 * QUAT_COMPONENT_RANGE);
+    out[j++] = (uint16_t)round(clamp(0.0, v, 1.0) * 32767.0);
+  }
+  out[0] |= uint16_t((largest & 1) << 15);
+  out[1] |= uint16_t((largest >> 1) << 15);
+}
+static inline void
+_decode_key(const CompressedTrack& track, uint32_t key, Vec3& v)
+{
+  const uint16_t* in = &track.values[3 * key];
+  v.x = track.range_min.x + double(in[0]) * track.range_scale.x;
+  v.y = track.range_min.y + double(in[1]) * track.range_scale.y;
+  v.z = track.range_min.z + double(in[2]) * track.range_scale.z;
+}
+static inline void
+_decode_key(const CompressedTrack& track, uint32_t key, Quat& q)
+{
+  const uint16_t* in = &track.values[3 * key];
+  uint32_t largest = uint32_t(in[0] >> 15) | (uint32_t(in[1] >> 15) << 1);
+  double c[4], sum = 0.0;
+  for (uint32_t i = 0, j = 0; i < 4; i++) {
+    if (i == largest) continue;
+    c[i] = double(in[j++] & 0x7fff) * (2.0 * QUAT_COMPONENT_RANGE / 32767.0) - QUAT_COMPONENT_RANGE;
+    sum += c[i] * c[i];
+  }
+  c[largest] = sqrt(max(0.0, 1.0 - sum));
+  q = Quat(c[3], c[0], c[1], c[2]);
+}
+static inline Vec3 _blend_keys(const Vec3& a, const Vec3& b, double w) { return lerp(a, b, w); }
+static inline Quat _blend_keys(const Quat& a, const Quat& b, double w) { return nlerp(a, b, w); }
+static inline double
+_key_error(const Vec3& a, const Vec3& b)
+{
+  return max(fabs(a.x - b.x), max(fabs(a.y - b.y), fabs(a.z - b.z)));
+}
+static inline double
+_key_error(const Quat& a, const Quat& b)
+{
+  /* angle of the rotation between a and b */
+  return 2.0 * acos(min(1.0, fabs(dot(normalize(a), normalize(b)))));
+}
+static inline void
+_setup_track_range(const std::vector<Vec3>& samples, CompressedTrack& track)
+{
+  Vec3 lo = samples[0], hi = samples[0];
+  for (uint32_t i = 1; i < samples.size(); i++) {
+    for (uint32_t c = 0; c < 3; c++) {
+      lo.i[c] = min(lo.i[c], samples[i].i[c]);
+      hi.i[c] = max(hi.i[c], samples[i].i[c]);
+    }
+  }
+  track.range_min = lo;
+  track.range_scale = (hi - lo) / 65535.0;
+}
+static inline void
+_setup_track_range(const std::vector<Quat>& samples, CompressedTrack& track)
+{
+  /* quaternions are always within the unit range */
+  track.range_min = Vec3();
+  track.range_scale = Vec3();
+}
+
+template <typename T>
+inline T
+_sample_compressed_track(
+  const CompressedTrack& track, double t, const KeyframeInterp_t interp)
+{
+  /* t: position on the timeline, measured in baked samples */
+  const std::vector<uint16_t>& ids = track.sample_ids;
+  const uint32_t n_keys = (uint32_t)ids.size();
+  T v0, v1;
+  if (n_keys == 1 || t <= 0.0) {
+    _decode_key(track, 0, v0);
+    return v0;
+  }
+  if (t >= double(ids[n_keys - 1])) {
+    _decode_key(track, n_keys - 1, v0);
+    return v0;
+  }
+  /* first key frame after t, key frame 0 is always at sample 0 */
+  uint32_t k1 = uint32_t(std::upper_bound(ids.begin() + 1, ids.end(), t) - ids.begin());
+  uint32_t k0 = k1 - 1;
+  _decode_key(track, k0, v0);
+  if (interp == KeyFrameInterp_Nearest)
+    return v0;
+  _decode_key(track, k1, v1);
+  double weight = (t - double(ids[k0])) / double(ids[k1] - ids[k0]);
+  return _blend_keys(v0, v1, weight);
+}
+
+template <typename T>
+inline void
+_compress_track(const std::vector<T>& samples, double tolerance,
+  CompressedTrack& track, double& max_error)
+{
+  const uint32_t n_samples = (uint32_t)samples.size();
+  _setup_track_range(samples, track);
+  /* quantize all the samples, and decode them back to account for the 
+  quantization error when picking key frames */
+  std::vector<uint16_t> quantized(3 * n_samples);
+  for (uint32_t i = 0; i < n_samples; i++)
+    _encode_key(samples[i], track, &quantized[3 * i]);
+  CompressedTrack all;
+  all.values = quantized;
+  all.range_min = track.range_min;
+  all.range_scale = track.range_scale;
+  std::vector<T> decoded(n_samples);
+  for (uint32_t i = 0; i < n_samples; i++)
+    _decode_key(all, i, decoded[i]);
+
+  /* error-bounded key reduction: greedily extend each segment as long as
+  all the samples in between can be reconstructed within the tolerance */
+  track.sample_ids.clear();
+  track.values.clear();
+  uint32_t key = 0;
+  while (true) {
+    track.sample_ids.push_back((uint16_t)key);
+    track.values.insert(track.values.end(), 
+      quantized.begin() + 3 * key, quantized.begin() + 3 * key + 3);
+    if (key + 1 >= n_samples)
+      break;
+    uint32_t next = key + 1;
+    while (next + 1 < n_samples && next + 1 - key <= MAX_KEY_FRAME_SEGMENT) {
+      const uint32_t end = next + 1;
+      bool within_tolerance = true;
+      for (uint32_t i = key + 1; i < end && within_tolerance; i++) {
+        double weight = double(i - key) / double(end - key);
+        T v = _blend_keys(decoded[key], decoded[end], weight);
+        within_tolerance = (_key_error(v, samples[i]) <= tolerance);
+      }
+      if (!within_tolerance)
+        break;
+      next = end;
+    }
+    key = next;
+  }
+  /* the actual error of the compressed track */
+  for (uint32_t i = 0; i < n_samples; i++) {
+    T v = _sample_compressed_track<T>(track, double(i), KeyFrameInterp_Linear);
+    max_error = max(max_error, _key_error(v, samples[i]));
+  }
+}
+
+std::vector<AnimationClipInfo>
+Model::compress_animations(double position_tolerance, double rotation_tolerance)
+{
+  std::vector<AnimationClipInfo> clips(anim_channels.size());
+  for (uint32_t i = 0; i < clips.size(); i++) {
+    clips[i].raw_bytes = clips[i].compressed_bytes = 0;
+    clips[i].max_position_error = 0.0;
+    clips[i].max_scaling_error = 0.0;
+    clips[i].max_rotation_error = 0.0;
+  }
+  for (auto& item : anim_name_to_unique_id) {
+    if (item.second < clips.size())
+      clips[item.second].name = item.first;
+  }
+  if (anim_bake_rate <= 0.0) {
+    printf("[*] Warning: animations must be baked before compression.\n");
+    return clips;
+  }
+  if (root_node != NULL)
+    _compress_node_animations(root_node, position_tolerance, rotation_tolerance, clips);
+  return clips;
+}
+
+void
+Model::_compress_node_animations(Node* node, double position_tolerance,
+  double rotation_tolerance, std::vector<AnimationClipInfo>& clips)
+{
+  for (uint32_t i_anim = 0; i_anim < node->animations.size(); i_anim++) {
+    Animation& anim = node->animations[i_anim];
+    const uint32_t n_samples = (uint32_t)anim.baked.positions.size();
+    if (n_samples == 0)
+      continue; /* not baked or already compressed */
+    if (n_samples > 65536) {
+      printf("[*] Warning: animation \"%s\" of node \"%s\" is too long "
+        "to be compressed.\n", anim.name.c_str(), node->name.c_str());
+      continue;
+    }
+    std::map<std::string, uint32_t>::const_iterator 
+      item = anim_name_to_unique_id.find(anim.name);
+    AnimationClipInfo dummy;
+    AnimationClipInfo& clip = (item != anim_name_to_unique_id.end() && 
+      item->second < clips.size()) ? clips[item->second] : dummy;
+
+    anim.compressed.first_tick = anim.baked.first_tick;
+    anim.compressed.ticks_per_sample = anim.baked.ticks_per_sample;
+    _compress_track(anim.baked.positions, position_tolerance, 
+      anim.compressed.positions, clip.max_position_error);
+    _compress_track(anim.baked.scalings, position_tolerance, 
+      anim.compressed.scalings, clip.max_scaling_error);
+    _compress_track(anim.baked.rotations, rotation_tolerance, 
+      anim.compressed.rotations, clip.max_rotation_error);
+
+    clip.raw_bytes += 
+      anim.position_key_frames.size() * sizeof(KeyFrame<Vec3>) +
+      anim.scaling_key_frames.size() * sizeof(KeyFrame<Vec3>) +
+      anim.rotation_key_frames.size() * sizeof(KeyFrame<Quat>);
+    const CompressedTrack* tracks[3] = { 
+      &anim.compressed.positions, &anim.compressed.scalings, &anim.compressed.rotations };
+    for (uint32_t i = 0; i < 3; i++) {
+      clip.compressed_bytes += 
+        (tracks[i]->sample_ids.size() + tracks[i]->values.size()) * sizeof(uint16_t);
+    }
+    clip.compressed_bytes += 4 * sizeof(Vec3); /* ranges of position/scaling tracks */
+
+    /* release the original key frames and the baked samples */
+    std::vector<KeyFrame<Vec3>>().swap(anim.position_key_frames);
+    std::vector<KeyFrame<Vec3>>().swap(anim.scaling_key_frames);
+    std::vector<KeyFrame<Quat>>().swap(anim.rotation_key_frames);
+    std::vector<Vec3>().swap(anim.baked.positions);
+    std::vector<Vec3>().swap(anim.baked.scalings);
+    std::vector<Quat>().swap(anim.baked.rotations);
+  }
+  for (uint32_t i = 0; i < node->childs.size(); i++)
+    _compress_node_animations(node->childs[i], position_tolerance, rotation_tolerance, clips);
+}
+
+static inline Mat4x4
+_compose_transform(const Vec3& position, const Quat& rotation, const Vec3& scaling) {
   /* build matrices and combine them */
   Mat4x4 position_transform(
     1.0, 0.0, 0.0, position.x,
@@ -521,6 +966,61 @@ Model::_interpolate_skeletal_animation(
   return mul(position_transform, mul(rotation_transform, scaling_transform));
 }
 
+Mat4x4 
+Model::_interpolate_skeletal_animation(
+  const Animation& anim, const double tick, const KeyframeInterp_t interp) const
+{
+  Vec3 position, scaling;
+  Quat rotation;
+  _sample_skeletal_animation(anim, tick, interp, position, rotation, scaling);
+  return _compose_transform(position, rotation, scaling);
+}
+
+void
+Model::_sample_skeletal_animation(
+  const Animation& anim, const double tick, const KeyframeInterp_t interp,
+  Vec3& position, Quat& rotation, Vec3& scaling) const
+{
+  /*
+  Interpolate position, scaling, and rotation.
+  NOTE: key frames are sorted by default, and at least one keyframe 
+  should exist in the animation (even if the model has no animation).
+  */
+  const uint32_t n_samples = (uint32_t)anim.baked.positions.size();
+  if (anim.compressed.rotations.sample_ids.size() > 0) {
+    /* compressed animation */
+    double t = 0.0;
+    if (anim.compressed.ticks_per_sample > 0.0)
+      t = (tick - anim.compressed.first_tick) / anim.compressed.ticks_per_sample;
+    position = _sample_compressed_track<Vec3>(anim.compressed.positions, t, interp);
+    scaling = _sample_compressed_track<Vec3>(anim.compressed.scalings, t, interp);
+    rotation = _sample_compressed_track<Quat>(anim.compressed.rotations, t, interp);
+  }
+  else if (n_samples > 0 && interp == KeyFrameInterp_Linear) {
+    /* baked animation, locate the samples directly */
+    uint32_t i0 = 0, i1 = 0;
+    double weight = 0.0;
+    if (anim.baked.ticks_per_sample > 0.0) {
+      double t = (tick - anim.baked.first_tick) / anim.baked.ticks_per_sample;
+      if (t >= double(n_samples - 1)) 
+        i0 = i1 = n_samples - 1;
+      else if (t > 0.0) {
+        i0 = (uint32_t)t;
+        i1 = i0 + 1;
+        weight = t - double(i0);
+      }
+    }
+    position = lerp(anim.baked.positions[i0], anim.baked.positions[i1], weight);
+    scaling = lerp(anim.baked.scalings[i0], anim.baked.scalings[i1], weight);
+    rotation = nlerp(anim.baked.rotations[i0], anim.baked.rotations[i1], weight);
+  }
+  else {
+    position = _interpolate_key_frames<Vec3>(anim.position_key_frames, tick, interp);
+    scaling = _interpolate_key_frames<Vec3>(anim.scaling_key_frames, tick, interp);
+    rotation = _interpolate_key_frames<Quat>(anim.rotation_key_frames, tick, interp);
+  }
+}
+
 void 
 Model::_dump_mesh(const Mesh & mesh)
 {
@@ -569,53 +1069,233 @@ Animation*
 Model::_find_node_animation_by_name(Node& node, const std::string & anim_name)
 {
   for (uint32_t i_anim = 0; i_anim < node.animations.size(); i_anim++) {
-    std::string anim_name = node.animations[i_anim].name;
-    if (anim_name == anim_name) {
+    if (node.animations[i_anim].name == anim_name) {
       return &(node.animations[i_anim]);
     }
   }
   return NULL;
 }
 
-void 
-Model::update_skeletal_animation_for_mesh(const Mesh& mesh,
-  const std::string& anim_name, double time, Uniforms& uniforms)
+double
+Model::get_animation_duration(const int32_t& anim_id) const
+{
+  if (anim_id < 0 || anim_id >= int32_t(anim_channels.size()))
+    return 0.0;
+  double duration = 0.0;
+  const std::vector<const Animation*>& channels = anim_channels[anim_id];
+  for (uint32_t i_node = 0; i_node < channels.size(); i_node++) {
+    const Animation* anim = channels[i_node];
+    if (anim == NULL)
+      continue;
+    double last_tick = 0.0;
+    if (anim->position_key_frames.size() > 0)
+      last_tick = max(last_tick, anim->position_key_frames.back().tick);
+    if (anim->scaling_key_frames.size() > 0)
+      last_tick = max(last_tick, anim->scaling_key_frames.back().tick);
+    if (anim->rotation_key_frames.size() > 0)
+      last_tick = max(last_tick, anim->rotation_key_frames.back().tick);
+    if (anim->compressed.rotations.sample_ids.size() > 0) {
+      last_tick = max(last_tick, anim->compressed.first_tick + 
+        anim->compressed.ticks_per_sample * anim->compressed.rotations.sample_ids.back());
+    }
+    duration = max(duration, last_tick / anim->ticks_per_second);
+  }
+  return duration;
+}
+
+const BoundingVolume&
+Model::get_bounds(const int32_t& anim_id) const
+{
+  if (anim_id >= 0 && anim_id < int32_t(anim_bounds.size()))
+    return anim_bounds[anim_id];
+  return bounds;
+}
+
+const BoundingVolume&
+Model::get_mesh_bounds(const Mesh& mesh, const int32_t& anim_id) const
+{
+  if (anim_id >= 0 && anim_id < int32_t(mesh.anim_bounds.size()))
+    return mesh.anim_bounds[anim_id];
+  return mesh.bounds;
+}
+
+int32_t
+Model::get_mesh_bone_count(const Mesh& mesh) const
+{
+  /* bone ids of the vertices are the unique ids of the bone nodes */
+  int32_t n_bones = 0;
+  for (uint32_t i_bone = 0; i_bone < mesh.bone_node_ids.size(); i_bone++)
+    n_bones = max(n_bones, int32_t(mesh.bone_node_ids[i_bone]) + 1);
+  return n_bones;
+}
+
+int32_t
+Model::get_animation_id(const std::string& anim_name) const
 {
-  /* traverse from root node to calculate all the bone transformations
-  for a single mesh and save the calculated results into bone_matrices */
   std::map<std::string, uint32_t>::const_iterator 
     item = anim_name_to_unique_id.find(anim_name);
-  if (item == anim_name_to_unique_id.end()) {
+  if (item == anim_name_to_unique_id.end())
+    return -1;
+  return int32_t(item->second);
+}
+
+void 
+Model::update_skeletal_animation_for_mesh(const Mesh& mesh,
+  const std::string& anim_name, double time, Uniforms& uniforms) const
+{
+  int32_t anim_id = get_animation_id(anim_name);
+  if (anim_id < 0) {
     printf("[*] Warning: could not find the required "
       "animation \"%s\" for model.\n", anim_name.c_str());
     return;
   }
-  uint32_t anim_id = item->second;
-  this->_update_mesh_skeletal_animation_from_node(
-    root_node, Mat4x4::identity(), mesh, 
-    anim_id, time, uniforms);
+  update_skeletal_animation_for_mesh(mesh, anim_id, time, uniforms);
+}
+
+void 
+Model::update_skeletal_animation_for_mesh(const Mesh& mesh,
+  const int32_t& anim_id, double time, Uniforms& uniforms) const
+{
+  if (anim_id < 0 || anim_id >= int32_t(anim_channels.size()))
+    return;
+  std::vector<Mat4x4> pose;
+  evaluate_pose(anim_id, time, pose);
+  update_bone_matrices_for_mesh(mesh, pose, uniforms);
 }
 
 void
-model_VS(
-  const Uniforms& uniforms,
+Model::evaluate_pose(const int32_t& anim_id, double time, std::vector<Mat4x4>& pose,
+  const uint32_t culled_levels) const
+{
+  const uint32_t n_nodes = (uint32_t)skeleton.size();
+  const std::vector<const Animation*>* channels = 
+    (anim_id >= 0 && anim_id < int32_t(anim_channels.size())) ? &anim_channels[anim_id] : NULL;
+  pose.resize(n_nodes);
+  /* parents are always evaluated before their children */
+  for (uint32_t i_node = 0; i_node < n_nodes; i_node++) {
+    const SkeletonNode& node = skeleton[i_node];
+    const Animation* anim = (channels != NULL && node.height >= culled_levels) ? 
+      (*channels)[i_node] : NULL;
+    Mat4x4 node_transform;
+    if (anim != NULL) {
+      double anim_tick = time * anim->ticks_per_second;
+      node_transform = _interpolate_skeletal_animation(*anim, anim_tick, this->keyframe_interp_mode);
+    }
+    else {
+      node_transform = node.transform;
+    }
+    pose[i_node] = (node.parent >= 0) ? mul(pose[node.parent], node_transform) : node_transform;
+  }
+}
+
+void
+Model::evaluate_local_pose(const int32_t& anim_id, double time, 
+  std::vector<NodePose>& local_pose, const uint32_t culled_levels) const
+{
+  const uint32_t n_nodes = (uint32_t)skeleton.size();
+  const std::vector<const Animation*>* channels = 
+    (anim_id >= 0 && anim_id < int32_t(anim_channels.size())) ? &anim_channels[anim_id] : NULL;
+  local_pose.resize(n_nodes);
+  for (uint32_t i_node = 0; i_node < n_nodes; i_node++) {
+    const SkeletonNode& node = skeleton[i_node];
+    const Animation* anim = (channels != NULL && node.height >= culled_levels) ? 
+      (*channels)[i_node] : NULL;
+    NodePose& node_pose = local_pose[i_node];
+    node_pose.animated = (anim != NULL);
+    if (anim != NULL) {
+      double anim_tick = time * anim->ticks_per_second;
+      _sample_skeletal_animation(*anim, anim_tick, this->keyframe_interp_mode,
+        node_pose.position, node_pose.rotation, node_pose.scaling);
+    }
+  }
+}
+
+void
+Model::compose_pose(const std::vector<NodePose>& local_pose, std::vector<Mat4x4>& pose) const
+{
+  const uint32_t n_nodes = min((uint32_t)skeleton.size(), (uint32_t)local_pose.size());
+  pose.resize(n_nodes);
+  for (uint32_t i_node = 0; i_node < n_nodes; i_node++) {
+    const SkeletonNode& node = skeleton[i_node];
+    const NodePose& node_pose = local_pose[i_node];
+    const Mat4x4 local = node_pose.animated ? 
+      _compose_transform(node_pose.position, node_pose.rotation, node_pose.scaling) : node.transform;
+    pose[i_node] = (node.parent >= 0) ? mul(pose[node.parent], local) : local;
+  }
+}
+
+void
+Model::blend_local_poses(const std::vector<NodePose>& local_pose0, 
+  const std::vector<NodePose>& local_pose1, double weight, std::vector<Mat4x4>& pose) const
+{
+  const uint32_t n_nodes = min((uint32_t)skeleton.size(), 
+    min((uint32_t)local_pose0.size(), (uint32_t)local_pose1.size()));
+  pose.resize(n_nodes);
+  for (uint32_t i_node = 0; i_node < n_nodes; i_node++) {
+    const SkeletonNode& node = skeleton[i_node];
+    const NodePose& node0 = local_pose0[i_node];
+    const NodePose& node1 = local_pose1[i_node];
+    Mat4x4 local;
+    if (node0.animated && node1.animated) {
+      local = _compose_transform(
+        lerp(node0.position, node1.position, weight),
+        nlerp(node0.rotation, node1.rotation, weight),
+        lerp(node0.scaling, node1.scaling, weight));
+    }
+    else {
+      const NodePose& nearest = (weight < 0.5) ? node0 : node1;
+      local = nearest.animated ? 
+        _compose_transform(nearest.position, nearest.rotation, nearest.scaling) : node.transform;
+    }
+    /* parents are always blended before their children */
+    pose[i_node] = (node.parent >= 0) ? mul(pose[node.parent], local) : local;
+  }
+}
+
+void
+Model::update_bone_matrices_for_mesh(
+  const Mesh& mesh, const std::vector<Mat4x4>& pose, Uniforms& uniforms) const
+{
+  update_bone_matrices_for_mesh(mesh, pose, uniforms.bone_matrices);
+}
+
+void
+Model::update_bone_matrices_for_mesh(
+  const Mesh& mesh, const std::vector<Mat4x4>& pose, Mat4x4* bone_matrices) const
+{
+  /* Nodes that are not bones of this mesh should not be linked to any vertex.
+  For debugging purposes we set them to zero matrices, so if something wrong 
+  happens (such as a vertex is linked to a non-bone node) then we will know. */
+  const uint32_t n_nodes = min((uint32_t)pose.size(), (uint32_t)MAX_NODES_PER_MODEL);
+  for (uint32_t i_node = 0; i_node < n_nodes; i_node++)
+    bone_matrices[i_node] = Mat4x4();
+  for (uint32_t i_bone = 0; i_bone < mesh.bones.size(); i_bone++) {
+    const uint32_t node_id = mesh.bone_node_ids[i_bone];
+    if (node_id >= n_nodes)
+      continue;
+    /* in some tutorials, a global inverse transform is applied to the end
+    of the transformation chain, but here I ignore it as apply an additional
+    transformation seems to mess up the model location. */
+    bone_matrices[node_id] = mul(pose[node_id], mesh.bones[i_bone].offset);
+  }
+}
+
+/* shared by model_VS() and model_instanced_VS() */
+static inline void
+_model_VS(
+  const Mat4x4& model,
+  const Mat4x4& transform,
+  const Mat3x3& normal_matrix,
+  const Mat4x4* bone_matrices,
   const Vertex& vertex_in,
   Vertex_gl& vertex_out
 ) {
-  /* uniforms:
-   * in_textures[0]: diffuse texture.
-   * */
-  const Mat4x4 &model = uniforms.model;
-  const Mat4x4 &view = uniforms.view;
-  const Mat4x4 &projection = uniforms.projection;
-  Mat4x4 transform = mul(projection, mul(view, model));
-
   if (vertex_in.bone_IDs.i[0] < 0) {
     /* vertex does not belong to any bone */
     Vec4 gl_Position = mul(transform, Vec4(vertex_in.p, 1.0));
     vertex_out.gl_Position = gl_Position;
     vertex_out.t = vertex_in.t;
-    vertex_out.wn = mul(model, Vec4(vertex_in.n, 1.0)).xyz();
+    vertex_out.wn = mul(normal_matrix, vertex_in.n);
     vertex_out.wp = mul(model, Vec4(vertex_in.p, 1.0)).xyz();
   }
   else {
@@ -637,19 +1317,44 @@ model_VS(
        * corresponding slot is unused. */
       if (bone_id < 0) break; 
       double bone_weight = vertex_in.bone_weights.i[i_bone];
-      const Mat4x4& bone_matrix = uniforms.bone_matrices[bone_id];
+      const Mat4x4& bone_matrix = bone_matrices[bone_id];
       final_matrix += bone_weight * bone_matrix;
     }
     /* apply final matrix to vertex position */
     Vec4 p_rig = mul(final_matrix, Vec4(vertex_in.p, 1.0));
-    Vec4 n_rig = mul(final_matrix, Vec4(vertex_in.n, 1.0));
+    Vec4 n_rig = mul(final_matrix, Vec4(vertex_in.n, 0.0));
     vertex_out.gl_Position = mul(transform, p_rig);
     vertex_out.t = vertex_in.t;
-    vertex_out.wn = mul(model, n_rig).xyz();
+    vertex_out.wn = mul(normal_matrix, n_rig.xyz());
     vertex_out.wp = mul(model, p_rig).xyz();
   }
 }
 
+void
+model_VS(
+  const Uniforms& uniforms,
+  const Vertex& vertex_in,
+  Vertex_gl& vertex_out
+) {
+  /* uniforms:
+   * in_textures[0]: diffuse texture.
+   * */
+  /* Model & View & Projection matrix (see default_UP) */
+  _model_VS(uniforms.model, uniforms.model_view_projection, uniforms.normal_matrix,
+    uniforms.bone_matrices, vertex_in, vertex_out);
+}
+
+void
+model_instanced_VS(
+  const Uniforms& uniforms,
+  const InstanceData& instance,
+  const Vertex& vertex_in,
+  Vertex_gl& vertex_out
+) {
+  _model_VS(instance.model, instance.model_view_projection, instance.normal_matrix,
+    uniforms.bone_matrices + instance.bone_offset, vertex_in, vertex_out);
+}
+
 void 
 model_FS(
   const Uniforms& uniforms,
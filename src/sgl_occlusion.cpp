@@ -0,0 +1,223 @@
+#include "sgl_occlusion.h"
+
+#include <algorithm>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define SGL_SSE2
+#endif
+
+namespace sgl {
+
+/* pixels processed per SIMD iteration, rows are padded to this width */
+#if defined(__AVX2__)
+static const int32_t OCCLUSION_SIMD_WIDTH = 8;
+#elif defined(SGL_SSE2)
+static const int32_t OCCLUSION_SIMD_WIDTH = 4;
+#else
+static const int32_t OCCLUSION_SIMD_WIDTH = 1;
+#endif
+
+/* Safety margins that keep the float evaluation conservative: edge
+ * thresholds are enlarged by a fraction of the edge gradient and depths
+ * are pushed away from the eye. */
+static const double OCCLUSION_EDGE_EPSILON = 1e-3;
+static const double OCCLUSION_DEPTH_EPSILON = 1e-6;
+
+OcclusionBuffer::OcclusionBuffer(int32_t w, int32_t h)
+{
+  this->w = max(w, 1);
+  this->h = max(h, 1);
+  this->stride = (this->w + OCCLUSION_SIMD_WIDTH - 1) / OCCLUSION_SIMD_WIDTH * OCCLUSION_SIMD_WIDTH;
+  this->depth.assign(size_t(this->stride) * this->h, 1.0f);
+  this->view_projection = Mat4x4::identity();
+}
+
+void
+OcclusionBuffer::begin(const Mat4x4& view_projection)
+{
+  this->view_projection = view_projection;
+  std::fill(this->depth.begin(), this->depth.end(), 1.0f);
+}
+
+void
+OcclusionBuffer::add_occluder(const VertexBuffer_t& vertices, const IndexBuffer_t& indices,
+  const Mat4x4& transform)
+{
+  const Mat4x4 model_view_projection = mul(this->view_projection, transform);
+  /* transform each vertex only once, indices are mostly shared by several
+  triangles */
+  this->clip_vertices.resize(vertices.size());
+  for (size_t i = 0; i < vertices.size(); i++)
+    this->clip_vertices[i] = mul(model_view_projection, Vec4(vertices[i].p, 1.0));
+  for (size_t i = 0; i + 2 < indices.size(); i += 3) {
+    _rasterize_triangle(
+      this->clip_vertices[indices[i]],
+      this->clip_vertices[indices[i + 1]],
+      this->clip_vertices[indices[i + 2]]);
+  }
+}
+
+void
+OcclusionBuffer::add_occluder(const Model& model, const Mat4x4& transform)
+{
+  const std::vector<Mesh>& meshes = model.get_meshes();
+  for (size_t i = 0; i < meshes.size(); i++)
+    add_occluder(meshes[i].vertices, meshes[i].indices, transform);
+}
+
+void
+OcclusionBuffer::_rasterize_triangle(const Vec4& v0, const Vec4& v1, const Vec4& v2)
+{
+  /* skip triangles crossing the near plane instead of clipping them */
+  const Vec4* v[3] = { &v0, &v1, &v2 };
+  double sx[3], sy[3], sz[3];
+  for (int i = 0; i < 3; i++) {
+    if (v[i]->w <= 0.0 || v[i]->z < -v[i]->w)
+      return;
+    const double inv_w = 1.0 / v[i]->w;
+    sx[i] = (v[i]->x * inv_w * 0.5 + 0.5) * this->w;
+    sy[i] = (v[i]->y * inv_w * 0.5 + 0.5) * this->h;
+    sz[i] = v[i]->z * inv_w;
+  }
+  /* occluders are double sided, make the triangle counter-clockwise */
+  double area = (sx[1] - sx[0]) * (sy[2] - sy[0]) - (sx[2] - sx[0]) * (sy[1] - sy[0]);
+  if (area < 0.0) {
+    std::swap(sx[1], sx[2]);
+    std::swap(sy[1], sy[2]);
+    std::swap(sz[1], sz[2]);
+    area = -area;
+  }
+  if (area < 1e-12)
+    return;
+
+  /* pixels whose area may be covered by the triangle */
+  int32_t x_min = max(int32_t(floor(min(sx[0], min(sx[1], sx[2])))), 0);
+  int32_t x_max = min(int32_t(floor(max(sx[0], max(sx[1], sx[2])))), this->w - 1);
+  int32_t y_min = max(int32_t(floor(min(sy[0], min(sy[1], sy[2])))), 0);
+  int32_t y_max = min(int32_t(floor(max(sy[0], max(sy[1], sy[2])))), this->h - 1);
+  if (x_min > x_max || y_min > y_max)
+    return;
+
+  /* Edge functions E(x,y) = A*x + B*y + C, positive inside. A pixel is
+  completely covered if all its corners are inside, that is, if E at the
+  pixel center is at least (|A| + |B|) / 2 for every edge. */
+  double A[3], B[3], C[3];
+  for (int i = 0; i < 3; i++) {
+    const int j = (i + 1) % 3;
+    A[i] = sy[i] - sy[j];
+    B[i] = sx[j] - sx[i];
+    C[i] = -(A[i] * sx[i] + B[i] * sy[i]);
+    C[i] -= (fabs(A[i]) + fabs(B[i])) * (0.5 + OCCLUSION_EDGE_EPSILON);
+  }
+  /* Depth plane, the farthest depth within a pixel is at one of its
+  corners, and never beyond the farthest vertex. */
+  const double dzdx = ((sz[1] - sz[0]) * (sy[2] - sy[0]) - (sz[2] - sz[0]) * (sy[1] - sy[0])) / area;
+  const double dzdy = ((sz[2] - sz[0]) * (sx[1] - sx[0]) - (sz[1] - sz[0]) * (sx[2] - sx[0])) / area;
+  const double z_offset = (fabs(dzdx) + fabs(dzdy)) * 0.5 + OCCLUSION_DEPTH_EPSILON;
+  const float z_max = float(max(sz[0], max(sz[1], sz[2])) + OCCLUSION_DEPTH_EPSILON);
+
+  /* Values are evaluated relative to the first pixel of each row, so that
+  the float rounding error stays small for vertices far off the screen.
+  Lanes outside the bounding box are still exact, and a pixel outside the
+  box is never covered (the padding of each row is never read). */
+  const int32_t x_start = x_min / OCCLUSION_SIMD_WIDTH * OCCLUSION_SIMD_WIDTH;
+  const float fA0 = float(A[0]), fA1 = float(A[1]), fA2 = float(A[2]);
+  const float fdzdx = float(dzdx);
+  for (int32_t y = y_min; y <= y_max; y++) {
+    const double xc = x_start + 0.5, yc = y + 0.5;
+    const float e0 = float(A[0] * xc + B[0] * yc + C[0]);
+    const float e1 = float(A[1] * xc + B[1] * yc + C[1]);
+    const float e2 = float(A[2] * xc + B[2] * yc + C[2]);
+    const float z0 = float(sz[0] + dzdx * (xc - sx[0]) + dzdy * (yc - sy[0]) + z_offset);
+    float* row = &this->depth[size_t(y) * this->stride];
+    int32_t x = x_start;
+#if defined(__AVX2__)
+    const __m256 lane = _mm256_set_ps(7.0f, 6.0f, 5.0f, 4.0f, 3.0f, 2.0f, 1.0f, 0.0f);
+    const __m256 zero = _mm256_setzero_ps();
+    for (; x <= x_max; x += 8) {
+      const __m256 dx = _mm256_add_ps(_mm256_set1_ps(float(x - x_start)), lane);
+      const __m256 in0 = _mm256_cmp_ps(_mm256_add_ps(_mm256_set1_ps(e0), _mm256_mul_ps(_mm256_set1_ps(fA0), dx)), zero, _CMP_GE_OQ);
+      const __m256 in1 = _mm256_cmp_ps(_mm256_add_ps(_mm256_set1_ps(e1), _mm256_mul_ps(_mm256_set1_ps(fA1), dx)), zero, _CMP_GE_OQ);
+      const __m256 in2 = _mm256_cmp_ps(_mm256_add_ps(_mm256_set1_ps(e2), _mm256_mul_ps(_mm256_set1_ps(fA2), dx)), zero, _CMP_GE_OQ);
+      const __m256 covered = _mm256_and_ps(in0, _mm256_and_ps(in1, in2));
+      if (_mm256_movemask_ps(covered) == 0)
+        continue;
+      __m256 z = _mm256_add_ps(_mm256_set1_ps(z0), _mm256_mul_ps(_mm256_set1_ps(fdzdx), dx));
+      z = _mm256_min_ps(z, _mm256_set1_ps(z_max));
+      const __m256 d = _mm256_loadu_ps(&row[x]);
+      _mm256_storeu_ps(&row[x], _mm256_blendv_ps(d, _mm256_min_ps(d, z), covered));
+    }
+#elif defined(SGL_SSE2)
+    const __m128 lane = _mm_set_ps(3.0f, 2.0f, 1.0f, 0.0f);
+    const __m128 zero = _mm_setzero_ps();
+    for (; x <= x_max; x += 4) {
+      const __m128 dx = _mm_add_ps(_mm_set1_ps(float(x - x_start)), lane);
+      const __m128 in0 = _mm_cmpge_ps(_mm_add_ps(_mm_set1_ps(e0), _mm_mul_ps(_mm_set1_ps(fA0), dx)), zero);
+      const __m128 in1 = _mm_cmpge_ps(_mm_add_ps(_mm_set1_ps(e1), _mm_mul_ps(_mm_set1_ps(fA1), dx)), zero);
+      const __m128 in2 = _mm_cmpge_ps(_mm_add_ps(_mm_set1_ps(e2), _mm_mul_ps(_mm_set1_ps(fA2), dx)), zero);
+      const __m128 covered = _mm_and_ps(in0, _mm_and_ps(in1, in2));
+      if (_mm_movemask_ps(covered) == 0)
+        continue;
+      __m128 z = _mm_add_ps(_mm_set1_ps(z0), _mm_mul_ps(_mm_set1_ps(fdzdx), dx));
+      z = _mm_min_ps(z, _mm_set1_ps(z_max));
+      const __m128 d = _mm_loadu_ps(&row[x]);
+      const __m128 nearest = _mm_min_ps(d, z);
+      _mm_storeu_ps(&row[x], _mm_or_ps(_mm_and_ps(covered, nearest), _mm_andnot_ps(covered, d)));
+    }
+#endif
+    for (; x <= x_max; x++) {
+      const float dx = float(x - x_start);
+      if (e0 + fA0 * dx >= 0.0f && e1 + fA1 * dx >= 0.0f && e2 + fA2 * dx >= 0.0f) {
+        const float z = min(z0 + fdzdx * dx, z_max);
+        row[x] = min(row[x], z);
+      }
+    }
+  }
+}
+
+bool
+OcclusionBuffer::is_occluded(const BoundingVolume& bounds, const Mat4x4& model_view_projection) const
+{
+  double x_min = 0.0, x_max = 0.0, y_min = 0.0, y_max = 0.0, z_near = 0.0;
+  for (int i = 0; i < 8; i++) {
+    Vec3 corner(
+      (i & 1) ? bounds.aabb_max.x : bounds.aabb_min.x,
+      (i & 2) ? bounds.aabb_max.y : bounds.aabb_min.y,
+      (i & 4) ? bounds.aabb_max.z : bounds.aabb_min.z);
+    Vec4 p = mul(model_view_projection, Vec4(corner, 1.0));
+    /* the projected box is only bounded if it is in front of the near plane */
+    if (p.w <= 0.0 || p.z < -p.w)
+      return false;
+    const double inv_w = 1.0 / p.w;
+    const double sx = (p.x * inv_w * 0.5 + 0.5) * this->w;
+    const double sy = (p.y * inv_w * 0.5 + 0.5) * this->h;
+    const double sz = p.z * inv_w;
+    if (i == 0) {
+      x_min = x_max = sx;
+      y_min = y_max = sy;
+      z_near = sz;
+      continue;
+    }
+    x_min = min(x_min, sx); x_max = max(x_max, sx);
+    y_min = min(y_min, sy); y_max = max(y_max, sy);
+    z_near = min(z_near, sz);
+  }
+  if (x_max < 0.0 || y_max < 0.0 || x_min >= this->w || y_min >= this->h)
+    return false;
+  const int32_t px_min = max(int32_t(floor(x_min)), 0), px_max = min(int32_t(floor(x_max)), this->w - 1);
+  const int32_t py_min = max(int32_t(floor(y_min)), 0), py_max = min(int32_t(floor(y_max)), this->h - 1);
+  /* hidden only if every pixel holds an occluder nearer than the box */
+  for (int32_t y = py_min; y <= py_max; y++) {
+    const float* row = &this->depth[size_t(y) * this->stride];
+    for (int32_t x = px_min; x <= px_max; x++) {
+      if (double(row[x]) >= z_near)
+        return false;
+    }
+  }
+  return true;
+}
+
+}; /* namespace sgl */
@@ -84,16 +84,93 @@ BasicAnimPass::BasicAnimPass() {
   model = NULL; 
   time = 0.0; 
   pipeline = NULL;
+  pose_cache = NULL;
+  skinning = NULL;
+  frustum_culling = true;
+  occlusion = NULL;
+  commands = NULL;
+  anim_lod.enabled = false;
+  anim_lod.distance = 10.0;
+  anim_lod.max_level = 3;
+  anim_lod.update_rate = 15.0;
+  anim_lod.interpolate = true;
+  run_count = 0;
 }
 
-void
-BasicAnimPass::run(bool clear) {
-  if (this->model == NULL) return;
+uint32_t
+BasicAnimPass::get_anim_lod_level() const {
+  if (this->model == NULL)
+    return 0;
+  return get_anim_lod_level(this->model->get_model_transform());
+}
+
+uint32_t
+BasicAnimPass::get_anim_lod_level(const Mat4x4& model_transform) const {
+  if (!this->anim_lod.enabled || this->anim_lod.distance <= 0.0)
+    return 0;
+  Vec3 origin(model_transform.i14, model_transform.i24, model_transform.i34);
+  double distance = length(origin - this->eye.position);
+  if (distance < this->anim_lod.distance)
+    return 0;
+  uint32_t level = 1 + (uint32_t)floor(log2(distance / this->anim_lod.distance));
+  return min(level, this->anim_lod.max_level);
+}
+
+BasicAnimPass::AnimLODPose&
+BasicAnimPass::_find_lod_pose(
+  const Model& model, int32_t anim_id, uint32_t culled_levels, double period, int64_t sample) {
+  /* find the pose if any instance evaluated it before, otherwise evaluate it */
+  AnimLODKey key;
+  key.model = &model;
+  key.anim_id = anim_id;
+  key.culled_levels = culled_levels;
+  key.sample = sample;
+  std::map<AnimLODKey, AnimLODPose>::iterator item = lod_poses.find(key);
+  if (item == lod_poses.end()) {
+    item = lod_poses.insert(std::make_pair(key, AnimLODPose())).first;
+    model.evaluate_local_pose(anim_id, double(sample) * period, item->second.local_pose, culled_levels);
+  }
+  item->second.last_used = this->run_count;
+  return item->second;
+}
 
+const std::vector<Mat4x4>&
+BasicAnimPass::_evaluate_lod_pose(
+  const Model& model, int32_t anim_id, uint32_t lod_level, double period, double time) {
+  const uint32_t culled_levels = lod_level - 1;
+  const int64_t sample = (int64_t)floor(time / period);
+  AnimLODPose& p0 = _find_lod_pose(model, anim_id, culled_levels, period, sample);
+  if (!this->anim_lod.interpolate) {
+    /* held poses are accumulated once and reused by the other instances */
+    if (p0.pose.empty())
+      model.compose_pose(p0.local_pose, p0.pose);
+    return p0.pose;
+  }
+  /* std::map never moves its elements, so p0 stays valid */
+  AnimLODPose& p1 = _find_lod_pose(model, anim_id, culled_levels, period, sample + 1);
+  const double weight = time / period - double(sample);
+  model.blend_local_poses(p0.local_pose, p1.local_pose, weight, lod_blended_pose);
+  return lod_blended_pose;
+}
+
+void
+BasicAnimPass::_begin(bool clear) {
+  /* drop the LOD poses that were not used by the previous run */
+  this->run_count++;
+  for (std::map<AnimLODKey, AnimLODPose>::iterator item = lod_poses.begin(); item != lod_poses.end(); ) {
+    if (item->second.last_used + 1 < this->run_count)
+      item = lod_poses.erase(item);
+    else
+      ++item;
+  }
   this->pipeline->set_shaders(this->VS, this->FS);
   this->pipeline->set_render_targets(this->color_texture, this->depth_texture);
   if (clear)
     this->pipeline->clear_render_targets(this->color_texture, this->depth_texture, Vec4(0.5, 0.5, 0.5, 1.0));
+  if (this->commands != NULL) {
+    this->commands->reset();
+    this->commands->set_shaders(this->VS, this->FS);
+  }
 
   /* setup internal variables (gl_*) */
   if (this->eye.perspective.enabled) {
@@ -106,27 +183,115 @@ BasicAnimPass::run(bool clear) {
     uniforms.gl_DepthRange.y = this->eye.orthographic.far;
     uniforms.gl_DepthRange.z = uniforms.gl_DepthRange.y - uniforms.gl_DepthRange.x;
   }
-  uniforms.model = this->model->get_model_transform();
   uniforms.view = this->get_view_matrix();
   uniforms.projection = this->get_projection_matrix();
+}
 
+void
+BasicAnimPass::_draw_model(Model& model, const Mat4x4& transform, int32_t anim_id, double time) {
+  uniforms.model = transform;
   /* Rendering all the mesh parts in model */
-  const std::vector<Mesh>& mesh_data = model->get_meshes();
-  const std::vector<Material>& materials = model->get_materials();
+  const std::vector<Mesh>& mesh_data = model.get_meshes();
+  const std::vector<Material>& materials = model.get_materials();
+  /* skip the whole model before doing any animation work if it is not visible */
+  const Mat4x4 model_view_projection = mul(uniforms.projection, mul(uniforms.view, uniforms.model));
+  if (this->frustum_culling && is_outside_frustum(model.get_bounds(anim_id), model_view_projection))
+    return;
+  if (this->occlusion != NULL && this->occlusion->is_occluded(model.get_bounds(anim_id), model_view_projection))
+    return;
+  /* animation level of detail */
+  const uint32_t lod_level = get_anim_lod_level(transform);
+  const std::vector<Mat4x4>* lod_pose = NULL;
+  if (lod_level > 0 && anim_id >= 0 && this->anim_lod.update_rate > 0.0) {
+    const double period = double(1u << (lod_level - 1)) / this->anim_lod.update_rate;
+    lod_pose = &_evaluate_lod_pose(model, anim_id, lod_level, period, time);
+  }
+  /* evaluate the pose once, it is then shared by all the meshes */
+  const std::vector<Mat4x4>* pose = lod_pose;
+  std::shared_ptr<const PoseCache::Pose_t> cached_pose;
+  if (pose == NULL && anim_id >= 0 && anim_id < int32_t(model.get_animation_count())) {
+    if (this->pose_cache != NULL) {
+      cached_pose = this->pose_cache->get_pose(model, anim_id, time);
+      pose = cached_pose.get();
+    }
+    else {
+      model.evaluate_pose(anim_id, time, this->anim_pose);
+      pose = &this->anim_pose;
+    }
+  }
 
   for (uint32_t i_mesh = 0; i_mesh < mesh_data.size(); i_mesh++) {
     const VertexBuffer_t& vertices = mesh_data[i_mesh].vertices;
     const IndexBuffer_t& indices = mesh_data[i_mesh].indices;
     const int32_t mat_id = mesh_data[i_mesh].mat_id;
     const Mesh& mesh = mesh_data[i_mesh];
+    if (this->frustum_culling && 
+      is_outside_frustum(model.get_mesh_bounds(mesh, anim_id), model_view_projection))
+      continue;
+    if (this->occlusion != NULL && 
+      this->occlusion->is_occluded(model.get_mesh_bounds(mesh, anim_id), model_view_projection))
+      continue;
 
     /* calculate bone tranformation matrices and update uniform variables */
-    this->model->update_skeletal_animation_for_mesh(mesh, this->anim_name, this->time, uniforms);
+    if (pose != NULL)
+      model.update_bone_matrices_for_mesh(mesh, *pose, uniforms);
     /* Setting up mesh materials. */
     uniforms.in_textures[0] = &materials[mat_id].diffuse_texture; /* diffuse texture */
     /* Launch the pipeline to render all the triangles in this mesh */
-    this->pipeline->draw(vertices, indices, uniforms);
+    if (this->commands != NULL)
+      this->commands->draw(vertices, indices, uniforms);
+    else if (this->skinning != NULL && anim_id >= 0)
+      this->pipeline->draw(this->skinning->skin_mesh(mesh, uniforms.bone_matrices), indices, uniforms);
+    else
+      this->pipeline->draw(vertices, indices, uniforms);
+  }
+}
+
+void
+BasicAnimPass::run(bool clear) {
+  if (this->model == NULL) return;
+  _begin(clear);
+  /* resolve the animation once, the pose is then shared by all meshes */
+  const int32_t anim_id = model->get_animation_id(this->anim_name);
+  if (anim_id < 0) {
+    printf("[*] Warning: could not find the required "
+      "animation \"%s\" for model.\n", this->anim_name.c_str());
+  }
+  _draw_model(*this->model, this->model->get_model_transform(), anim_id, this->time);
+  _end();
+}
+
+void
+BasicAnimPass::_end() {
+  if (this->commands != NULL)
+    this->pipeline->submit(*this->commands);
+}
+
+ScenePass::ScenePass() {
+  scene = NULL;
+}
+
+void
+ScenePass::run(bool clear) {
+  this->visible.clear();
+  if (this->scene == NULL) return;
+  _begin(clear);
+  /* the BVH skips whole groups of instances outside the frustum */
+  const Mat4x4 view_projection = mul(uniforms.projection, uniforms.view);
+  this->scene->query_frustum(view_projection, this->visible);
+  if (this->occlusion != NULL) {
+    this->occlusion->begin(view_projection);
+    for (uint32_t i = 0; i < this->visible.size(); i++) {
+      const SceneInstance& instance = this->scene->get_instance(this->visible[i]);
+      if (instance.occluder)
+        this->occlusion->add_occluder(*instance.model, instance.transform);
+    }
+  }
+  for (uint32_t i = 0; i < this->visible.size(); i++) {
+    const SceneInstance& instance = this->scene->get_instance(this->visible[i]);
+    _draw_model(*instance.model, instance.transform, instance.anim_id, instance.time);
   }
+  _end();
 }
 
 
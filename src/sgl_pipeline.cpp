@@ -1,18 +1,74 @@
 #include "sgl_pipeline.h"
 
+#include <algorithm>
+
+#if defined(PARALLEL_BACKEND_OPENMP)
 #include <omp.h>
+#endif
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define SGL_SSE2
+#endif
 
 namespace sgl {
 
+/**
+Call func(DepthBuffer<format, reversed>()) using the depth buffer type of the
+given depth format.
+@return: Returns false if the format is not a depth format.
+**/
+template <typename Func>
+static bool
+_with_depth_buffer(const PixelFormat &format, const bool &reversed, const Func &func) {
+  switch (format) {
+  case PixelFormat::pixel_format_float64:
+    if (reversed) func(DepthBuffer<PixelFormat::pixel_format_float64, true>());
+    else func(DepthBuffer<PixelFormat::pixel_format_float64, false>());
+    return true;
+  case PixelFormat::pixel_format_float32:
+    if (reversed) func(DepthBuffer<PixelFormat::pixel_format_float32, true>());
+    else func(DepthBuffer<PixelFormat::pixel_format_float32, false>());
+    return true;
+  case PixelFormat::pixel_format_depth24:
+    if (reversed) func(DepthBuffer<PixelFormat::pixel_format_depth24, true>());
+    else func(DepthBuffer<PixelFormat::pixel_format_depth24, false>());
+    return true;
+  case PixelFormat::pixel_format_depth16:
+    if (reversed) func(DepthBuffer<PixelFormat::pixel_format_depth16, true>());
+    else func(DepthBuffer<PixelFormat::pixel_format_depth16, false>());
+    return true;
+  default:
+    return false;
+  }
+}
+
 void Pipeline::_zero_init()
 {
   targets.color = NULL;
   targets.depth = NULL;
   shaders.VS = NULL;
   shaders.FS = NULL;
+  shaders.UP = default_UP;
+  shaders.VS_instanced = default_instanced_VS;
+  ppl.SkippedInstances = 0;
   ppl.num_threads = max(get_cpu_cores(), 1);
+  ppl.thread_pool = ThreadPool::get_default();
   ppl.backface_culling = true;
   ppl.do_depth_test = true;
+  ppl.early_depth_test = false;
+  ppl.reverse_depth = false;
+  ppl.guard_band = MAX_RASTER_EXTENT;
+  ppl.clip_extent_x = 1.0;
+  ppl.clip_extent_y = 1.0;
+  ppl.hiz_w = 0;
+  ppl.hiz_h = 0;
+  ppl.hiz_depth = NULL;
+  ppl.hiz_valid = false;
+  ppl.num_tiles_x = 0;
+  ppl.num_tiles_y = 0;
 }
 
 Pipeline::Pipeline() {
@@ -88,14 +144,17 @@ void Pipeline::draw(
   ppl.Vertices.clear();
   ppl.Triangles.clear();
 
+  /* Compute per-draw uniforms. */
+  const Uniforms &draw_uniforms = run_uniform_prologue(uniforms);
+
   /* Stage I: Vertex processing. */
-  vertex_processing(vertices, uniforms);
+  vertex_processing(vertices, draw_uniforms);
 
   /* Stage II: Vertex post-processing. */
   vertex_post_processing(indices);
 
   /* Step III: Rasterization & fragment processing */
-  fragment_processing_MT(uniforms, ppl.num_threads);
+  fragment_processing_MT(draw_uniforms, ppl.num_threads);
 }
 
 void Pipeline::draw(
@@ -110,214 +169,870 @@ void Pipeline::draw(
   );
 }
 
+void Pipeline::draw(
+  const VertexBuffer_t& vertices,
+  const IndexBuffer_t& indices,
+  const int32_t& first_index,
+  const int32_t& index_count,
+  const int32_t& base_vertex,
+  const Uniforms& uniforms)
+{
+  if (shaders.VS == NULL || shaders.FS == NULL)
+    return;
+
+  /* Clear cached data generated from previous call. */
+  ppl.Vertices.clear();
+  ppl.Triangles.clear();
+
+  /* Compute per-draw uniforms. */
+  const Uniforms &draw_uniforms = run_uniform_prologue(uniforms);
+
+  /* Stage I: Vertex fetch & processing. */
+  if (!vertex_fetch(vertices, indices, first_index, index_count, base_vertex))
+    return;
+  vertex_processing_fetched(vertices, draw_uniforms, shaders.VS);
+
+  /* Stage II: Vertex post-processing. */
+  vertex_post_processing(ppl.FetchIndices);
+
+  /* Step III: Rasterization & fragment processing */
+  fragment_processing_MT(draw_uniforms, ppl.num_threads);
+}
+
+void Pipeline::draw(
+  const int32_t & vbo, 
+  const int32_t & ibo, 
+  const int32_t & first_index,
+  const int32_t & index_count,
+  const int32_t & base_vertex,
+  const Uniforms& uniforms)
+{
+  this->draw(
+    buffers.VertexBuffers[vbo], 
+    buffers.IndexBuffers[ibo], 
+    first_index,
+    index_count,
+    base_vertex,
+    uniforms
+  );
+}
+
+void Pipeline::draw_instanced(
+  const VertexBuffer_t& vertices,
+  const IndexBuffer_t& indices,
+  const Uniforms& uniforms,
+  const InstanceData* instances,
+  const int32_t& instance_count)
+{
+  if (shaders.VS_instanced == NULL || shaders.FS == NULL || instance_count <= 0)
+    return;
+
+  /* Clear cached data generated from previous call. */
+  ppl.Vertices.clear();
+  ppl.Triangles.clear();
+
+  /* Compute per-draw uniforms & per-instance derived variables. */
+  const Uniforms &draw_uniforms = run_instanced_prologue(uniforms, instances, instance_count);
+
+  const int n_instances = int(ppl.Instances.size());
+  const int batch_size = get_instance_batch_size(indices, n_instances);
+  for (int first = 0; first < n_instances; first += batch_size) {
+    const int count = min(batch_size, n_instances - first);
+    /* Stage I: Vertex processing (all instances of the batch at once). */
+    vertex_processing_instanced(vertices, draw_uniforms, first, count);
+
+    /* Stage II: Vertex post-processing. */
+    repeat_instance_indices(indices, int(vertices.size()), count);
+    vertex_post_processing(ppl.InstanceIndices);
+
+    /* Step III: Rasterization & fragment processing */
+    fragment_processing_MT(draw_uniforms, ppl.num_threads);
+  }
+}
+
+void Pipeline::draw_instanced(
+  const int32_t & vbo, 
+  const int32_t & ibo, 
+  const Uniforms& uniforms,
+  const InstanceData* instances,
+  const int32_t& instance_count)
+{
+  this->draw_instanced(
+    buffers.VertexBuffers[vbo], 
+    buffers.IndexBuffers[ibo], 
+    uniforms,
+    instances,
+    instance_count
+  );
+}
+
+void Pipeline::submit(const CommandBuffer& commands)
+{
+  commands.get_submit_order(ppl.DrawOrder);
+  const int n_draws = int(ppl.DrawOrder.size());
+  int i_draw = 0;
+  while (i_draw < n_draws) {
+    /* combine whole draw calls until the pass has enough triangles */
+    ppl.Draws.clear();
+    int n_tris = 0;
+    while (i_draw < n_draws && n_tris < SUBMIT_BATCH_TRIANGLES) {
+      const DrawCommand &command = commands.get_draw(ppl.DrawOrder[i_draw++]);
+      DrawCall_gl draw;
+      draw.command = &command;
+      draw.uniforms = &commands.get_uniforms(command);
+      ppl.Draws.push_back(draw);
+      n_tris += (command.index_count < 0 ? int(command.indices->size()) : command.index_count) / 3;
+    }
+    draw_combined();
+  }
+}
+
+void
+Pipeline::draw_combined() {
+  /* Clear cached data generated from previous call. */
+  ppl.Vertices.clear();
+  ppl.Triangles.clear();
+
+  /* Stage I: Vertex fetch & processing. */
+  vertex_processing_draws();
+
+  /* Stage II: Vertex post-processing. */
+  vertex_post_processing_draws();
+
+  /* Step III: Rasterization & fragment processing */
+  triangle_setup_and_binning(&ppl.Draws);
+  for (uint32_t i = 0; i < ppl.Draws.size(); i++) {
+    if (ppl.Draws[i].command->depth_test && ppl.Draws[i].command->early_depth_test) {
+      update_depth_hierarchy();
+      break;
+    }
+  }
+  const int n_tiles = ppl.num_tiles_x * ppl.num_tiles_y;
+  parallel_for(n_tiles, [&](int tile_id) {
+    rasterize_tile_draws(tile_id);
+  });
+}
+
+void
+Pipeline::submit_sequential(const CommandBuffer &commands) {
+  const VS_func_t VS = shaders.VS;
+  const FS_func_t FS = shaders.FS;
+  const UP_func_t UP = shaders.UP;
+  const bool backface_culling = ppl.backface_culling;
+  const bool do_depth_test = ppl.do_depth_test;
+  const bool early_depth_test = ppl.early_depth_test;
+  /* the uniform prologue was already run when recording */
+  shaders.UP = NULL;
+  commands.get_submit_order(ppl.DrawOrder);
+  for (uint32_t i = 0; i < ppl.DrawOrder.size(); i++) {
+    const DrawCommand &command = commands.get_draw(ppl.DrawOrder[i]);
+    const Uniforms &uniforms = commands.get_uniforms(command);
+    shaders.VS = command.VS;
+    shaders.FS = command.FS;
+    ppl.backface_culling = command.backface_culling;
+    ppl.do_depth_test = command.depth_test;
+    ppl.early_depth_test = command.early_depth_test;
+    if (command.index_count < 0)
+      this->draw(*command.vertices, *command.indices, uniforms);
+    else
+      this->draw(*command.vertices, *command.indices, command.first_index,
+        command.index_count, command.base_vertex, uniforms);
+  }
+  shaders.VS = VS;
+  shaders.FS = FS;
+  shaders.UP = UP;
+  ppl.backface_culling = backface_culling;
+  ppl.do_depth_test = do_depth_test;
+  ppl.early_depth_test = early_depth_test;
+}
+
+void
+Pipeline::vertex_processing_draws() {
+  /* Vertex fetch of the ranged draw calls, each one reuses ppl.FetchVertices
+  & ppl.FetchIndices, so they are fetched one by one and copied. */
+  ppl.DrawFetchVertices.clear();
+  ppl.DrawIndices.clear();
+  int n_verts = 0, n_tasks = 0;
+  for (uint32_t i = 0; i < ppl.Draws.size(); i++) {
+    DrawCall_gl &draw = ppl.Draws[i];
+    const DrawCommand &command = *draw.command;
+    draw.first_vertex = n_verts;
+    draw.first_task = n_tasks;
+    if (command.index_count < 0) {
+      draw.first_fetch = -1;
+      draw.n_vertices = int(command.vertices->size());
+      draw.first_index = 0;
+      draw.n_indices = int(command.indices->size());
+    }
+    else {
+      draw.first_fetch = int(ppl.DrawFetchVertices.size());
+      draw.n_vertices = 0;
+      draw.first_index = int(ppl.DrawIndices.size());
+      draw.n_indices = 0;
+      if (vertex_fetch(*command.vertices, *command.indices, command.first_index,
+                       command.index_count, command.base_vertex)) {
+        draw.n_vertices = int(ppl.FetchVertices.size());
+        draw.n_indices = int(ppl.FetchIndices.size());
+        ppl.DrawFetchVertices.insert(ppl.DrawFetchVertices.end(), 
+          ppl.FetchVertices.begin(), ppl.FetchVertices.end());
+        ppl.DrawIndices.insert(ppl.DrawIndices.end(), 
+          ppl.FetchIndices.begin(), ppl.FetchIndices.end());
+      }
+    }
+    n_verts += draw.n_vertices;
+    n_tasks += (draw.n_vertices + VERTEX_CHUNK_SIZE - 1) / VERTEX_CHUNK_SIZE;
+  }
+  /* Vertices of all the draw calls are shaded in a single parallel job, each
+  task shades a chunk of a single draw call. */
+  const std::vector<DrawCall_gl> &draws = ppl.Draws;
+  ppl.Vertices.resize(n_verts);
+  parallel_for(n_tasks, [&](int task_id) {
+    const DrawCall_gl &draw = *(std::upper_bound(draws.begin(), draws.end(), task_id, 
+      [](const int &t, const DrawCall_gl &d) { return t < d.first_task; }) - 1);
+    const VertexBuffer_t &vertex_buffer = *draw.command->vertices;
+    const VS_func_t vertex_shader = draw.command->VS;
+    const int i_start = (task_id - draw.first_task) * VERTEX_CHUNK_SIZE;
+    const int i_end = min(i_start + VERTEX_CHUNK_SIZE, draw.n_vertices);
+    Vertex_gl *vertices_out = &ppl.Vertices[draw.first_vertex];
+    for (int i_vert = i_start; i_vert < i_end; i_vert++) {
+      const int i_in = (draw.first_fetch < 0) ? i_vert : ppl.DrawFetchVertices[draw.first_fetch + i_vert];
+      vertex_shader(*draw.uniforms, vertex_buffer[i_in], vertices_out[i_vert]);
+      vertices_out[i_vert].gl_InstanceID = 0;
+    }
+  });
+}
+
+void
+Pipeline::vertex_post_processing_draws() {
+  ppl.PrimitiveChunks.clear();
+  for (uint32_t i = 0; i < ppl.Draws.size(); i++) {
+    DrawCall_gl &draw = ppl.Draws[i];
+    draw.first_chunk = int(ppl.PrimitiveChunks.size());
+    const int32_t *indices = (draw.first_fetch < 0) ? 
+      draw.command->indices->data() : ppl.DrawIndices.data();
+    const int n_tris = draw.n_indices / 3;
+    for (int i_tri = 0; i_tri < n_tris; i_tri += PRIMITIVE_CHUNK_SIZE) {
+      PrimitiveChunk_gl chunk;
+      chunk.indices = indices + draw.first_index + i_tri * 3;
+      chunk.base_vertex = draw.first_vertex;
+      chunk.n_triangles = min(PRIMITIVE_CHUNK_SIZE, n_tris - i_tri);
+      ppl.PrimitiveChunks.push_back(chunk);
+    }
+  }
+  assemble_and_clip_chunks();
+  const int n_chunks = int(ppl.PrimitiveChunks.size());
+  for (uint32_t i = 0; i < ppl.Draws.size(); i++) {
+    DrawCall_gl &draw = ppl.Draws[i];
+    const int end_chunk = (i + 1 < ppl.Draws.size()) ? ppl.Draws[i + 1].first_chunk : n_chunks;
+    draw.first_triangle = int(ppl.ChunkOffsets[draw.first_chunk]);
+    draw.n_triangles = int(ppl.ChunkOffsets[end_chunk]) - draw.first_triangle;
+  }
+}
+
+const Uniforms &
+Pipeline::run_instanced_prologue(const Uniforms &uniforms, const InstanceData *instances,
+                                 const int &instance_count) {
+  /* always work on a copy, `uniforms.instances` is set by the pipeline */
+  if (&uniforms != &ppl.uniforms)
+    ppl.uniforms = uniforms;
+  if (shaders.UP != NULL)
+    shaders.UP(ppl.uniforms);
+  const Mat4x4 view_projection = mul(ppl.uniforms.projection, ppl.uniforms.view);
+  ppl.Instances.resize(instance_count);
+  int n_instances = 0;
+  for (int i = 0; i < instance_count; i++) {
+    /* the bones of the instance must fit in Uniforms::bone_matrices */
+    const int32_t bone_offset = instances[i].bone_offset;
+    const int32_t bone_count = instances[i].bone_count;
+    if (bone_count > 0 && (bone_offset < 0 || bone_offset > MAX_NODES_PER_MODEL - bone_count))
+      continue;
+    InstanceData &instance = ppl.Instances[n_instances++];
+    instance = instances[i];
+    const Mat4x4 &model = instance.model;
+    instance.model_view_projection = mul(view_projection, model);
+    Mat3x3 linear(
+      model.i11, model.i12, model.i13,
+      model.i21, model.i22, model.i23,
+      model.i31, model.i32, model.i33);
+    instance.normal_matrix = transpose(linear.inverse());
+  }
+  ppl.Instances.resize(n_instances);
+  ppl.SkippedInstances = instance_count - n_instances;
+  ppl.uniforms.instances = ppl.Instances.data();
+  return ppl.uniforms;
+}
+
+void
+Pipeline::repeat_instance_indices(const IndexBuffer_t &index_buffer, const int &n_verts,
+                                  const int &instance_count) {
+  const int n_indices = int(index_buffer.size());
+  ppl.InstanceIndices.resize(size_t(n_indices) * instance_count);
+  parallel_for(instance_count, [&](int i_instance) {
+    const int base_vertex = i_instance * n_verts;
+    int32_t *out = &ppl.InstanceIndices[size_t(i_instance) * n_indices];
+    for (int i = 0; i < n_indices; i++)
+      out[i] = index_buffer[i] + base_vertex;
+  });
+}
+
+int
+Pipeline::get_instance_batch_size(const IndexBuffer_t &index_buffer, const int &instance_count) {
+  const int n_tris = max(int(index_buffer.size()) / 3, 1);
+  return min(max(INSTANCE_BATCH_TRIANGLES / n_tris, 1), instance_count);
+}
+
+void
+Pipeline::vertex_processing_instanced(const VertexBuffer_t &vertex_buffer,
+                                      const Uniforms &uniforms, const int &first_instance,
+                                      const int &instance_count) {
+  /* chunks of all the instances are processed in a single parallel job */
+  const int n_verts = int(vertex_buffer.size());
+  const int n_chunks_per_instance = (n_verts + VERTEX_CHUNK_SIZE - 1) / VERTEX_CHUNK_SIZE;
+  const VS_instanced_func_t vertex_shader = shaders.VS_instanced;
+  ppl.Vertices.resize(size_t(n_verts) * instance_count);
+  parallel_for(n_chunks_per_instance * instance_count, [&](int chunk_id) {
+    const int i_instance = chunk_id / n_chunks_per_instance;
+    const InstanceData &instance = uniforms.instances[first_instance + i_instance];
+    const int i_start = (chunk_id % n_chunks_per_instance) * VERTEX_CHUNK_SIZE;
+    const int i_end = min(i_start + VERTEX_CHUNK_SIZE, n_verts);
+    Vertex_gl *vertices_out = &ppl.Vertices[size_t(i_instance) * n_verts];
+    for (int i_vert = i_start; i_vert < i_end; i_vert++) {
+      vertex_shader(uniforms, instance, vertex_buffer[i_vert], vertices_out[i_vert]);
+      vertices_out[i_vert].gl_InstanceID = first_instance + i_instance;
+    }
+  });
+}
+
+const Uniforms &
+Pipeline::run_uniform_prologue(const Uniforms &uniforms) {
+  if (shaders.UP == NULL)
+    return uniforms;
+  /* the caller may pass ppl.uniforms from the previous draw call */
+  if (&uniforms != &ppl.uniforms)
+    ppl.uniforms = uniforms;
+  shaders.UP(ppl.uniforms);
+  return ppl.uniforms;
+}
+
 void
 Pipeline::vertex_processing(const VertexBuffer_t &vertex_buffer,
                             const Uniforms &uniforms) {
-  for (uint32_t i_vert = 0; i_vert < vertex_buffer.size(); i_vert++) {
-    Vertex_gl vertex_out;
-    /* Map vertex from model local space to homogeneous clip space and stores to
-    "gl_Position". */
-    shaders.VS(uniforms, vertex_buffer[i_vert], vertex_out);
-    ppl.Vertices.push_back(vertex_out);
+  vertex_processing(vertex_buffer, uniforms, shaders.VS);
+}
+
+bool
+Pipeline::vertex_fetch(const VertexBuffer_t &vertex_buffer, 
+                       const IndexBuffer_t &index_buffer, const int &first_index,
+                       const int &index_count, const int &base_vertex) {
+  ppl.FetchVertices.clear();
+  ppl.FetchIndices.clear();
+  if (first_index < 0 || index_count < 0 || 
+      int64_t(first_index) + index_count > int64_t(index_buffer.size())) {
+    printf("Invalid index range.\n");
+    return false;
+  }
+  const int n_verts = int(vertex_buffer.size());
+  /* VertexRemap is kept all -1 between calls, so it only needs to be 
+  initialized when the vertex buffer grows */
+  if (int(ppl.VertexRemap.size()) < n_verts)
+    ppl.VertexRemap.resize(n_verts, -1);
+  ppl.FetchIndices.resize(index_count);
+  bool valid = true;
+  for (int i = 0; i < index_count; i++) {
+    const int64_t i_vert = int64_t(index_buffer[first_index + i]) + base_vertex;
+    if (i_vert < 0 || i_vert >= n_verts) {
+      valid = false;
+      break;
+    }
+    int32_t &remapped = ppl.VertexRemap[i_vert];
+    if (remapped < 0) {
+      remapped = int32_t(ppl.FetchVertices.size());
+      ppl.FetchVertices.push_back(int32_t(i_vert));
+    }
+    ppl.FetchIndices[i] = remapped;
   }
+  /* only reset the entries touched by this call */
+  for (uint32_t i = 0; i < ppl.FetchVertices.size(); i++)
+    ppl.VertexRemap[ppl.FetchVertices[i]] = -1;
+  if (!valid) {
+    printf("Vertex index out of range.\n");
+    ppl.FetchVertices.clear();
+    ppl.FetchIndices.clear();
+  }
+  return valid;
 }
 
 void
 Pipeline::vertex_post_processing(const std::vector<int> &index_buffer) {
-  for (uint32_t i_tri = 0; i_tri < index_buffer.size() / 3; i_tri++) {
-    /* Step 2.1: Primitive assembly. */
-    Triangle_gl tri_gl;
-    tri_gl.v[0] = ppl.Vertices[index_buffer[i_tri * 3]];
-    tri_gl.v[1] = ppl.Vertices[index_buffer[i_tri * 3 + 1]];
-    tri_gl.v[2] = ppl.Vertices[index_buffer[i_tri * 3 + 2]];
-    /** Step 2.2: Clipping.
-    @note: For detailed explanation of how to do clipping in homogeneous space,
-    see: "How to clip in homogeneous space?" in "doc/graphics_pipeline.md".
-    **/
-    clip_triangle(tri_gl, ppl.Triangles);
+  const int n_tris = int(index_buffer.size() / 3);
+  ppl.PrimitiveChunks.clear();
+  for (int i_tri = 0; i_tri < n_tris; i_tri += PRIMITIVE_CHUNK_SIZE) {
+    PrimitiveChunk_gl chunk;
+    chunk.indices = &index_buffer[i_tri * 3];
+    chunk.base_vertex = 0;
+    chunk.n_triangles = min(PRIMITIVE_CHUNK_SIZE, n_tris - i_tri);
+    ppl.PrimitiveChunks.push_back(chunk);
   }
+  assemble_and_clip_chunks();
 }
 
 void
-Pipeline::fragment_processing(const Uniforms &uniforms) {
-  for (uint32_t i_tri = 0; i_tri < ppl.Triangles.size(); i_tri++) {
-    /* Step 3.1: Convert clip space to NDC space (perspective divide) */
-    Triangle_gl tri_gl = ppl.Triangles[i_tri];
-    Vertex_gl &v0 = tri_gl.v[0];
-    Vertex_gl &v1 = tri_gl.v[1];
-    Vertex_gl &v2 = tri_gl.v[2];
-    const Vec3 iz = Vec3(1.0 / v0.gl_Position.w, 1.0 / v1.gl_Position.w, 1.0 / v2.gl_Position.w);
-    Vec3 p0_NDC = v0.gl_Position.xyz() * iz.i[0];
-    Vec3 p1_NDC = v1.gl_Position.xyz() * iz.i[1];
-    Vec3 p2_NDC = v2.gl_Position.xyz() * iz.i[2];
-    /* Step 3.2: Convert NDC space to window space */
-    /**
-    @note: In NDC space, x,y,z is between [-1, +1]
-    NDC space       window space
-    -----------------------------
-    x: [-1, +1]     x: [0, +w]
-    y: [-1, +1]     y: [0, +h]
-    z: [-1, +1]     z: [0, +1]
-    @note: The window space origin is at the lower-left corner of the screen,
-    with +x axis pointing to the right and +y axis pointing to the top.
-    **/
-    const double render_width = double(this->targets.color->w);
-    const double render_height = double(this->targets.color->h);
-    const Vec3 scale_factor = Vec3(render_width, render_height, 1.0);
-    const Vec4 p0 = Vec4(0.5 * (p0_NDC + 1.0) * scale_factor, iz.i[0]);
-    const Vec4 p1 = Vec4(0.5 * (p1_NDC + 1.0) * scale_factor, iz.i[1]);
-    const Vec4 p2 = Vec4(0.5 * (p2_NDC + 1.0) * scale_factor, iz.i[2]);
-    double area = edge(p0, p1, p2);
-    if (isnan(area) || isinf(area)) continue; /* Ignore invalid triangles. */
-    if (area < 0.0 && ppl.backface_culling) continue; /* Backface culling. */
-    /** @note: p0, p1, p2 are actually gl_FragCoord. **/
-    /* Step 3.3: Rasterization. */
-    Vec4 rect = get_minimum_rect(p0, p1, p2);
-    /* precomupte: divide by real z */
-    v0 *= iz.i[0];
-    v1 *= iz.i[1];
-    v2 *= iz.i[2];
-    Vec4 p;
-    for (p.y = floor(rect.i[1]) + 0.5; p.y < rect.i[3]; p.y += 1.0) {
-      for (p.x = floor(rect.i[0]) + 0.5; p.x < rect.i[2]; p.x += 1.0) {
-        /**
-        @note: here the winding order is important,
-        and w_i are calculated in window space
-        **/
-        Vec3 w = Vec3(edge(p1, p2, p), edge(p2, p0, p), edge(p0, p1, p));
-        /* discard pixel if it is outside the triangle area */
-        bool all_pos = (w.i[0] >= 0.0 && w.i[1] >= 0.0 && w.i[2] >= 0.0);
-        bool all_neg = (w.i[0] <= 0.0 && w.i[1] <= 0.0 && w.i[2] <= 0.0);
-        if (!all_pos && !all_neg) continue;
-        /* interpolate vertex */
-        w /= area;
-        Vertex_gl v_lerp = v0 * w.i[0] + v1 * w.i[1] + v2 * w.i[2];
-        double z_real = 1.0 / (iz.i[0] * w.i[0] + iz.i[1] * w.i[1] + iz.i[2] * w.i[2]);
-        v_lerp *= z_real;
-        /* Step 3.4: Assemble fragment and render pixel. */
-        Fragment_gl fragment;
-        assemble_fragment(v_lerp, fragment);
-        /*
-        v_lerp.gl_Position.z / v_lerp.gl_Position.w is the depth value in NDC 
-        space, which is in range [-1, +1], then we need to map it to [0, +1]. 
-
-        * Although OpenGL's depth range is [-1, +1], but if you want to read the 
-          depth value from a depth texture, the value is further normalized to 
-          [0, +1]. So here for convenience we directly convert it to [0, +1]
-          because reading from depth buffer is rather common in graphics 
-          programming. 
-        */
-        double gl_FragDepth = ((v_lerp.gl_Position.z / v_lerp.gl_Position.w) + 1.0) * 0.5;
-        fragment.gl_FragCoord = Vec4(p.x, p.y, gl_FragDepth, 1.0 / v_lerp.gl_Position.w);
-        Vec4 color_out;
-        bool is_discarded = false;
-        shaders.FS(uniforms, fragment, color_out, is_discarded, gl_FragDepth);
-        /* Step 3.5: Fragment processing */
-        if (!is_discarded) {
-          write_render_targets(fragment.gl_FragCoord.xy(), color_out,
-            gl_FragDepth);
-        }
-      }
+Pipeline::assemble_and_clip_chunks() {
+  const int n_chunks = int(ppl.PrimitiveChunks.size());
+  /* x & y clip planes: the render target (NDC [-1, +1]) extended by the guard
+  band on each side, limited by the largest extent the rasterizer supports */
+  const int render_width = this->targets.color->w;
+  const int render_height = this->targets.color->h;
+  const int guard_band_x = max(min(ppl.guard_band, (MAX_RASTER_EXTENT - render_width) / 2), 0);
+  const int guard_band_y = max(min(ppl.guard_band, (MAX_RASTER_EXTENT - render_height) / 2), 0);
+  ppl.clip_extent_x = 1.0 + 2.0 * guard_band_x / render_width;
+  ppl.clip_extent_y = 1.0 + 2.0 * guard_band_y / render_height;
+  /* reuse chunk buffers from the previous draw call to avoid re-allocation */
+  if (int(ppl.ChunkTriangles.size()) < n_chunks) {
+    ppl.ChunkTriangles.resize(n_chunks);
+    ppl.ChunkVertices.resize(n_chunks);
+  }
+  parallel_for(n_chunks, [&](int chunk_id) {
+    std::vector<Triangle_gl> &triangles_out = ppl.ChunkTriangles[chunk_id];
+    std::vector<Vertex_gl> &vertices_out = ppl.ChunkVertices[chunk_id];
+    triangles_out.clear();
+    vertices_out.clear();
+    const PrimitiveChunk_gl &chunk = ppl.PrimitiveChunks[chunk_id];
+    for (int i_tri = 0; i_tri < chunk.n_triangles; i_tri++) {
+      /* Step 2.1: Primitive assembly. */
+      Triangle_gl tri_gl;
+      tri_gl.v[0] = uint32_t(chunk.indices[i_tri * 3] + chunk.base_vertex);
+      tri_gl.v[1] = uint32_t(chunk.indices[i_tri * 3 + 1] + chunk.base_vertex);
+      tri_gl.v[2] = uint32_t(chunk.indices[i_tri * 3 + 2] + chunk.base_vertex);
+      /** Step 2.2: Clipping.
+      @note: For detailed explanation of how to do clipping in homogeneous space,
+      see: "How to clip in homogeneous space?" in "doc/graphics_pipeline.md".
+      **/
+      clip_triangle(tri_gl, triangles_out, vertices_out);
     }
+  });
+  /* Step 2.3: Concatenate chunk outputs in chunk order, vertices generated by
+  clipping are moved to the end of the post-transform vertex array. */
+  std::vector<uint32_t> &offsets = ppl.ChunkOffsets;
+  std::vector<uint32_t> vertex_offsets(n_chunks + 1, 0);
+  offsets.assign(n_chunks + 1, 0);
+  vertex_offsets[0] = uint32_t(ppl.Vertices.size());
+  for (int chunk_id = 0; chunk_id < n_chunks; chunk_id++) {
+    offsets[chunk_id + 1] = offsets[chunk_id] + uint32_t(ppl.ChunkTriangles[chunk_id].size());
+    vertex_offsets[chunk_id + 1] = vertex_offsets[chunk_id] + uint32_t(ppl.ChunkVertices[chunk_id].size());
   }
+  ppl.Triangles.resize(offsets[n_chunks]);
+  ppl.Vertices.resize(vertex_offsets[n_chunks]);
+  parallel_for(n_chunks, [&](int chunk_id) {
+    const std::vector<Triangle_gl> &triangles = ppl.ChunkTriangles[chunk_id];
+    Triangle_gl *triangles_out = &ppl.Triangles[0] + offsets[chunk_id];
+    for (uint32_t i_tri = 0; i_tri < triangles.size(); i_tri++) {
+      for (int k = 0; k < 3; k++) {
+        const uint32_t id = triangles[i_tri].v[k];
+        triangles_out[i_tri].v[k] = (id & CLIPPED_VERTEX_BIT) ? 
+          vertex_offsets[chunk_id] + (id & ~CLIPPED_VERTEX_BIT) : id;
+      }
+    }
+    std::copy(ppl.ChunkVertices[chunk_id].begin(), ppl.ChunkVertices[chunk_id].end(),
+      ppl.Vertices.begin() + vertex_offsets[chunk_id]);
+  });
+}
+
+void
+Pipeline::fragment_processing(const Uniforms &uniforms) {
+  /* Step 3.1 & 3.2: Triangle setup and binning. */
+  triangle_setup_and_binning();
+  prepare_depth_hierarchy();
+  /* Step 3.3: Rasterization, tile by tile. */
+  const int n_tiles = ppl.num_tiles_x * ppl.num_tiles_y;
+  for (int tile_id = 0; tile_id < n_tiles; tile_id++)
+    rasterize_tile(tile_id, uniforms);
 }
 
 void
 Pipeline::fragment_processing_MT(const Uniforms &uniforms,
                                  const int &num_threads) {
-#pragma omp parallel for num_threads(num_threads)
-  for (int thread_id = 0; thread_id < num_threads; thread_id++) {
+  /* Step 3.1 & 3.2: Triangle setup and binning. */
+  triangle_setup_and_binning();
+  prepare_depth_hierarchy();
+  /* Step 3.3: Rasterization. */
+  /**
+  @note: sort-middle rendering in MT mode. The render target is split into 
+  tiles of RASTER_TILE_SIZE x RASTER_TILE_SIZE pixels, and each thread takes
+  one tile at a time and rasterizes all the triangles binned into it. Since a 
+  tile is only touched by a single thread, the color & depth data of the tile 
+  stay in that core's cache, and no triangle is set up more than once. Tiles
+  are scheduled dynamically to balance workload among workers.
+  **/
+  const int n_tiles = ppl.num_tiles_x * ppl.num_tiles_y;
+  parallel_for(n_tiles, [&](int tile_id) {
+    rasterize_tile(tile_id, uniforms);
+  }, num_threads);
+}
+
+void
+Pipeline::triangle_setup_and_binning(const std::vector<DrawCall_gl> *draws) {
+  const int render_width = this->targets.color->w;
+  const int render_height = this->targets.color->h;
+  ppl.num_tiles_x = (render_width + RASTER_TILE_SIZE - 1) / RASTER_TILE_SIZE;
+  ppl.num_tiles_y = (render_height + RASTER_TILE_SIZE - 1) / RASTER_TILE_SIZE;
+  const int n_tiles = ppl.num_tiles_x * ppl.num_tiles_y;
+  /* reuse bins from the previous draw call to avoid re-allocation */
+  if (int(ppl.TileBins.size()) != n_tiles)
+    ppl.TileBins.resize(n_tiles);
+  for (int tile_id = 0; tile_id < n_tiles; tile_id++)
+    ppl.TileBins[tile_id].clear();
+
+  /* Step 3.1 & 3.2: Set up all triangles concurrently. */
+  const int n_tris = int(ppl.Triangles.size());
+  const int n_chunks = (n_tris + PRIMITIVE_CHUNK_SIZE - 1) / PRIMITIVE_CHUNK_SIZE;
+  ppl.Setups.resize(n_tris);
+  parallel_for(n_chunks, [&](int chunk_id) {
+    const int i_start = chunk_id * PRIMITIVE_CHUNK_SIZE;
+    const int i_end = min(i_start + PRIMITIVE_CHUNK_SIZE, n_tris);
+    if (draws == NULL) {
+      for (int i_tri = i_start; i_tri < i_end; i_tri++)
+        setup_triangle(ppl.Triangles[i_tri], ppl.Setups[i_tri], ppl.backface_culling);
+      return;
+    }
+    /* find the draw call of the first triangle, then walk forward */
+    const DrawCall_gl *draw = draws->data() - 1 + (std::upper_bound(draws->begin(), draws->end(),
+      i_start, [](const int &i_tri, const DrawCall_gl &d) { return i_tri < d.first_triangle; }) - 
+      draws->begin());
+    for (int i_tri = i_start; i_tri < i_end; i_tri++) {
+      while (i_tri >= draw->first_triangle + draw->n_triangles)
+        draw++;
+      setup_triangle(ppl.Triangles[i_tri], ppl.Setups[i_tri], draw->command->backface_culling);
+    }
+  });
+
+  /* Bin each triangle into all the tiles it overlaps (in submission order). */
+  for (int i_tri = 0; i_tri < n_tris; i_tri++) {
+    const IVec4 &bounds = ppl.Setups[i_tri].bounds;
+    if (bounds.x > bounds.z || bounds.y > bounds.w)
+      continue; /* Triangle is culled or does not cover any pixel center. */
+    const int tx_s = bounds.x / RASTER_TILE_SIZE, tx_e = bounds.z / RASTER_TILE_SIZE;
+    const int ty_s = bounds.y / RASTER_TILE_SIZE, ty_e = bounds.w / RASTER_TILE_SIZE;
+    for (int ty = ty_s; ty <= ty_e; ty++)
+      for (int tx = tx_s; tx <= tx_e; tx++)
+        ppl.TileBins[ty * ppl.num_tiles_x + tx].push_back(uint32_t(i_tri));
+  }
+}
+
+void
+Pipeline::setup_triangle(const Triangle_gl &tri_gl, TriangleSetup_gl &setup,
+                         const bool &backface_culling) {
+  const int render_width = this->targets.color->w;
+  const int render_height = this->targets.color->h;
+  const Vec3 scale_factor = Vec3(double(render_width), double(render_height), 1.0);
+  setup.bounds = IVec4(0, 0, -1, -1); /* mark as empty */
+  setup.instance_id = ppl.Vertices[tri_gl.v[0]].gl_InstanceID;
+  /* Step 3.1: Convert clip space to NDC space (perspective divide) */
+  const Vertex_gl *v[3] = {
+    &ppl.Vertices[tri_gl.v[0]], &ppl.Vertices[tri_gl.v[1]], &ppl.Vertices[tri_gl.v[2]]
+  };
+  const Vertex_gl &v0 = *v[0];
+  const Vertex_gl &v1 = *v[1];
+  const Vertex_gl &v2 = *v[2];
+  const Vec3 iz = Vec3(1.0 / v0.gl_Position.w, 1.0 / v1.gl_Position.w, 1.0 / v2.gl_Position.w);
+  Vec3 p0_NDC = v0.gl_Position.xyz() * iz.i[0];
+  Vec3 p1_NDC = v1.gl_Position.xyz() * iz.i[1];
+  Vec3 p2_NDC = v2.gl_Position.xyz() * iz.i[2];
+  /* Step 3.2: Convert NDC space to window space */
+  /**
+  @note: In NDC space, x,y,z is between [-1, +1]
+  NDC space       window space
+  -----------------------------
+  x: [-1, +1]     x: [0, +w]
+  y: [-1, +1]     y: [0, +h]
+  z: [-1, +1]     z: [0, +1]
+  @note: The window space origin is at the lower-left corner of the screen,
+  with +x axis pointing to the right and +y axis pointing to the top.
+  **/
+  Vec4 p[3];
+  p[0] = Vec4(0.5 * (p0_NDC + 1.0) * scale_factor, iz.i[0]);
+  p[1] = Vec4(0.5 * (p1_NDC + 1.0) * scale_factor, iz.i[1]);
+  p[2] = Vec4(0.5 * (p2_NDC + 1.0) * scale_factor, iz.i[2]);
+  /** @note: p0, p1, p2 are actually gl_FragCoord. **/
+  /* Snap window coordinates to fixed point. */
+  const double subpixel_scale = double(1 << SUBPIXEL_BITS);
+  int64_t X[3], Y[3];
+  for (int i = 0; i < 3; i++) {
+    if (isnan(p[i].x) || isnan(p[i].y) || isinf(p[i].x) || isinf(p[i].y)) 
+      return; /* Ignore invalid triangles. */
+    X[i] = int64_t(llround(p[i].x * subpixel_scale));
+    Y[i] = int64_t(llround(p[i].y * subpixel_scale));
+  }
+  /* edge equations, see edge(...) */
+  int64_t area = (Y[0] - Y[1]) * X[2] + (X[1] - X[0]) * Y[2] + (X[0] * Y[1] - Y[0] * X[1]);
+  if (area == 0) return; /* Ignore degenerated triangles. */
+  if (area < 0 && backface_culling) return; /* Backface culling. */
+  const int64_t sign = (area < 0) ? -1 : +1;
+  for (int i = 0; i < 3; i++) {
+    const int i0 = (i + 1) % 3, i1 = (i + 2) % 3;
+    const int64_t a = sign * (Y[i0] - Y[i1]);
+    const int64_t b = sign * (X[i1] - X[i0]);
+    setup.edge_a[i] = a;
+    setup.edge_b[i] = b;
+    setup.edge_c[i] = sign * (X[i0] * Y[i1] - Y[i0] * X[i1]);
     /**
-    @note: interlaced rendering in MT mode. For example, if 4 threads (0~3)
-    are used for rasterization, then:
-    - thread 0 will only render y (rows) = 0, 4, 8, 12, ...
-    - thread 1 will only render y (rows) = 1, 5, 9, 13, ...
-    - thread 2 will only render y (rows) = 2, 6, 10, 14, ...
-    - thread 3 will only render y (rows) = 3, 7, 11, 15, ...
-    This is a way to achieve decent workload balance among workers.
+    @note: Top-left fill rule. Since window space +y axis is pointing to the 
+    top, the triangle interior is on the right side of a left edge (a > 0) and
+    is below a top edge (a == 0, b < 0). Pixels lying exactly on other edges 
+    are not covered, this is done by making the test "w >= 0" to "w > 0".
     **/
-    for (uint32_t i_tri = 0; i_tri < ppl.Triangles.size(); i_tri++) {
-      /* Step 3.1: Convert clip space to NDC space (perspective divide) */
-      Triangle_gl tri_gl = ppl.Triangles[i_tri];
-      Vertex_gl &v0 = tri_gl.v[0];
-      Vertex_gl &v1 = tri_gl.v[1];
-      Vertex_gl &v2 = tri_gl.v[2];
-      const Vec3 iz = Vec3(1.0 / v0.gl_Position.w, 1.0 / v1.gl_Position.w, 1.0 / v2.gl_Position.w);
-      Vec3 p0_NDC = v0.gl_Position.xyz() * iz.i[0];
-      Vec3 p1_NDC = v1.gl_Position.xyz() * iz.i[1];
-      Vec3 p2_NDC = v2.gl_Position.xyz() * iz.i[2];
-      /* Step 3.2: Convert NDC space to window space */
-      /**
-      @note: In NDC space, x,y,z is between [-1, +1]
-      NDC space       window space
-      -----------------------------
-      x: [-1, +1]     x: [0, +w]
-      y: [-1, +1]     y: [0, +h]
-      z: [-1, +1]     z: [0, +1]
-      @note: The window space origin is at the lower-left corner of the screen,
-      with +x axis pointing to the right and +y axis pointing to the top.
-      **/
-      const double render_width = double(this->targets.color->w);
-      const double render_height = double(this->targets.color->h);
-      const Vec3 scale_factor = Vec3(render_width, render_height, 1.0);
-      const Vec4 p0 = Vec4(0.5 * (p0_NDC + 1.0) * scale_factor, iz.i[0]);
-      const Vec4 p1 = Vec4(0.5 * (p1_NDC + 1.0) * scale_factor, iz.i[1]);
-      const Vec4 p2 = Vec4(0.5 * (p2_NDC + 1.0) * scale_factor, iz.i[2]);
-      double area = edge(p0, p1, p2);
-      if (isnan(area) || isinf(area)) continue; /* Ignore invalid triangles. */
-      if (area < 0.0 && ppl.backface_culling) continue; /* Backface culling. */
-      /** @note: p0, p1, p2 are actually gl_FragCoord. **/
-      /* Step 3.3: Rasterization. */
-      Vec4 rect = get_minimum_rect(p0, p1, p2);
-      /* precomupte: divide by real z */
-      v0 *= iz.i[0];
-      v1 *= iz.i[1];
-      v2 *= iz.i[2];
-      Vec4 p;
-      int y_base = num_threads * int(int(rect.i[1]) / num_threads);
-      for (p.y = double(y_base) + 0.5 + double(thread_id); p.y < rect.i[3]; p.y += double(num_threads)) {
-        for (p.x = floor(rect.i[0]) + 0.5; p.x < rect.i[2]; p.x += 1.0) {
-          /**
-          @note: here the winding order is important,
-          and w_i are calculated in window space
-          **/
-          Vec3 w = Vec3(edge(p1, p2, p), edge(p2, p0, p), edge(p0, p1, p));
-          /* discard pixel if it is outside the triangle area */
-          bool all_pos = (w.i[0] >= 0.0 && w.i[1] >= 0.0 && w.i[2] >= 0.0);
-          bool all_neg = (w.i[0] <= 0.0 && w.i[1] <= 0.0 && w.i[2] <= 0.0);
-          if (!all_pos && !all_neg) continue;
-          /* interpolate vertex */
-          w /= area;
-          Vertex_gl v_lerp = v0 * w.i[0] + v1 * w.i[1] + v2 * w.i[2];
-          double z_real = 1.0 / (iz.i[0] * w.i[0] + iz.i[1] * w.i[1] + iz.i[2] * w.i[2]);
-          v_lerp *= z_real;
-          /* Step 3.4: Assemble fragment and render pixel. */
-          Fragment_gl fragment;
-          assemble_fragment(v_lerp, fragment);
-          /*
-          v_lerp.gl_Position.z / v_lerp.gl_Position.w is the depth value in NDC
-          space, which is in range [-1, +1], then we need to map it to [0, +1].
-
-          * Although OpenGL's depth range is [-1, +1], but if you want to read the
-            depth value from a depth texture, the value is further normalized to
-            [0, +1]. So here for convenience we directly convert it to [0, +1]
-            because reading from depth buffer is rather common in graphics
-            programming.
-          */
-          double gl_FragDepth = ((v_lerp.gl_Position.z / v_lerp.gl_Position.w) + 1.0) * 0.5;
-          fragment.gl_FragCoord = Vec4(p.x, p.y, gl_FragDepth, 1.0 / v_lerp.gl_Position.w);
-          Vec4 color_out;
-          bool is_discarded = false;
-          shaders.FS(uniforms, fragment, color_out, is_discarded, gl_FragDepth);
-          /* Step 3.5: Fragment processing */
-          if (!is_discarded) {
-            write_render_targets(fragment.gl_FragCoord.xy(), color_out,
-              gl_FragDepth);
-          }
-        }
+    bool is_top_left = (a > 0) || (a == 0 && b < 0);
+    if (!is_top_left)
+      setup.edge_c[i] -= 1;
+  }
+  /* pixel (x, y) is sampled at its center (x+0.5, y+0.5), only pixels inside
+  the minimum rectangle of the triangle and the render target are kept, i.e.,
+  from the first pixel with X_min <= center to the last with center <= X_max. */
+  const int64_t one = int64_t(1) << SUBPIXEL_BITS, half = one >> 1;
+  int64_t X_min = min(min(X[0], X[1]), X[2]), X_max = max(max(X[0], X[1]), X[2]);
+  int64_t Y_min = min(min(Y[0], Y[1]), Y[2]), Y_max = max(max(Y[0], Y[1]), Y[2]);
+  setup.z_min = min(min(p[0].z, p[1].z), p[2].z);
+  setup.bounds = IVec4(
+    int(max((X_min - half + one - 1) >> SUBPIXEL_BITS, int64_t(0))),
+    int(max((Y_min - half + one - 1) >> SUBPIXEL_BITS, int64_t(0))),
+    int(min((X_max - half) >> SUBPIXEL_BITS, int64_t(render_width - 1))),
+    int(min((Y_max - half) >> SUBPIXEL_BITS, int64_t(render_height - 1))));
+  /* Attribute plane equations. Varyings are divided by real z so they can be 
+  linearly interpolated in window space (perspective correct interpolation).
+  The snapped vertex positions are used, so the planes are consistent with the
+  edge equations. */
+  double f[3][NUM_INTERPOLANTS];
+  for (int i = 0; i < 3; i++) {
+    f[i][INTERP_Z] = p[i].z;
+    f[i][INTERP_INV_W] = iz.i[i];
+    pack_varyings(*v[i], &f[i][INTERP_VARYINGS]);
+    for (int k = INTERP_VARYINGS; k < NUM_INTERPOLANTS; k++)
+      f[i][k] *= iz.i[i];
+  }
+  const double x0 = double(X[0]) / subpixel_scale, y0 = double(Y[0]) / subpixel_scale;
+  const double x10 = double(X[1] - X[0]) / subpixel_scale, y10 = double(Y[1] - Y[0]) / subpixel_scale;
+  const double x20 = double(X[2] - X[0]) / subpixel_scale, y20 = double(Y[2] - Y[0]) / subpixel_scale;
+  const double inv_det = 1.0 / (x10 * y20 - x20 * y10);
+  for (int k = 0; k < NUM_INTERPOLANTS; k++) {
+    const double f10 = f[1][k] - f[0][k], f20 = f[2][k] - f[0][k];
+    setup.dfdx[k] = (f10 * y20 - f20 * y10) * inv_det;
+    setup.dfdy[k] = (f20 * x10 - f10 * x20) * inv_det;
+    setup.f0[k] = f[0][k] - setup.dfdx[k] * x0 - setup.dfdy[k] * y0;
+  }
+}
+
+/**
+Test coverage of an edge for all pixels in a block.
+@param w0: Fixed-point edge function value at the center of the first pixel 
+of the block.
+@param a, b: Edge function increments along +x and +y (per pixel).
+@return: Coverage mask, bit (y*RASTER_BLOCK_SIZE+x) is set if w >= 0.
+@note: Only call this function if the edge crosses the block, in such case all
+the values inside the block are guaranteed to fit in 32 bits.
+**/
+static inline uint64_t
+_eval_edge_block(const int32_t w0, const int32_t a, const int32_t b) {
+  uint64_t mask = 0;
+#if defined(__AVX2__)
+  const __m256i step = _mm256_mullo_epi32(_mm256_set1_epi32(a), 
+    _mm256_set_epi32(7, 6, 5, 4, 3, 2, 1, 0));
+  __m256i row = _mm256_add_epi32(_mm256_set1_epi32(w0), step);
+  const __m256i row_step = _mm256_set1_epi32(b);
+  for (int y = 0; y < RASTER_BLOCK_SIZE; y++) {
+    /* sign bit is set if w < 0 */
+    uint64_t bits = uint64_t(_mm256_movemask_ps(_mm256_castsi256_ps(row)));
+    mask |= bits << (y * RASTER_BLOCK_SIZE);
+    row = _mm256_add_epi32(row, row_step);
+  }
+#elif defined(SGL_SSE2)
+  __m128i lo = _mm_set_epi32(w0 + 3 * a, w0 + 2 * a, w0 + a, w0);
+  __m128i hi = _mm_add_epi32(lo, _mm_set1_epi32(4 * a));
+  const __m128i row_step = _mm_set1_epi32(b);
+  for (int y = 0; y < RASTER_BLOCK_SIZE; y++) {
+    /* sign bit is set if w < 0 */
+    uint64_t bits = uint64_t(_mm_movemask_ps(_mm_castsi128_ps(lo))) |
+                   (uint64_t(_mm_movemask_ps(_mm_castsi128_ps(hi))) << 4);
+    mask |= bits << (y * RASTER_BLOCK_SIZE);
+    lo = _mm_add_epi32(lo, row_step);
+    hi = _mm_add_epi32(hi, row_step);
+  }
+#else
+  for (int y = 0; y < RASTER_BLOCK_SIZE; y++) {
+    int32_t w = w0 + y * b;
+    for (int x = 0; x < RASTER_BLOCK_SIZE; x++, w += a) {
+      if (w < 0)
+        mask |= uint64_t(1) << (y * RASTER_BLOCK_SIZE + x);
+    }
+  }
+#endif
+  return ~mask;
+}
+
+void
+Pipeline::prepare_depth_hierarchy() {
+  if (!ppl.do_depth_test || !ppl.early_depth_test)
+    return;
+  update_depth_hierarchy();
+}
+
+void
+Pipeline::update_depth_hierarchy() {
+  const int NB = RASTER_TILE_SIZE / RASTER_BLOCK_SIZE;
+  const int hiz_w = ppl.num_tiles_x * NB, hiz_h = ppl.num_tiles_y * NB;
+  if (ppl.hiz_valid && ppl.hiz_depth == this->targets.depth && 
+      ppl.hiz_w == hiz_w && ppl.hiz_h == hiz_h)
+    return;
+  ppl.HiZ.resize(hiz_w * hiz_h);
+  parallel_for(hiz_h, [&](int j) {
+    for (int i = 0; i < hiz_w; i++)
+      ppl.HiZ[j * hiz_w + i] = get_depth_block_max(i * RASTER_BLOCK_SIZE, j * RASTER_BLOCK_SIZE);
+  });
+  ppl.hiz_w = hiz_w;
+  ppl.hiz_h = hiz_h;
+  ppl.hiz_depth = this->targets.depth;
+  ppl.hiz_valid = true;
+}
+
+double
+Pipeline::get_depth_block_max(const int &x, const int &y) {
+  double z_max = 0.0;
+  _with_depth_buffer(this->targets.depth->format, ppl.reverse_depth, 
+    [&](auto depth_buffer) {
+      z_max = get_depth_block_max<decltype(depth_buffer)>(x, y);
+    });
+  return z_max;
+}
+
+void
+Pipeline::rasterize_tile(const int &tile_id, const Uniforms &uniforms) {
+  rasterize_tile_range(tile_id, uniforms, shaders.FS, ppl.do_depth_test, 
+    ppl.early_depth_test, 0, int(ppl.TileBins[tile_id].size()));
+}
+
+void
+Pipeline::rasterize_tile_draws(const int &tile_id) {
+  const std::vector<uint32_t> &bin = ppl.TileBins[tile_id];
+  const int n_bin = int(bin.size());
+  const DrawCall_gl *draw = ppl.Draws.data();
+  int i_bin = 0;
+  while (i_bin < n_bin) {
+    /* bins keep the submission order, so the triangles of each draw call 
+    form a single run */
+    while (int(bin[i_bin]) >= draw->first_triangle + draw->n_triangles)
+      draw++;
+    const int tri_end = draw->first_triangle + draw->n_triangles;
+    int i_end = i_bin + 1;
+    while (i_end < n_bin && int(bin[i_end]) < tri_end)
+      i_end++;
+    const DrawCommand &command = *draw->command;
+    rasterize_tile_range(tile_id, *draw->uniforms, command.FS, command.depth_test,
+      command.early_depth_test, i_bin, i_end);
+    i_bin = i_end;
+  }
+}
+
+void
+Pipeline::rasterize_tile_range(const int &tile_id, const Uniforms &uniforms, 
+                               const FS_func_t &FS, const bool &depth_test,
+                               const bool &early_depth_test, const int &i_bin_start,
+                               const int &i_bin_end) {
+  const PixelFormat format = this->targets.color->format;
+  const int &s = i_bin_start, &e = i_bin_end;
+  if (format == PixelFormat::pixel_format_RGBA8888) {
+    if (!depth_test) 
+      rasterize_tile_dispatch_depth<false, false, PixelFormat::pixel_format_RGBA8888>(tile_id, uniforms, FS, s, e);
+    else if (!early_depth_test) 
+      rasterize_tile_dispatch_depth<true, false, PixelFormat::pixel_format_RGBA8888>(tile_id, uniforms, FS, s, e);
+    else 
+      rasterize_tile_dispatch_depth<true, true, PixelFormat::pixel_format_RGBA8888>(tile_id, uniforms, FS, s, e);
+  }
+  else if (format == PixelFormat::pixel_format_BGRA8888) {
+    if (!depth_test) 
+      rasterize_tile_dispatch_depth<false, false, PixelFormat::pixel_format_BGRA8888>(tile_id, uniforms, FS, s, e);
+    else if (!early_depth_test) 
+      rasterize_tile_dispatch_depth<true, false, PixelFormat::pixel_format_BGRA8888>(tile_id, uniforms, FS, s, e);
+    else 
+      rasterize_tile_dispatch_depth<true, true, PixelFormat::pixel_format_BGRA8888>(tile_id, uniforms, FS, s, e);
+  }
+  else
+    printf("Invalid texture format.\n");
+}
+
+template <bool DepthTest, bool EarlyDepthTest, PixelFormat ColorFormat>
+void
+Pipeline::rasterize_tile_dispatch_depth(const int &tile_id, const Uniforms &uniforms,
+                                        const FS_func_t &FS, const int &i_bin_start,
+                                        const int &i_bin_end) {
+  if (!DepthTest) {
+    /* depth target is not touched */
+    rasterize_tile<PipelineState<false, true, ColorFormat, false>>(
+      tile_id, uniforms, FS, i_bin_start, i_bin_end);
+    return;
+  }
+  bool valid = _with_depth_buffer(this->targets.depth->format, ppl.reverse_depth, 
+    [&](auto depth_buffer) {
+      typedef decltype(depth_buffer) DB;
+      rasterize_tile<PipelineState<true, true, ColorFormat, EarlyDepthTest, 
+        DB::format, DB::reversed>>(tile_id, uniforms, FS, i_bin_start, i_bin_end);
+    });
+  if (!valid)
+    printf("Invalid depth texture format.\n");
+}
+
+int
+Pipeline::rasterize_blocks(const TriangleSetup_gl &setup, const int &tile_x, 
+                           const int &tile_y, BlockCoverage_gl *blocks) {
+  const int BS = RASTER_BLOCK_SIZE;
+  const int64_t one = int64_t(1) << SUBPIXEL_BITS, half = one >> 1;
+  int n_blocks = 0;
+  const int x_s = max(setup.bounds.x, tile_x);
+  const int y_s = max(setup.bounds.y, tile_y);
+  const int x_e = min(setup.bounds.z, tile_x + RASTER_TILE_SIZE - 1);
+  const int y_e = min(setup.bounds.w, tile_y + RASTER_TILE_SIZE - 1);
+  /* edge function increments per pixel, and the largest & smallest 
+  increments within a block */
+  int64_t a[3], b[3], w_max[3], w_min[3];
+  for (int i = 0; i < 3; i++) {
+    a[i] = setup.edge_a[i] * one;
+    b[i] = setup.edge_b[i] * one;
+    w_max[i] = int64_t(BS - 1) * (max(a[i], int64_t(0)) + max(b[i], int64_t(0)));
+    w_min[i] = int64_t(BS - 1) * (min(a[i], int64_t(0)) + min(b[i], int64_t(0)));
+  }
+  const int bx_s = tile_x + ((x_s - tile_x) / BS) * BS;
+  const int by_s = tile_y + ((y_s - tile_y) / BS) * BS;
+  for (int by = by_s; by <= y_e; by += BS) {
+    /* rows of the block inside the minimum rectangle */
+    const int row_s = max(y_s - by, 0), row_e = min(y_e - by, BS - 1);
+    for (int bx = bx_s; bx <= x_e; bx += BS) {
+      const int col_s = max(x_s - bx, 0), col_e = min(x_e - bx, BS - 1);
+      /* edge functions at the first pixel center of the block */
+      int64_t w0[3];
+      bool outside = false, inside[3];
+      for (int i = 0; i < 3; i++) {
+        w0[i] = setup.edge_a[i] * (bx * one + half) + 
+                setup.edge_b[i] * (by * one + half) + setup.edge_c[i];
+        if (w0[i] + w_max[i] < 0) outside = true;
+        inside[i] = (w0[i] + w_min[i] >= 0);
+      }
+      if (outside) continue; /* trivial reject */
+      /* pixels inside the minimum rectangle */
+      const uint64_t row_bits = ((uint64_t(1) << (col_e - col_s + 1)) - 1) << col_s;
+      uint64_t mask = 0;
+      for (int row = row_s; row <= row_e; row++)
+        mask |= row_bits << (row * BS);
+      /* only test edges crossing the block (trivial accept otherwise) */
+      for (int i = 0; i < 3; i++) {
+        if (!inside[i])
+          mask &= _eval_edge_block(int32_t(w0[i]), int32_t(a[i]), int32_t(b[i]));
       }
+      if (!mask) continue;
+      blocks[n_blocks].x = bx;
+      blocks[n_blocks].y = by;
+      blocks[n_blocks].mask = mask;
+      n_blocks++;
     }
   }
+  return n_blocks;
 }
 
 void
@@ -332,13 +1047,20 @@ Pipeline::write_render_targets(const Vec2 &p, const Vec4 &color, const double &z
   (origin is at the top-left corner of the screen). */
   int pixel_id = iy * w + ix;
   /* depth test */
-  double *depths = (double *) this->targets.depth->pixels;
-  double z_new = min(max(z, 0.0), 1.0);
-  double z_orig = depths[pixel_id];
-  if (z_new > z_orig && ppl.do_depth_test)
-    return;
-  if (ppl.do_depth_test)
-    depths[pixel_id] = z_new;
+  if (ppl.do_depth_test) {
+    bool passed = true;
+    _with_depth_buffer(this->targets.depth->format, ppl.reverse_depth, 
+      [&](auto depth_buffer) {
+        typedef decltype(depth_buffer) DB;
+        typename DB::type *depths = (typename DB::type *) this->targets.depth->pixels;
+        typename DB::type z_new = DB::encode(min(max(z, 0.0), 1.0));
+        passed = !DB::is_behind(z_new, depths[pixel_id]);
+        if (passed)
+          depths[pixel_id] = z_new;
+      });
+    if (!passed)
+      return;
+  }
   uint8_t R, G, B, A;
   uint32_t packed_32bit;
   unpack_color_to_unsigned_RGBA(color, R, G, B, A);
@@ -349,145 +1071,120 @@ Pipeline::write_render_targets(const Vec2 &p, const Vec4 &color, const double &z
 
 void
 Pipeline::clip_triangle(const Triangle_gl &triangle_in,
-                        std::vector<Triangle_gl> &triangles_out) {
-  std::vector<Triangle_gl> Q0, Q1;
-  std::vector<Triangle_gl> *Qcur = &Q0, *Qnext = &Q1, *Qtemp = NULL;
-  Qcur->push_back(triangle_in);
-  Vertex_gl q[4];
-  const int clip_signs[2] = {+1, -1};
-  for (uint32_t clip_axis = 0; clip_axis < 3; clip_axis++) {
-    for (uint32_t i_clip = 0; i_clip < 2; i_clip++) {
-      const int clip_sign = clip_signs[i_clip];
-      for (uint32_t i_tri = 0; i_tri < Qcur->size(); i_tri++) {
-        Triangle_gl &tri = (*Qcur)[i_tri];
-        int n_tri;
-        clip_triangle(tri.v[0], tri.v[1], tri.v[2], 
-          clip_axis, clip_sign, q[0], q[1], q[2], q[3], n_tri);
-        if (n_tri == 1) {
-          Qnext->push_back(Triangle_gl(q[0], q[1], q[2]));
-        } else if (n_tri == 2) {
-          Qnext->push_back(Triangle_gl(q[0], q[1], q[2]));
-          Qnext->push_back(Triangle_gl(q[0], q[2], q[3]));
-        }
-      }
-      /* swap `Qcur` and `Qnext` for the next iteration */
-      Qcur->clear();
-      Qtemp = Qcur;
-      Qcur = Qnext;
-      Qnext = Qtemp;
+                        std::vector<Triangle_gl> &triangles_out,
+                        std::vector<Vertex_gl> &vertices_out) {
+  const Vec4 &p0 = ppl.Vertices[triangle_in.v[0]].gl_Position;
+  const Vec4 &p1 = ppl.Vertices[triangle_in.v[1]].gl_Position;
+  const Vec4 &p2 = ppl.Vertices[triangle_in.v[2]].gl_Position;
+  const int outcode_0 = get_outcode(p0, ppl.clip_extent_x, ppl.clip_extent_y);
+  const int outcode_1 = get_outcode(p1, ppl.clip_extent_x, ppl.clip_extent_y);
+  const int outcode_2 = get_outcode(p2, ppl.clip_extent_x, ppl.clip_extent_y);
+  if ((get_outcode(p0) & get_outcode(p1) & get_outcode(p2)) != 0) {
+    /* all vertices are outside the same plane (or the same side of the render
+     * target), simply discard it. */
+    return;
+  }
+  if ((outcode_0 | outcode_1 | outcode_2) == 0) {
+    /* triangle is completely inside the clipping volume (including the guard
+     * band), we don't need to do any clipping operations, pixels outside the
+     * render target are scissored in rasterization */
+    triangles_out.push_back(triangle_in);
+    return;
+  }
+  /* clip against the planes crossed by the triangle only, ping-pong between
+  two polygon buffers on the stack */
+  const int clip_mask = outcode_0 | outcode_1 | outcode_2;
+  Vertex_gl polygon[2][MAX_CLIP_VERTICES];
+  uint32_t ids[2][MAX_CLIP_VERTICES];
+  for (int k = 0; k < 3; k++) {
+    polygon[0][k] = ppl.Vertices[triangle_in.v[k]];
+    ids[0][k] = triangle_in.v[k];
+  }
+  int n_vertices = 3, i_cur = 0;
+  for (int plane = 0; plane < NUM_CLIP_PLANES; plane++) {
+    if ((clip_mask & (1 << plane)) == 0)
+      continue;
+    n_vertices = clip_polygon(polygon[i_cur], ids[i_cur], n_vertices, plane, 
+                              polygon[i_cur ^ 1], ids[i_cur ^ 1]);
+    i_cur ^= 1;
+    if (n_vertices < 3)
+      return;
+  }
+  /* only output the new vertices, the remaining ones are still referenced by
+  their original indices */
+  uint32_t *I = ids[i_cur];
+  for (int i = 0; i < n_vertices; i++) {
+    if (I[i] == CLIPPED_VERTEX_BIT) {
+      I[i] = CLIPPED_VERTEX_BIT | uint32_t(vertices_out.size());
+      vertices_out.push_back(polygon[i_cur][i]);
     }
   }
-  for (uint32_t i_tri = 0; i_tri < Qcur->size(); i_tri++)
-    triangles_out.push_back((*Qcur)[i_tri]);
+  /* triangulate the clipped (convex) polygon as a fan */
+  for (int i = 1; i < n_vertices - 1; i++)
+    triangles_out.push_back(Triangle_gl(I[0], I[i], I[i + 1]));
 }
 
-void
-Pipeline::clip_triangle(const Vertex_gl &v1, const Vertex_gl &v2,
-                        const Vertex_gl &v3, const int clip_axis,
-                        const int clip_sign, Vertex_gl &q1, Vertex_gl &q2,
-                        Vertex_gl &q3, Vertex_gl &q4, int &n_tri) {
-  int p1_sign, p2_sign, p3_sign;
-  if (clip_sign == +1) {
-    /* use <= instead of <, if a point lies on the clip plane we don't need to
-     * clip it. */
-    p1_sign = (v1.gl_Position.i[clip_axis] <= v1.gl_Position.w) ? +1 : -1;
-    p2_sign = (v2.gl_Position.i[clip_axis] <= v2.gl_Position.w) ? +1 : -1;
-    p3_sign = (v3.gl_Position.i[clip_axis] <= v3.gl_Position.w) ? +1 : -1;
-  } else {
-    /* use >= instead of >. */
-    p1_sign = (v1.gl_Position.i[clip_axis] >= -v1.gl_Position.w) ? +1 : -1;
-    p2_sign = (v2.gl_Position.i[clip_axis] >= -v2.gl_Position.w) ? +1 : -1;
-    p3_sign = (v3.gl_Position.i[clip_axis] >= -v3.gl_Position.w) ? +1 : -1;
-  }
-
-  if (p1_sign < 0 && p2_sign < 0 && p3_sign < 0) {
-    /* triangle is completely outside the clipping volume, simply discard it. */
-    n_tri = 0;
-  } 
-  else if (p1_sign > 0 && p2_sign > 0 && p3_sign > 0) {
-    /* triangle is completely inside clipping volume, we don't need to do any
-     * clipping operations */
-    n_tri = 1;
-    q1 = v1, q2 = v2, q3 = v3;
-  } 
-  else {
-    /* clipping is needed, check how many vertices are in the upper side of
-    the plane, to obtain the number of newly generated triangles */
-    n_tri = 0;
-    if (p1_sign > 0)
-      n_tri++;
-    if (p2_sign > 0)
-      n_tri++;
-    if (p3_sign > 0)
-      n_tri++;
-    const Vertex_gl *v[3];
-    /* sort pointers, ensuring that the clipping plane always intersects with
-    edge v[0]-v[1] and v[0]-v[2] */
-    if (n_tri == 1) {
-      /* ensure v[0] is always inside the clipping plane */
-      if (p1_sign > 0) {
-        v[0] = &v1, v[1] = &v2, v[2] = &v3;
-      } else if (p2_sign > 0) {
-        v[0] = &v2, v[1] = &v3, v[2] = &v1;
-      } else {
-        v[0] = &v3, v[1] = &v1, v[2] = &v2;
-      }
-    } else {
-      /* ensure v[0] is always outside the clipping plane */
-      if (p1_sign < 0) {
-        v[0] = &v1, v[1] = &v2, v[2] = &v3;
-      } else if (p2_sign < 0) {
-        v[0] = &v2, v[1] = &v3, v[2] = &v1;
-      } else {
-        v[0] = &v3, v[1] = &v1, v[2] = &v2;
-      }
+int
+Pipeline::clip_polygon(const Vertex_gl *polygon_in, const uint32_t *ids_in,
+                       const int n_in, const int plane, Vertex_gl *polygon_out,
+                       uint32_t *ids_out) {
+  double d[MAX_CLIP_VERTICES];
+  for (int i = 0; i < n_in; i++)
+    d[i] = get_clip_distance(polygon_in[i].gl_Position, plane);
+  int n_out = 0;
+  for (int i = 0; i < n_in; i++) {
+    const int j = (i + 1 == n_in) ? 0 : i + 1;
+    const bool i_inside = (d[i] >= 0.0), j_inside = (d[j] >= 0.0);
+    /* the polygon stays convex in theory, the capacity check only guards 
+    against rounding errors */
+    if (i_inside && n_out < MAX_CLIP_VERTICES) {
+      ids_out[n_out] = ids_in[i];
+      polygon_out[n_out++] = polygon_in[i];
     }
-    /**
-    Then, clip segments p0-p1 and p0-p2.
+    if (i_inside != j_inside && n_out < MAX_CLIP_VERTICES) {
+      /**
+      Edge i-j crosses the plane, insert the intersection.
 
                 ** How to perform clipping in homogeneous space **             
-    ----------------------------------------------------------------------------
-    
-    Assume we have two vertices A(A_x, A_y, A_z, A_w) and B(B_x, B_y, B_z, B_w), 
-    segment A-B will be clipped by a plane, assume the intersection is C, such 
-    that C = (1-t)A + tB, where 0 < t < 1.
-    Then we have:
+      --------------------------------------------------------------------------
+      
+      Assume we have two vertices A(A_x, A_y, A_z, A_w) and B(B_x, B_y, B_z, 
+      B_w), segment A-B will be clipped by a plane, assume the intersection is 
+      C, such that C = (1-t)A + tB, where 0 < t < 1.
+      Then we have:
                               C_w = (1-t)*A_w + t*B_w.
-    For the near plane (z-axis) clipping, we have:
+      For the near plane (z-axis) clipping, we have:
                                      C_z = -C_w.
-    Since C_z = (1-t)*A_z + t*B_z, then we also have:
+      Since C_z = (1-t)*A_z + t*B_z, then we also have:
                      -(1-t)*A_w - t*B_w = (1-t)*A_z + t*B_z.
-    We can solve for scalar t:
+      We can solve for scalar t:
                        t = (A_z+A_w) / ((A_z+A_w)-(B_z+B_w)).
-    Similarly, we can solve scalar t for far plane clipping:
+      Similarly, we can solve scalar t for far plane clipping:
                        t = (A_z-A_w) / ((A_z-A_w)-(B_z-B_w)).
-    Clipping with other axes is also the same. Just replace A_z to A_x or A_y 
-    and B_z to B_x or B_y.
-    
-    From: https://stackoverflow.com/questions/60910464/at-what-stage-is-clipping-performed-in-the-graphics-pipeline
-    => The scalar t can also be used to interpolate all the associated vertex 
-    attributes for C. The linear interpolation is perfectly sufficient even in 
-    perspective distorted cases, because we are before the perspective divide 
-    here, were the whole perspective transformation is perfectly affine w.r.t. 
-    the 4D space we work in.
-    **/
-    double t[2];
-    clip_segment(*v[0], *v[1], clip_axis, clip_sign, t[0]);
-    clip_segment(*v[0], *v[2], clip_axis, clip_sign, t[1]);
-
-    if (n_tri == 1) {
-      q1 = *(v[0]);
-      q2 = Vertex_gl::lerp(*v[0], *v[1], t[0]);
-      q3 = Vertex_gl::lerp(*v[0], *v[2], t[1]);
-    } 
-    else if (n_tri == 2) {
-      q1 = *(v[1]), q2 = *(v[2]);
-      q3 = Vertex_gl::lerp(*v[0], *v[2], t[1]);
-      q4 = Vertex_gl::lerp(*v[0], *v[1], t[0]);
+      Clipping with other axes is also the same. Just replace A_z to A_x or A_y 
+      and B_z to B_x or B_y. Here (A_z+A_w) and (A_w-A_z) are exactly the 
+      signed distances given by get_clip_distance().
+      
+      From: https://stackoverflow.com/questions/60910464/at-what-stage-is-clipping-performed-in-the-graphics-pipeline
+      => The scalar t can also be used to interpolate all the associated vertex 
+      attributes for C. The linear interpolation is perfectly sufficient even 
+      in perspective distorted cases, because we are before the perspective 
+      divide here, were the whole perspective transformation is perfectly 
+      affine w.r.t. the 4D space we work in.
+
+      @note: Always interpolate from the inside vertex, so an edge shared by 
+      two triangles is cut at exactly the same point in both of them.
+      **/
+      ids_out[n_out] = CLIPPED_VERTEX_BIT;
+      if (i_inside)
+        polygon_out[n_out++] = Vertex_gl::lerp(polygon_in[i], polygon_in[j], d[i] / (d[i] - d[j]));
+      else
+        polygon_out[n_out++] = Vertex_gl::lerp(polygon_in[j], polygon_in[i], d[j] / (d[j] - d[i]));
     }
-    /* for the case when n_tri==0, the triangle is automatically discarded. */
   }
+  return n_out;
 }
+
 void
 Pipeline::clear_render_targets(
   Texture* color, 
@@ -506,10 +1203,19 @@ Pipeline::clear_render_targets(
       pixels[i] = packed_32bit;
   }
   if (depth != NULL) {
+    if (depth == ppl.hiz_depth)
+      ppl.hiz_valid = false;
     int n_pixels = depth->w * depth->h;
-    double *pixels = (double *) depth->pixels;
-    for (int i = 0; i < n_pixels; i++)
-      pixels[i] = 1.0;
+    bool valid = _with_depth_buffer(depth->format, ppl.reverse_depth, 
+      [&](auto depth_buffer) {
+        typedef decltype(depth_buffer) DB;
+        typename DB::type *pixels = (typename DB::type *) depth->pixels;
+        const typename DB::type far_depth = DB::encode(1.0);
+        for (int i = 0; i < n_pixels; i++)
+          pixels[i] = far_depth;
+      });
+    if (!valid)
+      printf("Invalid depth texture format.\n");
   }
 }
 
@@ -521,9 +1227,10 @@ void WireframePipeline::draw(
   ppl.Vertices.clear();
   ppl.Triangles.clear();
 
-  vertex_processing(vertices, uniforms);
+  const Uniforms &draw_uniforms = run_uniform_prologue(uniforms);
+  vertex_processing(vertices, draw_uniforms);
   vertex_post_processing(indices);
-  fragment_processing(uniforms);
+  fragment_processing(draw_uniforms);
 }
 void WireframePipeline::draw(
   const int32_t & vbo,
@@ -536,15 +1243,92 @@ void WireframePipeline::draw(
     uniforms
   );
 }
+void WireframePipeline::draw(
+  const VertexBuffer_t& vertices,
+  const IndexBuffer_t& indices,
+  const int32_t& first_index,
+  const int32_t& index_count,
+  const int32_t& base_vertex,
+  const Uniforms& uniforms)
+{
+  ppl.Vertices.clear();
+  ppl.Triangles.clear();
+
+  const Uniforms &draw_uniforms = run_uniform_prologue(uniforms);
+  if (!vertex_fetch(vertices, indices, first_index, index_count, base_vertex))
+    return;
+  vertex_processing_fetched(vertices, draw_uniforms, shaders.VS);
+  vertex_post_processing(ppl.FetchIndices);
+  fragment_processing(draw_uniforms);
+}
+void WireframePipeline::draw(
+  const int32_t & vbo,
+  const int32_t & ibo,
+  const int32_t & first_index,
+  const int32_t & index_count,
+  const int32_t & base_vertex,
+  const Uniforms & uniforms)
+{
+  this->draw(
+    buffers.VertexBuffers[vbo],
+    buffers.IndexBuffers[ibo],
+    first_index,
+    index_count,
+    base_vertex,
+    uniforms
+  );
+}
+
+void WireframePipeline::draw_instanced(
+  const VertexBuffer_t& vertices,
+  const IndexBuffer_t& indices,
+  const Uniforms& uniforms,
+  const InstanceData* instances,
+  const int32_t& instance_count)
+{
+  if (shaders.VS_instanced == NULL || instance_count <= 0)
+    return;
+  ppl.Vertices.clear();
+  ppl.Triangles.clear();
+
+  const Uniforms &draw_uniforms = run_instanced_prologue(uniforms, instances, instance_count);
+  const int n_instances = int(ppl.Instances.size());
+  if (n_instances == 0)
+    return;
+  vertex_processing_instanced(vertices, draw_uniforms, 0, n_instances);
+  repeat_instance_indices(indices, int(vertices.size()), n_instances);
+  vertex_post_processing(ppl.InstanceIndices);
+  fragment_processing(draw_uniforms);
+}
+void WireframePipeline::draw_instanced(
+  const int32_t & vbo,
+  const int32_t & ibo,
+  const Uniforms & uniforms,
+  const InstanceData* instances,
+  const int32_t& instance_count)
+{
+  this->draw_instanced(
+    buffers.VertexBuffers[vbo],
+    buffers.IndexBuffers[ibo],
+    uniforms,
+    instances,
+    instance_count
+  );
+}
+
+void WireframePipeline::submit(const CommandBuffer& commands)
+{
+  submit_sequential(commands);
+}
 
 void WireframePipeline::fragment_processing(const Uniforms & uniforms)
 {
   for (uint32_t i_tri = 0; i_tri < ppl.Triangles.size(); i_tri++) {
     /* Step 3.1: Convert clip space to NDC space (perspective divide) */
-    Triangle_gl tri_gl = ppl.Triangles[i_tri];
-    Vertex_gl &v0 = tri_gl.v[0];
-    Vertex_gl &v1 = tri_gl.v[1];
-    Vertex_gl &v2 = tri_gl.v[2];
+    const Triangle_gl &tri_gl = ppl.Triangles[i_tri];
+    Vertex_gl v0 = ppl.Vertices[tri_gl.v[0]];
+    Vertex_gl v1 = ppl.Vertices[tri_gl.v[1]];
+    Vertex_gl v2 = ppl.Vertices[tri_gl.v[2]];
     const Vec3 iz = Vec3(1.0 / v0.gl_Position.w, 1.0 / v1.gl_Position.w, 1.0 / v2.gl_Position.w);
     Vec3 p0_NDC = v0.gl_Position.xyz() * iz.i[0];
     Vec3 p1_NDC = v1.gl_Position.xyz() * iz.i[1];
@@ -585,7 +1369,9 @@ WireframePipeline::_inner_interpolate(
   double z_real = 1.0 / (iz.i[0] * w.i[0] + iz.i[1] * w.i[1]);
   v_lerp *= z_real;
   Fragment_gl fragment;
-  assemble_fragment(v_lerp, fragment);
+  double varyings[NUM_VARYINGS];
+  pack_varyings(v_lerp, varyings);
+  assemble_fragment(varyings, fragment);
   double gl_FragDepth = (v_lerp.gl_Position.z / v_lerp.gl_Position.w + 1.0) * 0.5;
   gl_FragDepth *= 0.999;
   fragment.gl_FragCoord = Vec4(x, y, gl_FragDepth, 1.0 / v_lerp.gl_Position.w);
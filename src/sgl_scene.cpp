@@ -0,0 +1,369 @@
+#include "sgl_scene.h"
+
+#include <algorithm>
+
+namespace sgl {
+
+/* maximum number of instances in a BVH leaf */
+static const uint32_t MAX_BVH_LEAF_SIZE = 4;
+
+Scene::Scene()
+{
+  this->needs_rebuild = false;
+  this->needs_refit = false;
+}
+
+void
+Scene::clear()
+{
+  this->instances.clear();
+  this->free_ids.clear();
+  this->nodes.clear();
+  this->items.clear();
+  this->needs_rebuild = false;
+  this->needs_refit = false;
+}
+
+uint32_t
+Scene::add_instance(Model* model, const Mat4x4& transform, const int32_t& anim_id)
+{
+  uint32_t id;
+  if (free_ids.size() > 0) {
+    id = free_ids.back();
+    free_ids.pop_back();
+  }
+  else {
+    id = (uint32_t)instances.size();
+    instances.push_back(SceneInstance());
+  }
+  SceneInstance& instance = instances[id];
+  instance.model = model;
+  instance.transform = transform;
+  instance.anim_id = anim_id;
+  instance.time = 0.0;
+  instance.occluder = false;
+  _update_instance_bounds(instance);
+  this->needs_rebuild = true;
+  return id;
+}
+
+void
+Scene::remove_instance(const uint32_t& id)
+{
+  if (id >= instances.size() || instances[id].model == NULL)
+    return;
+  instances[id].model = NULL;
+  free_ids.push_back(id);
+  this->needs_rebuild = true;
+}
+
+void
+Scene::set_transform(const uint32_t& id, const Mat4x4& transform)
+{
+  if (id >= instances.size() || instances[id].model == NULL)
+    return;
+  instances[id].transform = transform;
+  _update_instance_bounds(instances[id]);
+  this->needs_refit = true;
+}
+
+void
+Scene::set_animation(const uint32_t& id, const int32_t& anim_id)
+{
+  if (id >= instances.size() || instances[id].model == NULL || instances[id].anim_id == anim_id)
+    return;
+  instances[id].anim_id = anim_id;
+  _update_instance_bounds(instances[id]);
+  this->needs_refit = true;
+}
+
+void
+Scene::set_time(const uint32_t& id, const double& time)
+{
+  if (id < instances.size())
+    instances[id].time = time;
+}
+
+void
+Scene::set_occluder(const uint32_t& id, bool occluder)
+{
+  if (id < instances.size())
+    instances[id].occluder = occluder;
+}
+
+void
+Scene::_update_instance_bounds(SceneInstance& instance)
+{
+  /* world space box of the transformed model box */
+  const BoundingVolume& local = instance.model->get_bounds(instance.anim_id);
+  BoundingVolume& bounds = instance.bounds;
+  for (int i = 0; i < 8; i++) {
+    Vec3 corner(
+      (i & 1) ? local.aabb_max.x : local.aabb_min.x,
+      (i & 2) ? local.aabb_max.y : local.aabb_min.y,
+      (i & 4) ? local.aabb_max.z : local.aabb_min.z);
+    Vec3 p = mul(instance.transform, Vec4(corner, 1.0)).xyz();
+    if (i == 0) {
+      bounds.aabb_min = bounds.aabb_max = p;
+      continue;
+    }
+    for (uint32_t c = 0; c < 3; c++) {
+      bounds.aabb_min.i[c] = min(bounds.aabb_min.i[c], p.i[c]);
+      bounds.aabb_max.i[c] = max(bounds.aabb_max.i[c], p.i[c]);
+    }
+  }
+  bounds.center = (bounds.aabb_min + bounds.aabb_max) * 0.5;
+  bounds.radius = length(bounds.aabb_max - bounds.aabb_min) * 0.5;
+}
+
+void
+Scene::update()
+{
+  if (this->needs_rebuild)
+    rebuild();
+  else if (this->needs_refit)
+    _refit();
+}
+
+void
+Scene::rebuild()
+{
+  this->items.clear();
+  for (uint32_t id = 0; id < instances.size(); id++) {
+    if (instances[id].model != NULL)
+      this->items.push_back(id);
+  }
+  this->nodes.clear();
+  if (this->items.size() > 0) {
+    BVHNode root;
+    root.first = 0;
+    root.count = (uint32_t)this->items.size();
+    root.child = -1;
+    this->nodes.push_back(root);
+    _build_node(0);
+  }
+  this->needs_rebuild = false;
+  this->needs_refit = false;
+}
+
+void
+Scene::_build_node(uint32_t i_node)
+{
+  const uint32_t first = nodes[i_node].first, count = nodes[i_node].count;
+  /* node bounds, and the bounds of the instance centers */
+  Vec3 lo = instances[items[first]].bounds.aabb_min, hi = instances[items[first]].bounds.aabb_max;
+  Vec3 center_lo = instances[items[first]].bounds.center, center_hi = center_lo;
+  for (uint32_t i = first + 1; i < first + count; i++) {
+    const BoundingVolume& b = instances[items[i]].bounds;
+    for (uint32_t c = 0; c < 3; c++) {
+      lo.i[c] = min(lo.i[c], b.aabb_min.i[c]);
+      hi.i[c] = max(hi.i[c], b.aabb_max.i[c]);
+      center_lo.i[c] = min(center_lo.i[c], b.center.i[c]);
+      center_hi.i[c] = max(center_hi.i[c], b.center.i[c]);
+    }
+  }
+  nodes[i_node].aabb_min = lo;
+  nodes[i_node].aabb_max = hi;
+  nodes[i_node].child = -1;
+  if (count <= MAX_BVH_LEAF_SIZE)
+    return;
+
+  /* split at the median along the longest axis of the centers */
+  Vec3 extent = center_hi - center_lo;
+  uint32_t axis = 0;
+  if (extent.y > extent.i[axis]) axis = 1;
+  if (extent.z > extent.i[axis]) axis = 2;
+  const uint32_t half = count / 2;
+  std::nth_element(items.begin() + first, items.begin() + first + half, items.begin() + first + count,
+    [this, axis](const uint32_t& a, const uint32_t& b) {
+      return instances[a].bounds.center.i[axis] < instances[b].bounds.center.i[axis];
+    });
+
+  /* children are allocated after their parent, so refitting the nodes in
+  reverse order always updates the children first */
+  const int32_t child = (int32_t)nodes.size();
+  nodes[i_node].child = child;
+  BVHNode left, right;
+  left.first = first;
+  left.count = half;
+  left.child = -1;
+  right.first = first + half;
+  right.count = count - half;
+  right.child = -1;
+  nodes.push_back(left);
+  nodes.push_back(right);
+  _build_node(child);
+  _build_node(child + 1);
+}
+
+void
+Scene::_refit()
+{
+  for (int32_t i_node = int32_t(nodes.size()) - 1; i_node >= 0; i_node--) {
+    BVHNode& node = nodes[i_node];
+    if (node.child < 0) {
+      node.aabb_min = instances[items[node.first]].bounds.aabb_min;
+      node.aabb_max = instances[items[node.first]].bounds.aabb_max;
+      for (uint32_t i = node.first + 1; i < node.first + node.count; i++) {
+        const BoundingVolume& b = instances[items[i]].bounds;
+        for (uint32_t c = 0; c < 3; c++) {
+          node.aabb_min.i[c] = min(node.aabb_min.i[c], b.aabb_min.i[c]);
+          node.aabb_max.i[c] = max(node.aabb_max.i[c], b.aabb_max.i[c]);
+        }
+      }
+    }
+    else {
+      const BVHNode& l = nodes[node.child];
+      const BVHNode& r = nodes[node.child + 1];
+      for (uint32_t c = 0; c < 3; c++) {
+        node.aabb_min.i[c] = min(l.aabb_min.i[c], r.aabb_min.i[c]);
+        node.aabb_max.i[c] = max(l.aabb_max.i[c], r.aabb_max.i[c]);
+      }
+    }
+  }
+  this->needs_refit = false;
+}
+
+/**
+Test a box against the frustum planes.
+@return: Returns -1 if the box is outside, 1 if it is completely inside, or
+0 if it intersects the frustum boundary. The test is conservative, a box
+near a frustum corner can be reported as intersecting.
+**/
+static inline int
+_classify_box(const double planes[6][4], const Vec3& lo, const Vec3& hi)
+{
+  int result = 1;
+  for (int i_plane = 0; i_plane < 6; i_plane++) {
+    const double* p = planes[i_plane];
+    /* the corner farthest along the plane normal (and the nearest one) */
+    double d_far = p[3], d_near = p[3];
+    for (int c = 0; c < 3; c++) {
+      d_far += p[c] * ((p[c] > 0.0) ? hi.i[c] : lo.i[c]);
+      d_near += p[c] * ((p[c] > 0.0) ? lo.i[c] : hi.i[c]);
+    }
+    if (d_far < 0.0) return -1;
+    if (d_near < 0.0) result = 0;
+  }
+  return result;
+}
+
+void
+Scene::query_frustum(const Mat4x4& view_projection, std::vector<uint32_t>& ids)
+{
+  ids.clear();
+  update();
+  if (nodes.size() == 0)
+    return;
+
+  /* Frustum planes (a,b,c,d) in world space, a point p is inside the plane
+  if a*p.x + b*p.y + c*p.z + d >= 0. They are extracted from the clip space
+  conditions -w <= x,y,z <= +w, such as w + x = (row4 + row1) * p >= 0. */
+  const Mat4x4& m = view_projection;
+  double planes[6][4];
+  for (int i_axis = 0; i_axis < 3; i_axis++) {
+    const double* row = (i_axis == 0) ? m.i1x : (i_axis == 1) ? m.i2x : m.i3x;
+    for (int k = 0; k < 4; k++) {
+      planes[i_axis * 2 + 0][k] = m.i4x[k] + row[k];
+      planes[i_axis * 2 + 1][k] = m.i4x[k] - row[k];
+    }
+  }
+
+  uint32_t stack[64];
+  int32_t n_stack = 0;
+  stack[n_stack++] = 0;
+  while (n_stack > 0) {
+    const BVHNode& node = nodes[stack[--n_stack]];
+    const int result = _classify_box(planes, node.aabb_min, node.aabb_max);
+    if (result < 0)
+      continue;
+    if (result > 0) {
+      ids.insert(ids.end(), items.begin() + node.first, items.begin() + node.first + node.count);
+      continue;
+    }
+    if (node.child < 0) {
+      for (uint32_t i = node.first; i < node.first + node.count; i++) {
+        const BoundingVolume& b = instances[items[i]].bounds;
+        if (_classify_box(planes, b.aabb_min, b.aabb_max) >= 0)
+          ids.push_back(items[i]);
+      }
+      continue;
+    }
+    stack[n_stack++] = uint32_t(node.child);
+    stack[n_stack++] = uint32_t(node.child + 1);
+  }
+}
+
+/**
+Slab test of a ray against a box.
+@return: Returns true if the ray enters the box within [0, t_max], t_enter
+is the entry point (0 if the origin is inside the box).
+**/
+static inline bool
+_intersect_ray_box(const Vec3& origin, const Vec3& inv_dir,
+  const Vec3& lo, const Vec3& hi, const double& t_max, double& t_enter)
+{
+  double t0 = 0.0, t1 = t_max;
+  for (uint32_t c = 0; c < 3; c++) {
+    double ta = (lo.i[c] - origin.i[c]) * inv_dir.i[c];
+    double tb = (hi.i[c] - origin.i[c]) * inv_dir.i[c];
+    if (ta > tb) std::swap(ta, tb);
+    /* NaN (0 * inf, ray lying on the slab boundary) is treated as a hit */
+    if (ta > t0) t0 = ta;
+    if (tb < t1) t1 = tb;
+    if (t0 > t1) return false;
+  }
+  t_enter = t0;
+  return true;
+}
+
+int32_t
+Scene::query_ray(const Vec3& origin, const Vec3& dir, double& t_hit, double t_max)
+{
+  update();
+  int32_t hit = -1;
+  if (nodes.size() == 0)
+    return hit;
+  const Vec3 inv_dir(1.0 / dir.x, 1.0 / dir.y, 1.0 / dir.z);
+  double t_best = t_max;
+
+  uint32_t stack[64];
+  int32_t n_stack = 0;
+  stack[n_stack++] = 0;
+  while (n_stack > 0) {
+    const BVHNode& node = nodes[stack[--n_stack]];
+    double t_node;
+    if (!_intersect_ray_box(origin, inv_dir, node.aabb_min, node.aabb_max, t_best, t_node))
+      continue;
+    if (node.child < 0) {
+      for (uint32_t i = node.first; i < node.first + node.count; i++) {
+        const BoundingVolume& b = instances[items[i]].bounds;
+        double t;
+        if (_intersect_ray_box(origin, inv_dir, b.aabb_min, b.aabb_max, t_best, t) &&
+          (hit < 0 || t < t_best)) {
+          t_best = t;
+          hit = int32_t(items[i]);
+        }
+      }
+      continue;
+    }
+    /* visit the nearer child first so the farther one can be pruned */
+    const BVHNode& l = nodes[node.child];
+    const BVHNode& r = nodes[node.child + 1];
+    double t_l, t_r;
+    bool hit_l = _intersect_ray_box(origin, inv_dir, l.aabb_min, l.aabb_max, t_best, t_l);
+    bool hit_r = _intersect_ray_box(origin, inv_dir, r.aabb_min, r.aabb_max, t_best, t_r);
+    if (hit_l && hit_r) {
+      bool left_first = (t_l <= t_r);
+      stack[n_stack++] = uint32_t(left_first ? node.child + 1 : node.child);
+      stack[n_stack++] = uint32_t(left_first ? node.child : node.child + 1);
+    }
+    else if (hit_l) stack[n_stack++] = uint32_t(node.child);
+    else if (hit_r) stack[n_stack++] = uint32_t(node.child + 1);
+  }
+  if (hit >= 0)
+    t_hit = t_best;
+  return hit;
+}
+
+}; /* namespace sgl */
@@ -2,6 +2,18 @@
 
 namespace sgl {
 
+void
+default_UP(Uniforms &uniforms) {
+  const Mat4x4 &model = uniforms.model;
+  uniforms.view_projection = mul(uniforms.projection, uniforms.view);
+  uniforms.model_view_projection = mul(uniforms.view_projection, model);
+  Mat3x3 linear(
+    model.i11, model.i12, model.i13,
+    model.i21, model.i22, model.i23,
+    model.i31, model.i32, model.i33);
+  uniforms.normal_matrix = transpose(linear.inverse());
+}
+
 void
 default_VS(
   const Uniforms &uniforms,
@@ -10,21 +22,25 @@ default_VS(
 ) {
   /* Implement default vertex shader. */
   const Mat4x4 &model = uniforms.model;
-  const Mat4x4 &view = uniforms.view;
-  const Mat4x4 &projection = uniforms.projection;
-  /* Model & View & Projection matrix */
-  Mat4x4 transform = mul(mul(projection, view), model);
+  /* Model & View & Projection matrix (see default_UP) */
+  const Mat4x4 &transform = uniforms.model_view_projection;
   Vec4 gl_Position = mul(transform, Vec4(vertex_in.p, 1.0));
   vertex_out.gl_Position = gl_Position;
   vertex_out.t = vertex_in.t;
-  vertex_out.wn = mul(model, Vec4(vertex_in.n, 1.0)).xyz();
+  vertex_out.wn = mul(uniforms.normal_matrix, vertex_in.n);
   vertex_out.wp = mul(model, Vec4(vertex_in.p, 1.0)).xyz();
 }
 void
-assemble_fragment(const Vertex_gl &vertex_in, Fragment_gl &fragment_out) {
-  fragment_out.wn = vertex_in.wn;
-  fragment_out.wp = vertex_in.wp;
-  fragment_out.t = vertex_in.t;
+default_instanced_VS(
+  const Uniforms &uniforms,
+  const InstanceData &instance,
+  const Vertex &vertex_in,
+  Vertex_gl &vertex_out
+) {
+  vertex_out.gl_Position = mul(instance.model_view_projection, Vec4(vertex_in.p, 1.0));
+  vertex_out.t = vertex_in.t;
+  vertex_out.wn = mul(instance.normal_matrix, vertex_in.n);
+  vertex_out.wp = mul(instance.model, Vec4(vertex_in.p, 1.0)).xyz();
 }
 void
 default_FS(
@@ -38,5 +54,18 @@ default_FS(
   Vec3 textured = texture(uniforms.in_textures[0], uv).rgb();
   color_out = Vec4(textured, 1.0);
 }
+void
+default_instanced_FS(
+  const Uniforms &uniforms,
+  const Fragment_gl &fragment_in,
+  Vec4 &color_out,
+  bool& is_discarded,
+  double& gl_FragDepth
+) {
+  const Vec4 &tint = uniforms.instances[fragment_in.gl_InstanceID].tint;
+  Vec2 uv = fragment_in.t;
+  Vec3 textured = texture(uniforms.in_textures[0], uv).rgb();
+  color_out = Vec4(textured.x * tint.x, textured.y * tint.y, textured.z * tint.z, tint.w);
+}
 
 }; /* namespace sgl */
@@ -45,6 +45,13 @@ Texture::create(int32_t w, int32_t h,
   else if (texture_format == PixelFormat::pixel_format_float64) {
     this->bypp = 8;
   }
+  else if (texture_format == PixelFormat::pixel_format_float32 ||
+    texture_format == PixelFormat::pixel_format_depth24) {
+    this->bypp = 4;
+  }
+  else if (texture_format == PixelFormat::pixel_format_depth16) {
+    this->bypp = 2;
+  }
   else {
     printf("Texture create failed: unsupported / "
       "unimplemented texture format.\n");
@@ -162,8 +169,8 @@ bool Texture::save_png(const std::string & path) const
     printf("Cannot save texture, texture object is invalid.\n");
     return false;
   }
-  if (this->bypp != 4 || this->format == PixelFormat::pixel_format_float64 || 
-    this->format == PixelFormat::pixel_format_unknown) {
+  if (this->format != PixelFormat::pixel_format_RGBA8888 && 
+    this->format != PixelFormat::pixel_format_BGRA8888) {
     printf("Cannot save texture, unsupported pixel format.\n");
     return false;
   }
@@ -0,0 +1,146 @@
+#include "sgl_thread_pool.h"
+#include "sgl_utils.h"
+
+namespace sgl {
+
+/* set for threads that are currently running a task of any pool, nested jobs
+submitted from them will be executed serially to avoid deadlocks. */
+static thread_local bool in_pool_task = false;
+
+ThreadPool::ThreadPool(const int &num_threads) : workers(max(num_threads, 1)) {
+  this->num_threads = max(num_threads, 1);
+  job.task = NULL;
+  job.n_workers = 0;
+  job.generation = 0;
+  job.stop = false;
+  n_active = 0;
+  for (int i = 0; i < this->num_threads; i++)
+    workers[i].begin = workers[i].end = 0;
+  /* worker 0 is the thread that submits the job */
+  for (int i = 1; i < this->num_threads; i++)
+    threads.push_back(std::thread(&ThreadPool::_worker_loop, this, i));
+}
+
+ThreadPool::~ThreadPool() {
+  {
+    std::unique_lock<std::mutex> guard(job_lock);
+    job.stop = true;
+  }
+  job_start.notify_all();
+  for (uint32_t i = 0; i < threads.size(); i++)
+    threads[i].join();
+}
+
+ThreadPool *
+ThreadPool::get_default() {
+  static ThreadPool default_pool(max(get_cpu_cores(), 1));
+  return &default_pool;
+}
+
+void
+ThreadPool::run(const int &n_tasks, const Task_func_t &task, const int &max_threads) {
+  if (n_tasks <= 0)
+    return;
+  int n_workers = (max_threads > 0) ? min(max_threads, num_threads) : num_threads;
+  n_workers = min(n_workers, n_tasks);
+  if (n_workers <= 1 || in_pool_task) {
+    /* not worth waking up other threads */
+    for (int task_id = 0; task_id < n_tasks; task_id++)
+      task(task_id);
+    return;
+  }
+  std::unique_lock<std::mutex> submit_guard(submit_lock);
+  /* split tasks evenly among all participating workers */
+  for (int i = 0; i < n_workers; i++) {
+    std::unique_lock<std::mutex> guard(workers[i].lock);
+    workers[i].begin = int(int64_t(n_tasks) * i / n_workers);
+    workers[i].end = int(int64_t(n_tasks) * (i + 1) / n_workers);
+  }
+  {
+    std::unique_lock<std::mutex> guard(job_lock);
+    job.task = &task;
+    job.n_workers = n_workers;
+    job.generation++;
+    n_active = n_workers - 1;
+  }
+  job_start.notify_all();
+  /* the calling thread works as worker 0 */
+  _work(0);
+  /* wait for other workers, they will not touch the job after leaving */
+  std::unique_lock<std::mutex> guard(job_lock);
+  job_done.wait(guard, [this] { return n_active.load() == 0; });
+  job.task = NULL;
+}
+
+void
+ThreadPool::_worker_loop(const int worker_id) {
+  uint64_t seen_generation = 0;
+  while (true) {
+    {
+      std::unique_lock<std::mutex> guard(job_lock);
+      job_start.wait(guard, [&] { return job.stop || job.generation != seen_generation; });
+      if (job.stop)
+        return;
+      seen_generation = job.generation;
+      if (worker_id >= job.n_workers)
+        continue; /* not participating this job */
+    }
+    _work(worker_id);
+    if (--n_active == 0) {
+      std::unique_lock<std::mutex> guard(job_lock);
+      job_done.notify_one();
+    }
+  }
+}
+
+void
+ThreadPool::_work(const int worker_id) {
+  const Task_func_t &task = *job.task;
+  in_pool_task = true;
+  int task_id;
+  while (true) {
+    if (_pop_task(worker_id, task_id))
+      task(task_id);
+    else if (!_steal_tasks(worker_id))
+      break; /* no tasks left in any worker */
+  }
+  in_pool_task = false;
+}
+
+bool
+ThreadPool::_pop_task(const int worker_id, int &task_id) {
+  Worker &self = workers[worker_id];
+  std::unique_lock<std::mutex> guard(self.lock);
+  if (self.begin >= self.end)
+    return false;
+  task_id = self.begin++;
+  return true;
+}
+
+bool
+ThreadPool::_steal_tasks(const int worker_id) {
+  /* visit other workers in a round-robin way, starting from the next one,
+  steal half of the remaining tasks from the back of the victim's range */
+  for (int i = 1; i < job.n_workers; i++) {
+    Worker &victim = workers[(worker_id + i) % job.n_workers];
+    int begin, end;
+    {
+      std::unique_lock<std::mutex> guard(victim.lock);
+      int n_left = victim.end - victim.begin;
+      if (n_left <= 0)
+        continue;
+      int n_steal = (n_left + 1) / 2;
+      begin = victim.end - n_steal;
+      end = victim.end;
+      victim.end = begin;
+    }
+    Worker &self = workers[worker_id];
+    std::unique_lock<std::mutex> guard(self.lock);
+    self.begin = begin;
+    self.end = end;
+    return true;
+  }
+  return false;
+}
+
+}; /* namespace sgl */
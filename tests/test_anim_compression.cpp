@@ -0,0 +1,81 @@
+#include <stdio.h>
+#include <math.h>
+
+#include "sgl_utils.h"
+#include "sgl_model.h"
+
+using namespace sgl;
+
+/* Headless check of animation compression: the reconstruction errors of the
+ * compressed tracks must stay within the tolerances, and the poses of the
+ * skeleton must stay close to those of the uncompressed animations. */
+
+const double bake_rate = 30.0;
+const double position_tolerance = 1e-3;
+const double rotation_tolerance = 1e-3;
+
+int
+main(int argc, char* argv[]) {
+  set_cwd(gd(argv[0]));
+  /* the reference model is only baked, the other one is also compressed */
+  Model reference, compressed;
+  if (!reference.load("models/boblamp.zip") || !compressed.load("models/boblamp.zip")) {
+    printf("[*] Error: cannot load the test model.\n");
+    return 1;
+  }
+  reference.set_animation_bake_rate(bake_rate);
+  compressed.set_animation_bake_rate(bake_rate);
+  const std::vector<AnimationClipInfo> clips =
+    compressed.compress_animations(position_tolerance, rotation_tolerance);
+  if (clips.size() == 0) {
+    printf("[*] Error: the test model has no animation.\n");
+    return 1;
+  }
+
+  bool failed = false;
+  for (int32_t anim_id = 0; anim_id < int32_t(clips.size()); anim_id++) {
+    const AnimationClipInfo& clip = clips[anim_id];
+    /* the report is measured at the baked samples */
+    if (clip.max_position_error > position_tolerance ||
+        clip.max_scaling_error > position_tolerance ||
+        clip.max_rotation_error > rotation_tolerance) {
+      printf("[*] Error: animation \"%s\" exceeds the tolerances (position %g, "
+        "scaling %g, rotation %g).\n", clip.name.c_str(), clip.max_position_error,
+        clip.max_scaling_error, clip.max_rotation_error);
+      failed = true;
+    }
+    if (clip.compressed_bytes >= clip.raw_bytes) {
+      printf("[*] Error: animation \"%s\" is not compressed (%d -> %d bytes).\n",
+        clip.name.c_str(), int32_t(clip.raw_bytes), int32_t(clip.compressed_bytes));
+      failed = true;
+    }
+    /* compare the node positions of both skeletons between the samples, the
+     * small errors of the nodes add up along the hierarchy, so only a small
+     * fraction of the size of the skeleton is allowed */
+    std::vector<Mat4x4> pose0, pose1;
+    double extent = 0.0, max_error = 0.0;
+    for (int32_t i = 0; i < int32_t(10.0 * bake_rate); i++) {
+      const double time = (double(i) + 0.5) / bake_rate;
+      reference.evaluate_pose(anim_id, time, pose0);
+      compressed.evaluate_pose(anim_id, time, pose1);
+      for (size_t i_node = 0; i_node < pose0.size() && i_node < pose1.size(); i_node++) {
+        const Vec3 p0(pose0[i_node].i14, pose0[i_node].i24, pose0[i_node].i34);
+        const Vec3 p1(pose1[i_node].i14, pose1[i_node].i24, pose1[i_node].i34);
+        extent = max(extent, length(p0));
+        max_error = max(max_error, length(p1 - p0));
+      }
+    }
+    if (max_error > 0.01 * extent) {
+      printf("[*] Error: animation \"%s\" deviates by %g (skeleton size %g).\n",
+        clip.name.c_str(), max_error, extent);
+      failed = true;
+    }
+    printf("[*] Animation \"%s\": %d -> %d bytes, max deviation %g (skeleton size %g).\n",
+      clip.name.c_str(), int32_t(clip.raw_bytes), int32_t(clip.compressed_bytes),
+      max_error, extent);
+  }
+  if (failed)
+    return 1;
+  printf("[*] Animation compression within tolerances, OK.\n");
+  return 0;
+}
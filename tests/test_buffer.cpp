@@ -79,7 +79,7 @@ init_render() {
     PixelFormat::pixel_format_RGBA8888,
     TextureSampling::texture_sampling_point);
   depth_texture.create(w, h,
-    PixelFormat::pixel_format_float64,
+    PixelFormat::pixel_format_float32,
     TextureSampling::texture_sampling_point);
 
   /* rotate model along x axis by -55 degrees */
@@ -0,0 +1,118 @@
+#include <stdio.h>
+#include <math.h>
+
+#include <atomic>
+
+#include "sgl_pipeline.h"
+
+using namespace sgl;
+
+/* Headless check of near plane clipping: a triangle with one vertex behind
+ * the eye must cover the same pixels as the polygon clipped by hand (which
+ * lies in front of the near plane), and all its fragments must have a depth
+ * within the depth range. */
+
+const int w = 64, h = 64;
+const double z_near = 0.1, z_far = 100.0;
+std::atomic<int32_t> n_bad_depth(0);
+
+void
+depth_check_FS(const Uniforms& uniforms, const Fragment_gl& fragment_in,
+  Vec4& color, bool& discard, double& depth) {
+  if (!(fragment_in.gl_FragCoord.z >= 0.0 && fragment_in.gl_FragCoord.z <= 1.0))
+    n_bad_depth++;
+  color = Vec4(1.0, 1.0, 1.0, 1.0);
+}
+
+uint32_t
+read_pixel(const Texture& texture, int x, int y) {
+  return ((const uint32_t*)texture.pixels)[y * texture.w + x];
+}
+
+/* draw a polygon (as a triangle fan) given in view space, returns the covered
+ * pixels */
+std::vector<bool>
+draw_polygon(const std::vector<Vec3>& polygon) {
+  Texture color_texture, depth_texture;
+  color_texture.create(w, h,
+    PixelFormat::pixel_format_RGBA8888,
+    TextureSampling::texture_sampling_point);
+  depth_texture.create(w, h,
+    PixelFormat::pixel_format_float32,
+    TextureSampling::texture_sampling_point);
+
+  /* perspective projection, 90 degrees field of view */
+  Uniforms uniforms;
+  uniforms.model = Mat4x4::identity();
+  uniforms.view = Mat4x4::identity();
+  uniforms.projection = Mat4x4(
+    1.0, 0.0, 0.0, 0.0,
+    0.0, 1.0, 0.0, 0.0,
+    0.0, 0.0, -(z_far + z_near) / (z_far - z_near), -2.0 * z_far * z_near / (z_far - z_near),
+    0.0, 0.0, -1.0, 0.0);
+
+  VertexBuffer_t vertices;
+  IndexBuffer_t indices;
+  Vertex v;
+  for (size_t i = 0; i < polygon.size(); i++) {
+    v.p = polygon[i];
+    vertices.push_back(v);
+  }
+  for (int32_t i = 1; i + 1 < int32_t(polygon.size()); i++) {
+    indices.push_back(0);
+    indices.push_back(i);
+    indices.push_back(i + 1);
+  }
+
+  Pipeline pipeline;
+  pipeline.set_shaders(default_VS, depth_check_FS);
+  pipeline.disable_backface_culling();
+  pipeline.set_render_targets(&color_texture, &depth_texture);
+  pipeline.clear_render_targets(&color_texture, &depth_texture, Vec4(0.0, 0.0, 0.0, 1.0));
+  const uint32_t background = read_pixel(color_texture, 0, 0);
+  pipeline.draw(vertices, indices, uniforms);
+
+  std::vector<bool> covered(w * h);
+  for (int32_t y = 0; y < h; y++)
+    for (int32_t x = 0; x < w; x++)
+      covered[y * w + x] = (read_pixel(color_texture, x, y) != background);
+  return covered;
+}
+
+int
+main(int argc, char* argv[]) {
+  /* the eye looks down -z, vertex C is behind it */
+  const Vec3 A(-1.0, -1.0, -2.0), B(1.0, -1.0, -2.0), C(0.0, 1.0, 1.0);
+  std::vector<Vec3> triangle;
+  triangle.push_back(A);
+  triangle.push_back(B);
+  triangle.push_back(C);
+  /* clip edges B-C and C-A at z = -z_near */
+  const double t_bc = (-z_near - B.z) / (C.z - B.z);
+  const double t_ca = (-z_near - C.z) / (A.z - C.z);
+  std::vector<Vec3> clipped;
+  clipped.push_back(A);
+  clipped.push_back(B);
+  clipped.push_back(B + (C - B) * t_bc);
+  clipped.push_back(C + (A - C) * t_ca);
+
+  const std::vector<bool> covered = draw_polygon(triangle);
+  const std::vector<bool> expected = draw_polygon(clipped);
+  int32_t n_covered = 0, n_different = 0;
+  for (int32_t i = 0; i < w * h; i++) {
+    if (covered[i]) n_covered++;
+    if (covered[i] != expected[i]) n_different++;
+  }
+  /* the clipped vertices are not exactly the same, allow a few pixels along
+   * the edges to differ */
+  if (n_covered == 0 || n_different > w / 8 || n_bad_depth > 0) {
+    printf("[*] Error: triangle crossing the near plane is not clipped "
+      "correctly (%d pixels covered, %d different from the clipped polygon, "
+      "%d fragments out of the depth range).\n",
+      n_covered, n_different, int32_t(n_bad_depth));
+    return 1;
+  }
+  printf("[*] Near plane clipping: %d pixels covered, %d different, OK.\n",
+    n_covered, n_different);
+  return 0;
+}
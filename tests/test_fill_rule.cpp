@@ -0,0 +1,94 @@
+#include <stdio.h>
+#include <math.h>
+
+#include <atomic>
+
+#include "sgl_pipeline.h"
+
+using namespace sgl;
+
+/* Headless check of the top-left fill rule: triangles sharing edges (a fan
+ * around a vertex lying exactly on a pixel center, with edges running through
+ * rows, columns and diagonals of pixel centers) must shade every covered
+ * pixel exactly once. */
+
+const int w = 64, h = 64;
+std::atomic<int32_t> shaded[w * h];
+
+void
+count_FS(const Uniforms& uniforms, const Fragment_gl& fragment_in,
+  Vec4& color, bool& discard, double& depth) {
+  const int x = int(floor(fragment_in.gl_FragCoord.x));
+  const int y = int(floor(fragment_in.gl_FragCoord.y));
+  if (x >= 0 && x < w && y >= 0 && y < h)
+    shaded[y * w + x]++;
+  color = Vec4(1.0, 1.0, 1.0, 1.0);
+}
+
+/* NDC coordinate of a window space coordinate */
+double
+ndc(double window, int size) {
+  return window / double(size) * 2.0 - 1.0;
+}
+
+int
+main(int argc, char* argv[]) {
+  Texture color_texture, depth_texture;
+  color_texture.create(w, h,
+    PixelFormat::pixel_format_RGBA8888,
+    TextureSampling::texture_sampling_point);
+  depth_texture.create(w, h,
+    PixelFormat::pixel_format_float64,
+    TextureSampling::texture_sampling_point);
+
+  Uniforms uniforms;
+  uniforms.model = Mat4x4::identity();
+  uniforms.view = Mat4x4::identity();
+  uniforms.projection = Mat4x4::identity();
+
+  /* center of the fan on the center of pixel (32, 32), the outer vertices
+   * are either on pixel centers or at odd subpixel positions */
+  const double outer[8][2] = {
+    {56.5, 32.5}, {49.3125, 49.5}, {32.5, 56.5}, {15.6875, 49.0625},
+    { 8.5, 32.5}, {15.5, 15.5},    {32.5,  8.5}, {49.125, 15.8125},
+  };
+  VertexBuffer_t vertices;
+  IndexBuffer_t indices;
+  Vertex v;
+  v.p = Vec3(ndc(32.5, w), ndc(32.5, h), 0.0);
+  vertices.push_back(v);
+  for (int32_t i = 0; i < 8; i++) {
+    v.p = Vec3(ndc(outer[i][0], w), ndc(outer[i][1], h), 0.0);
+    vertices.push_back(v);
+  }
+  for (int32_t i = 0; i < 8; i++) {
+    indices.push_back(0);
+    indices.push_back(1 + i);
+    indices.push_back(1 + (i + 1) % 8);
+  }
+
+  Pipeline pipeline;
+  pipeline.set_shaders(default_VS, count_FS);
+  pipeline.disable_depth_test();
+  pipeline.set_render_targets(&color_texture, &depth_texture);
+  pipeline.clear_render_targets(&color_texture, &depth_texture, Vec4(0.0, 0.0, 0.0, 1.0));
+  pipeline.draw(vertices, indices, uniforms);
+
+  int32_t n_shaded = 0, n_twice = 0, n_holes = 0;
+  for (int32_t y = 0; y < h; y++) {
+    for (int32_t x = 0; x < w; x++) {
+      const int32_t count = shaded[y * w + x];
+      if (count > 0) n_shaded++;
+      if (count > 1) n_twice++;
+      /* pixels well inside the fan must be shaded */
+      if (count == 0 && abs(x - 32) <= 12 && abs(y - 32) <= 12) n_holes++;
+    }
+  }
+  if (n_shaded == 0 || n_twice > 0 || n_holes > 0) {
+    printf("[*] Error: fill rule violated (%d pixels shaded, %d shaded more "
+      "than once, %d holes).\n", n_shaded, n_twice, n_holes);
+    return 1;
+  }
+  printf("[*] Fill rule: %d pixels shaded exactly once, OK.\n", n_shaded);
+  return 0;
+}
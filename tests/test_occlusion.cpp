@@ -0,0 +1,82 @@
+#include <stdio.h>
+
+#include "sgl_occlusion.h"
+
+using namespace sgl;
+
+/* Headless check of occlusion culling: a box behind a full-screen occluder
+ * must be culled, while boxes in front of it or sticking out of a smaller
+ * occluder must not. */
+
+BoundingVolume
+make_box(const Vec3& lo, const Vec3& hi) {
+  BoundingVolume b;
+  b.aabb_min = lo;
+  b.aabb_max = hi;
+  b.center = (lo + hi) * 0.5;
+  b.radius = length(hi - lo) * 0.5;
+  return b;
+}
+
+/* a polygon (triangle fan) facing the eye at depth z */
+void
+add_polygon(OcclusionBuffer& occlusion, const std::vector<Vec2>& points, double z) {
+  VertexBuffer_t vertices;
+  IndexBuffer_t indices;
+  Vertex v;
+  for (size_t i = 0; i < points.size(); i++) {
+    v.p = Vec3(points[i].x, points[i].y, z);
+    vertices.push_back(v);
+  }
+  for (int32_t i = 1; i + 1 < int32_t(points.size()); i++) {
+    indices.push_back(0);
+    indices.push_back(i);
+    indices.push_back(i + 1);
+  }
+  occlusion.add_occluder(vertices, indices, Mat4x4::identity());
+}
+
+int
+main(int argc, char* argv[]) {
+  /* the eye is at the origin looking down -z, 90 degrees field of view */
+  const double n = 0.1, f = 100.0;
+  const Mat4x4 view_projection(
+    1.0, 0.0, 0.0, 0.0,
+    0.0, 1.0, 0.0, 0.0,
+    0.0, 0.0, -(f + n) / (f - n), -2.0 * f * n / (f - n),
+    0.0, 0.0, -1.0, 0.0);
+  const BoundingVolume behind = make_box(Vec3(-1.0, -1.0, -12.0), Vec3(1.0, 1.0, -10.0));
+  const BoundingVolume in_front = make_box(Vec3(-1.0, -1.0, -4.0), Vec3(1.0, 1.0, -3.0));
+
+  /* a single triangle covering the whole screen (the view is 10 units wide
+   * at z = -5), pixels along an edge shared by two occluder triangles are
+   * never completely covered by either of them */
+  std::vector<Vec2> full_screen;
+  full_screen.push_back(Vec2(-20.0, -10.0));
+  full_screen.push_back(Vec2(20.0, -10.0));
+  full_screen.push_back(Vec2(0.0, 30.0));
+  OcclusionBuffer occlusion;
+  occlusion.begin(view_projection);
+  add_polygon(occlusion, full_screen, -5.0);
+  const bool behind_culled = occlusion.is_occluded(behind, view_projection);
+  const bool in_front_culled = occlusion.is_occluded(in_front, view_projection);
+
+  /* the box behind sticks out of a smaller occluder */
+  std::vector<Vec2> small_square;
+  small_square.push_back(Vec2(-0.2, -0.2));
+  small_square.push_back(Vec2(0.2, -0.2));
+  small_square.push_back(Vec2(0.2, 0.2));
+  small_square.push_back(Vec2(-0.2, 0.2));
+  occlusion.begin(view_projection);
+  add_polygon(occlusion, small_square, -5.0);
+  const bool partly_culled = occlusion.is_occluded(behind, view_projection);
+
+  if (!behind_culled || in_front_culled || partly_culled) {
+    printf("[*] Error: wrong occlusion results (box behind: %s, box in front: %s, "
+      "box partly hidden: %s).\n", behind_culled ? "culled" : "visible",
+      in_front_culled ? "culled" : "visible", partly_culled ? "culled" : "visible");
+    return 1;
+  }
+  printf("[*] Occlusion culling, OK.\n");
+  return 0;
+}
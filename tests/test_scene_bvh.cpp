@@ -0,0 +1,161 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+
+#include <algorithm>
+
+#include "sgl_utils.h"
+#include "sgl_scene.h"
+
+using namespace sgl;
+
+/* Headless check of the scene BVH: frustum and ray queries must return the
+ * same instances as a brute-force scan of the instance boxes, also after
+ * instances are moved (refit) and removed (rebuild). */
+
+double
+random_range(double lo, double hi) {
+  return lo + (hi - lo) * double(rand()) / double(RAND_MAX);
+}
+
+Mat4x4
+random_transform() {
+  const double angle = random_range(0.0, 2.0 * PI);
+  const double s = random_range(0.01, 0.05);
+  const double c = cos(angle) * s, n = sin(angle) * s;
+  return Mat4x4(
+      c, 0.0,   n, random_range(-50.0, 50.0),
+    0.0,   s, 0.0, random_range(-5.0, 5.0),
+     -n, 0.0,   c, random_range(-50.0, 50.0),
+    0.0, 0.0, 0.0, 1.0);
+}
+
+/* perspective camera at `eye` looking along -z after a rotation around y */
+Mat4x4
+camera(const Vec3& eye, double yaw) {
+  const double n = 0.1, f = 60.0;
+  const Mat4x4 projection(
+    1.0, 0.0, 0.0, 0.0,
+    0.0, 1.0, 0.0, 0.0,
+    0.0, 0.0, -(f + n) / (f - n), -2.0 * f * n / (f - n),
+    0.0, 0.0, -1.0, 0.0);
+  const double c = cos(yaw), s = sin(yaw);
+  const Mat4x4 rotation(
+      c, 0.0,  -s, 0.0,
+    0.0, 1.0, 0.0, 0.0,
+      s, 0.0,   c, 0.0,
+    0.0, 0.0, 0.0, 1.0);
+  const Mat4x4 translation(
+    1.0, 0.0, 0.0, -eye.x,
+    0.0, 1.0, 0.0, -eye.y,
+    0.0, 0.0, 1.0, -eye.z,
+    0.0, 0.0, 0.0, 1.0);
+  return mul(projection, mul(rotation, translation));
+}
+
+/* a box is outside the frustum if its 8 corners are outside the same plane */
+bool
+is_box_in_frustum(const BoundingVolume& b, const Mat4x4& view_projection) {
+  Vec4 corners[8];
+  for (int i = 0; i < 8; i++) {
+    const Vec3 p((i & 1) ? b.aabb_max.x : b.aabb_min.x,
+                 (i & 2) ? b.aabb_max.y : b.aabb_min.y,
+                 (i & 4) ? b.aabb_max.z : b.aabb_min.z);
+    corners[i] = mul(view_projection, Vec4(p, 1.0));
+  }
+  for (int axis = 0; axis < 3; axis++) {
+    for (int side = -1; side <= 1; side += 2) {
+      bool outside = true;
+      for (int i = 0; i < 8 && outside; i++)
+        outside = (side * corners[i].i[axis] > corners[i].w);
+      if (outside)
+        return false;
+    }
+  }
+  return true;
+}
+
+/* entry point of a ray into a box, -1 if missed */
+double
+ray_box(const Vec3& origin, const Vec3& dir, const BoundingVolume& b) {
+  double t0 = 0.0, t1 = 1e30;
+  for (int c = 0; c < 3; c++) {
+    double ta = (b.aabb_min.i[c] - origin.i[c]) / dir.i[c];
+    double tb = (b.aabb_max.i[c] - origin.i[c]) / dir.i[c];
+    if (ta > tb) std::swap(ta, tb);
+    t0 = max(t0, ta);
+    t1 = min(t1, tb);
+    if (t0 > t1) return -1.0;
+  }
+  return t0;
+}
+
+int
+check_queries(Scene& scene, const char* stage) {
+  int32_t n_errors = 0, n_visible = 0, n_hits = 0;
+  for (int32_t i_camera = 0; i_camera < 16; i_camera++) {
+    const Vec3 eye(random_range(-40.0, 40.0), random_range(-2.0, 2.0), random_range(-40.0, 40.0));
+    const Mat4x4 view_projection = camera(eye, random_range(0.0, 2.0 * PI));
+    std::vector<uint32_t> ids, expected;
+    scene.query_frustum(view_projection, ids);
+    for (uint32_t id = 0; id < scene.get_instance_count(); id++) {
+      const SceneInstance& instance = scene.get_instance(id);
+      if (instance.model != NULL && is_box_in_frustum(instance.bounds, view_projection))
+        expected.push_back(id);
+    }
+    std::sort(ids.begin(), ids.end());
+    if (ids != expected) n_errors++;
+    n_visible += int32_t(ids.size());
+  }
+  for (int32_t i_ray = 0; i_ray < 256; i_ray++) {
+    const Vec3 origin(random_range(-60.0, 60.0), random_range(-6.0, 6.0), random_range(-60.0, 60.0));
+    const Vec3 dir(random_range(-1.0, 1.0), random_range(-0.1, 0.1), random_range(-1.0, 1.0));
+    double t_hit = -1.0, t_expected = -1.0;
+    const int32_t hit = scene.query_ray(origin, dir, t_hit);
+    for (uint32_t id = 0; id < scene.get_instance_count(); id++) {
+      const SceneInstance& instance = scene.get_instance(id);
+      if (instance.model == NULL) continue;
+      const double t = ray_box(origin, dir, instance.bounds);
+      if (t >= 0.0 && (t_expected < 0.0 || t < t_expected))
+        t_expected = t;
+    }
+    /* only compare the distances, boxes may be hit at the same point */
+    if ((hit >= 0) != (t_expected >= 0.0) || (hit >= 0 && fabs(t_hit - t_expected) > 1e-9))
+      n_errors++;
+    if (hit >= 0) n_hits++;
+  }
+  if (n_errors > 0 || n_visible == 0 || n_hits == 0) {
+    printf("[*] Error: BVH queries differ from brute force after %s (%d errors, "
+      "%d instances visible, %d rays hit).\n", stage, n_errors, n_visible, n_hits);
+    return 1;
+  }
+  printf("[*] BVH queries after %s: %d instances visible, %d rays hit.\n", stage, n_visible, n_hits);
+  return 0;
+}
+
+int
+main(int argc, char* argv[]) {
+  set_cwd(gd(argv[0]));
+  Model model;
+  if (!model.load("models/boblamp.zip")) {
+    printf("[*] Error: cannot load the test model.\n");
+    return 1;
+  }
+  srand(1);
+  Scene scene;
+  for (int32_t i = 0; i < 500; i++)
+    scene.add_instance(&model, random_transform());
+  int failed = check_queries(scene, "build");
+  /* move some instances, the tree is refitted */
+  for (uint32_t id = 0; id < 500; id += 3)
+    scene.set_transform(id, random_transform());
+  failed |= check_queries(scene, "refit");
+  /* remove some instances, the tree is rebuilt */
+  for (uint32_t id = 0; id < 500; id += 7)
+    scene.remove_instance(id);
+  failed |= check_queries(scene, "rebuild");
+  if (failed)
+    return 1;
+  printf("[*] BVH queries match brute force, OK.\n");
+  return 0;
+}
@@ -13,6 +13,7 @@ SDL_Surface* pWindowSurface;
 
 Model boblamp_model;
 BasicAnimPass render_pass;
+SkinningStage skinning; /* skin once, shared by the solid and wireframe passes */
 Pipeline pipeline;
 WireframePipeline wireframe_pipeline;
 Texture color_texture, depth_texture;
@@ -83,7 +84,7 @@ init_render() {
     PixelFormat::pixel_format_BGRA8888,
     TextureSampling::texture_sampling_point);
   depth_texture.create(w, h,
-    PixelFormat::pixel_format_float64,
+    PixelFormat::pixel_format_float32,
     TextureSampling::texture_sampling_point);
   boblamp_model.load("models/boblamp.zip");
   boblamp_model.dump();
@@ -109,6 +110,7 @@ init_render() {
   render_pass.eye.orthographic.height = 9.0;
   /* setup model to be rendered */
   render_pass.model = &boblamp_model;
+  render_pass.skinning = &skinning;
 
   render_pass.pipeline = &pipeline;
   wireframe_pipeline.set_wireframe_color(Vec3(1.0, 1.0, 1.0));
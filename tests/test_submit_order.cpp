@@ -0,0 +1,93 @@
+#include <stdio.h>
+
+#include <vector>
+
+#include "sgl_command_buffer.h"
+
+using namespace sgl;
+
+/* Headless check of the submission order of a command buffer: draws without
+ * depth test or recorded with strict order must keep their position with
+ * respect to all the other draws, while the other draws between them are
+ * sorted. */
+
+const int32_t n_draws = 48;
+
+int
+main(int argc, char* argv[]) {
+  Texture textures[2];
+  textures[0].create(4, 4);
+  textures[1].create(4, 4);
+
+  VertexBuffer_t vertices(3);
+  IndexBuffer_t indices;
+  indices.push_back(0); indices.push_back(1); indices.push_back(2);
+
+  /* perspective projection, the depth used for sorting is -z */
+  const double n = 0.1, f = 100.0;
+  Uniforms uniforms;
+  uniforms.view = Mat4x4::identity();
+  uniforms.projection = Mat4x4(
+    1.0, 0.0, 0.0, 0.0,
+    0.0, 1.0, 0.0, 0.0,
+    0.0, 0.0, -(f + n) / (f - n), -2.0 * f * n / (f - n),
+    0.0, 0.0, -1.0, 0.0);
+
+  /* draws are recorded from back to front with alternating textures, so
+   * that sorting them reorders almost every draw */
+  CommandBuffer commands;
+  commands.set_shaders(default_VS, default_FS);
+  std::vector<bool> is_barrier(n_draws, false);
+  for (int32_t i = 0; i < n_draws; i++) {
+    const bool no_depth_test = (i % 7 == 3);
+    const bool strict_order = (i % 11 == 5);
+    is_barrier[i] = no_depth_test || strict_order;
+    commands.enable_depth_test(!no_depth_test);
+    commands.enable_strict_order(strict_order);
+    uniforms.model = Mat4x4::identity();
+    uniforms.model.i34 = -double(n_draws - i);
+    uniforms.in_textures[0] = &textures[i % 2];
+    commands.draw(vertices, indices, uniforms);
+  }
+
+  std::vector<uint32_t> order;
+  commands.get_submit_order(order);
+  if (int32_t(order.size()) != n_draws) {
+    printf("[*] Error: %d draws submitted instead of %d.\n", int32_t(order.size()), n_draws);
+    return 1;
+  }
+  std::vector<int32_t> position(n_draws, -1);
+  for (int32_t i = 0; i < n_draws; i++) {
+    if (order[i] >= uint32_t(n_draws) || position[order[i]] >= 0) {
+      printf("[*] Error: the submit order is not a permutation of the draws.\n");
+      return 1;
+    }
+    position[order[i]] = i;
+  }
+  /* the barriers must stay in place, and the other draws must stay between
+   * the same barriers (same number of barriers before them) */
+  int32_t n_moved = 0, n_recorded_barriers = 0, n_submitted_barriers = 0;
+  std::vector<int32_t> segment(n_draws);
+  for (int32_t i = 0; i < n_draws; i++) {
+    segment[i] = n_recorded_barriers;
+    if (is_barrier[i]) n_recorded_barriers++;
+  }
+  for (int32_t i = 0; i < n_draws; i++) {
+    const uint32_t draw = order[i];
+    if (draw != uint32_t(i))
+      n_moved++;
+    if (is_barrier[draw] ? (draw != uint32_t(i)) : (segment[draw] != n_submitted_barriers)) {
+      printf("[*] Error: draw %d is submitted at position %d across a draw "
+        "without depth test or with strict order.\n", int32_t(draw), i);
+      return 1;
+    }
+    if (is_barrier[draw]) n_submitted_barriers++;
+  }
+  /* make sure the other draws were actually sorted */
+  if (n_moved == 0) {
+    printf("[*] Error: draws are never sorted.\n");
+    return 1;
+  }
+  printf("[*] Submit order: %d of %d draws moved, barriers kept, OK.\n", n_moved, n_draws);
+  return 0;
+}
@@ -0,0 +1,80 @@
+#include <stdio.h>
+
+#include "sgl_pipeline.h"
+
+using namespace sgl;
+
+/* Headless check: a ranged draw submitted to a WireframePipeline through a
+ * command buffer must draw the triangle edges only, never its interior. */
+
+int w = 64, h = 64;
+
+uint32_t
+read_pixel(const Texture& texture, int x, int y) {
+  return ((const uint32_t*)texture.pixels)[y * texture.w + x];
+}
+
+int
+main(int argc, char* argv[]) {
+  Texture color_texture, depth_texture, image_texture;
+  color_texture.create(w, h,
+    PixelFormat::pixel_format_RGBA8888,
+    TextureSampling::texture_sampling_point);
+  depth_texture.create(w, h,
+    PixelFormat::pixel_format_float32,
+    TextureSampling::texture_sampling_point);
+  image_texture.create(4, 4,
+    PixelFormat::pixel_format_RGBA8888,
+    TextureSampling::texture_sampling_point);
+  for (int32_t i = 0; i < 4 * 4; i++)
+    ((uint32_t*)image_texture.pixels)[i] = 0xffffffff;
+
+  Uniforms uniforms;
+  uniforms.model = Mat4x4::identity();
+  uniforms.view = Mat4x4::identity();
+  uniforms.projection = Mat4x4::identity();
+  uniforms.in_textures[0] = &image_texture;
+
+  /* a quad covering most of the viewport, the command only draws its first
+   * triangle (first_index = 0, index_count = 3) */
+  VertexBuffer_t vertices;
+  IndexBuffer_t indices;
+  Vertex v;
+  v.p = Vec3(-0.8, -0.8, 0.0); v.t = Vec2(0.0, 0.0); vertices.push_back(v);
+  v.p = Vec3( 0.8, -0.8, 0.0); v.t = Vec2(1.0, 0.0); vertices.push_back(v);
+  v.p = Vec3( 0.8,  0.8, 0.0); v.t = Vec2(1.0, 1.0); vertices.push_back(v);
+  v.p = Vec3(-0.8,  0.8, 0.0); v.t = Vec2(0.0, 1.0); vertices.push_back(v);
+  indices.push_back(0); indices.push_back(1); indices.push_back(2);
+  indices.push_back(0); indices.push_back(2); indices.push_back(3);
+
+  CommandBuffer commands;
+  commands.set_shaders(default_VS, default_FS);
+  commands.disable_backface_culling();
+  commands.draw(vertices, indices, 0, 3, 0, uniforms);
+
+  WireframePipeline pipeline;
+  pipeline.set_wireframe_color(Vec3(1.0, 1.0, 1.0));
+  pipeline.set_render_targets(&color_texture, &depth_texture);
+  pipeline.clear_render_targets(&color_texture, &depth_texture, Vec4(0.0, 0.0, 0.0, 1.0));
+  const uint32_t background = read_pixel(color_texture, 0, 0);
+  pipeline.submit(commands);
+
+  int32_t n_drawn = 0;
+  for (int32_t y = 0; y < h; y++)
+    for (int32_t x = 0; x < w; x++)
+      if (read_pixel(color_texture, x, y) != background)
+        n_drawn++;
+  /* centroids of the drawn triangle and of the other one (texture rows are
+   * stored from top to bottom) */
+  const bool inside_clear =
+    read_pixel(color_texture, w * 2 / 3, h * 2 / 3) == background &&
+    read_pixel(color_texture, w / 3, h / 3) == background;
+  /* lines only: three edges are a few hundred pixels at most */
+  if (n_drawn == 0 || n_drawn > 4 * (w + h) || !inside_clear) {
+    printf("[*] Error: wireframe submit of a ranged draw is not drawn as lines "
+      "(%d pixels drawn).\n", n_drawn);
+    return 1;
+  }
+  printf("[*] Wireframe submit of a ranged draw: %d pixels drawn, OK.\n", n_drawn);
+  return 0;
+}